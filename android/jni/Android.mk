@@ -42,7 +42,7 @@ LOCAL_MODULE := retro_ffmpeg
 LOCAL_ARM_MODE := arm
 LOCAL_CFLAGS += -std=gnu99 -Wall -DHAVE_OPENGLES2 -DGLES -DHAVE_OPENGLES3 -DHAVE_GL -DHAVE_GL_FFT
 LOCAL_LDLIBS := -llog -lz -lGLESv3 -lEGL
-LOCAL_SRC_FILES := ../../libretro.c ../../thread.c ../../fifo_buffer.c ../../glsym/glsym_es2.c ../../glsym/rglgen.c
+LOCAL_SRC_FILES := ../../libretro.c ../../thread.c ../../fifo_buffer.c ../../readahead.c ../../probe_cache.c ../../tonemap.c ../../glsym/glsym_es2.c ../../glsym/rglgen.c
 LOCAL_STATIC_LIBRARIES := glfft avformat avcodec avutil swscale swresample
 include $(BUILD_SHARED_LIBRARY)
 
@@ -0,0 +1,439 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "spectrum.h"
+#include "../thread.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define SPECTRUM_SSE 1
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define KAISER_BETA 12.0
+
+struct spectrum
+{
+   unsigned fft_size;
+   unsigned half_size;
+   unsigned width;
+   unsigned height;
+
+   // Main thread side.
+   int16_t *sliding;
+
+   // Handed over to the worker under lock.
+   int16_t *job;
+   bool pending;
+   bool dead;
+
+   // Worker side.
+   float *window;
+   float *re;
+   float *im;
+   float *twiddle_re;
+   float *twiddle_im;
+   float *split_re;
+   float *split_im;
+   unsigned *bitrev;
+   float *magnitude;
+   unsigned *column_bin;
+   uint32_t palette[256];
+
+   uint32_t *history;
+   unsigned history_ptr;
+
+   // Triple buffered output.
+   uint32_t *buffers[3];
+   unsigned display;
+   unsigned ready;
+   unsigned work;
+   bool fresh;
+
+   slock_t *lock;
+   scond_t *cond;
+   sthread_t *thread;
+};
+
+// Modified Bessel function of first order.
+// Same approximation as GLFFT.
+static double kaiser_besseli0(double x)
+{
+   double sum = 0.0;
+   double factorial = 1.0;
+   double factorial_mult = 0.0;
+   double x_pow = 1.0;
+   double two_div_pow = 1.0;
+   double x_sqr = x * x;
+
+   for (unsigned i = 0; i < 18; i++)
+   {
+      sum += x_pow * two_div_pow / (factorial * factorial);
+
+      factorial_mult += 1.0;
+      x_pow *= x_sqr;
+      two_div_pow *= 0.25;
+      factorial *= factorial_mult;
+   }
+
+   return sum;
+}
+
+static double kaiser_window(double index, double beta)
+{
+   return kaiser_besseli0(beta * sqrt(1 - index * index));
+}
+
+static unsigned bitinverse(unsigned x, unsigned bits)
+{
+   unsigned ret = 0;
+   for (unsigned i = 0; i < bits; i++)
+      ret |= ((x >> i) & 0x1) << (bits - 1 - i);
+   return ret;
+}
+
+static void spectrum_init_tables(spectrum_t *spec, unsigned fft_steps)
+{
+   unsigned n = spec->fft_size;
+   unsigned m = spec->half_size;
+
+   double window_mod = 1.0 / kaiser_window(0.0, KAISER_BETA);
+   for (unsigned i = 0; i < n; i++)
+   {
+      double phase = (double)((int)i - (int)n / 2) / ((int)n / 2);
+      spec->window[i] = kaiser_window(phase, KAISER_BETA) * window_mod / 0x8000;
+   }
+
+   // The real FFT is done as a complex FFT of half the size.
+   for (unsigned i = 0; i < m; i++)
+      spec->bitrev[i] = bitinverse(i, fft_steps - 1);
+
+   // Twiddles for each radix-2 stage, laid out contiguously so butterflies vectorize.
+   float *tw_re = spec->twiddle_re;
+   float *tw_im = spec->twiddle_im;
+   for (unsigned half = 1; half < m; half <<= 1)
+   {
+      for (unsigned k = 0; k < half; k++)
+      {
+         *tw_re++ = cos(-M_PI * k / half);
+         *tw_im++ = sin(-M_PI * k / half);
+      }
+   }
+
+   for (unsigned k = 0; k < m; k++)
+   {
+      spec->split_re[k] = cos(-2.0 * M_PI * k / n);
+      spec->split_im[k] = sin(-2.0 * M_PI * k / n);
+   }
+
+   // Log frequency axis from ~20 Hz (bin 1) up to Nyquist.
+   for (unsigned x = 0; x < spec->width; x++)
+   {
+      double bin = pow((double)(m - 1), (double)x / spec->width);
+      spec->column_bin[x] = (unsigned)bin;
+   }
+
+   for (unsigned i = 0; i < 256; i++)
+   {
+      float v = i / 255.0f;
+      unsigned r = 255.0f * fminf(1.0f, 3.0f * v);
+      unsigned g = 255.0f * fminf(1.0f, fmaxf(0.0f, 3.0f * v - 1.0f));
+      unsigned b = 255.0f * fminf(1.0f, fmaxf(0.0f, 3.0f * v - 2.0f) + 0.3f * v);
+      spec->palette[i] = (0xffu << 24) | (r << 16) | (g << 8) | b;
+   }
+}
+
+static void spectrum_butterflies(float *re, float *im,
+      const float *tw_re, const float *tw_im, unsigned half, unsigned size)
+{
+   for (unsigned i = 0; i < size; i += half << 1)
+   {
+      float *a_re = re + i;
+      float *a_im = im + i;
+      float *b_re = a_re + half;
+      float *b_im = a_im + half;
+      unsigned k = 0;
+
+#ifdef SPECTRUM_SSE
+      for (; k + 4 <= half; k += 4)
+      {
+         __m128 wr = _mm_loadu_ps(tw_re + k);
+         __m128 wi = _mm_loadu_ps(tw_im + k);
+         __m128 br = _mm_loadu_ps(b_re + k);
+         __m128 bi = _mm_loadu_ps(b_im + k);
+         __m128 ar = _mm_loadu_ps(a_re + k);
+         __m128 ai = _mm_loadu_ps(a_im + k);
+
+         __m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+         __m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+
+         _mm_storeu_ps(a_re + k, _mm_add_ps(ar, tr));
+         _mm_storeu_ps(a_im + k, _mm_add_ps(ai, ti));
+         _mm_storeu_ps(b_re + k, _mm_sub_ps(ar, tr));
+         _mm_storeu_ps(b_im + k, _mm_sub_ps(ai, ti));
+      }
+#endif
+
+      for (; k < half; k++)
+      {
+         float tr = b_re[k] * tw_re[k] - b_im[k] * tw_im[k];
+         float ti = b_re[k] * tw_im[k] + b_im[k] * tw_re[k];
+         b_re[k] = a_re[k] - tr;
+         b_im[k] = a_im[k] - ti;
+         a_re[k] += tr;
+         a_im[k] += ti;
+      }
+   }
+}
+
+static void spectrum_fft(spectrum_t *spec, const int16_t *samples)
+{
+   unsigned m = spec->half_size;
+   float *re = spec->re;
+   float *im = spec->im;
+
+   // Mono mix, windowed. Even samples go in the real part, odd in the imaginary part.
+   for (unsigned i = 0; i < m; i++)
+   {
+      unsigned j = spec->bitrev[i];
+      const int16_t *even = samples + 4 * j;
+      re[i] = 0.5f * (even[0] + even[1]) * spec->window[2 * j + 0];
+      im[i] = 0.5f * (even[2] + even[3]) * spec->window[2 * j + 1];
+   }
+
+   const float *tw_re = spec->twiddle_re;
+   const float *tw_im = spec->twiddle_im;
+   for (unsigned half = 1; half < m; half <<= 1)
+   {
+      spectrum_butterflies(re, im, tw_re, tw_im, half, m);
+      tw_re += half;
+      tw_im += half;
+   }
+
+   // Split into the spectrum of the real input.
+   for (unsigned k = 0; k < m; k++)
+   {
+      unsigned nk = (m - k) & (m - 1);
+      float zr = re[k], zi = im[k];
+      float cr = re[nk], ci = -im[nk];
+
+      float er = 0.5f * (zr + cr);
+      float ei = 0.5f * (zi + ci);
+      float or_ = 0.5f * (zi - ci);
+      float oi = -0.5f * (zr - cr);
+
+      float xr = er + or_ * spec->split_re[k] - oi * spec->split_im[k];
+      float xi = ei + or_ * spec->split_im[k] + oi * spec->split_re[k];
+      spec->magnitude[k] = xr * xr + xi * xi;
+   }
+}
+
+static void spectrum_draw(spectrum_t *spec)
+{
+   uint32_t *row = spec->history + spec->history_ptr * spec->width;
+   for (unsigned x = 0; x < spec->width; x++)
+   {
+      // Same dB mapping as GLFFT's resolve pass.
+      float height = 9.0f * logf(spec->magnitude[spec->column_bin[x]] + 0.0001f) - 22.0f;
+      int v = (int)((height + 40.0f) * (255.0f / 80.0f));
+      if (v < 0)
+         v = 0;
+      else if (v > 255)
+         v = 255;
+      row[x] = spec->palette[v];
+   }
+
+   // Oldest row at the top.
+   spec->history_ptr = (spec->history_ptr + 1) % spec->height;
+
+   uint32_t *out = spec->buffers[spec->work];
+   size_t stride = spec->width * sizeof(uint32_t);
+   unsigned first_rows = spec->height - spec->history_ptr;
+   memcpy(out, spec->history + spec->history_ptr * spec->width, first_rows * stride);
+   memcpy(out + first_rows * spec->width, spec->history, spec->history_ptr * stride);
+}
+
+static void spectrum_thread(void *data)
+{
+   spectrum_t *spec = (spectrum_t*)data;
+   int16_t *samples = (int16_t*)malloc(2 * spec->fft_size * sizeof(int16_t));
+   if (!samples)
+      return;
+
+   slock_lock(spec->lock);
+   for (;;)
+   {
+      while (!spec->pending && !spec->dead)
+         scond_wait(spec->cond, spec->lock);
+      if (spec->dead)
+         break;
+
+      memcpy(samples, spec->job, 2 * spec->fft_size * sizeof(int16_t));
+      spec->pending = false;
+      slock_unlock(spec->lock);
+
+      spectrum_fft(spec, samples);
+      spectrum_draw(spec);
+
+      slock_lock(spec->lock);
+      unsigned tmp = spec->ready;
+      spec->ready = spec->work;
+      spec->work = tmp;
+      spec->fresh = true;
+   }
+   slock_unlock(spec->lock);
+
+   free(samples);
+}
+
+spectrum_t *spectrum_new(unsigned fft_steps, unsigned width, unsigned height)
+{
+   if (!width || !height || fft_steps < 4)
+      return NULL;
+
+   spectrum_t *spec = (spectrum_t*)calloc(1, sizeof(*spec));
+   if (!spec)
+      return NULL;
+
+   spec->fft_size = 1 << fft_steps;
+   spec->half_size = spec->fft_size / 2;
+   spec->width = width;
+   spec->height = height;
+
+   spec->sliding = (int16_t*)calloc(2 * spec->fft_size, sizeof(int16_t));
+   spec->job = (int16_t*)calloc(2 * spec->fft_size, sizeof(int16_t));
+   spec->window = (float*)calloc(spec->fft_size, sizeof(float));
+   spec->re = (float*)calloc(spec->half_size, sizeof(float));
+   spec->im = (float*)calloc(spec->half_size, sizeof(float));
+   spec->twiddle_re = (float*)calloc(spec->half_size, sizeof(float));
+   spec->twiddle_im = (float*)calloc(spec->half_size, sizeof(float));
+   spec->split_re = (float*)calloc(spec->half_size, sizeof(float));
+   spec->split_im = (float*)calloc(spec->half_size, sizeof(float));
+   spec->bitrev = (unsigned*)calloc(spec->half_size, sizeof(unsigned));
+   spec->magnitude = (float*)calloc(spec->half_size, sizeof(float));
+   spec->column_bin = (unsigned*)calloc(width, sizeof(unsigned));
+   spec->history = (uint32_t*)calloc(width * height, sizeof(uint32_t));
+   for (unsigned i = 0; i < 3; i++)
+      spec->buffers[i] = (uint32_t*)calloc(width * height, sizeof(uint32_t));
+
+   spec->display = 0;
+   spec->ready = 1;
+   spec->work = 2;
+
+   spec->lock = slock_new();
+   spec->cond = scond_new();
+
+   if (!spec->sliding || !spec->job || !spec->window || !spec->re || !spec->im ||
+         !spec->twiddle_re || !spec->twiddle_im || !spec->split_re || !spec->split_im ||
+         !spec->bitrev || !spec->magnitude || !spec->column_bin || !spec->history ||
+         !spec->buffers[0] || !spec->buffers[1] || !spec->buffers[2] ||
+         !spec->lock || !spec->cond)
+      goto error;
+
+   spectrum_init_tables(spec, fft_steps);
+
+   spec->thread = sthread_create(spectrum_thread, spec);
+   if (!spec->thread)
+      goto error;
+
+   return spec;
+
+error:
+   spectrum_free(spec);
+   return NULL;
+}
+
+void spectrum_free(spectrum_t *spec)
+{
+   if (!spec)
+      return;
+
+   if (spec->thread)
+   {
+      slock_lock(spec->lock);
+      spec->dead = true;
+      scond_signal(spec->cond);
+      slock_unlock(spec->lock);
+      sthread_join(spec->thread);
+   }
+
+   if (spec->lock)
+      slock_free(spec->lock);
+   if (spec->cond)
+      scond_free(spec->cond);
+
+   free(spec->sliding);
+   free(spec->job);
+   free(spec->window);
+   free(spec->re);
+   free(spec->im);
+   free(spec->twiddle_re);
+   free(spec->twiddle_im);
+   free(spec->split_re);
+   free(spec->split_im);
+   free(spec->bitrev);
+   free(spec->magnitude);
+   free(spec->column_bin);
+   free(spec->history);
+   for (unsigned i = 0; i < 3; i++)
+      free(spec->buffers[i]);
+   free(spec);
+}
+
+void spectrum_step(spectrum_t *spec, const int16_t *buffer, unsigned frames)
+{
+   unsigned size = 2 * spec->fft_size;
+   if (frames > spec->fft_size)
+   {
+      buffer += 2 * (frames - spec->fft_size);
+      frames = spec->fft_size;
+   }
+
+   int16_t *slide = spec->sliding;
+   memmove(slide, slide + frames * 2, (size - 2 * frames) * sizeof(int16_t));
+   memcpy(slide + size - frames * 2, buffer, 2 * frames * sizeof(int16_t));
+
+   // If the worker is still busy, this simply replaces the queued job.
+   slock_lock(spec->lock);
+   memcpy(spec->job, slide, size * sizeof(int16_t));
+   spec->pending = true;
+   scond_signal(spec->cond);
+   slock_unlock(spec->lock);
+}
+
+const uint32_t *spectrum_render(spectrum_t *spec)
+{
+   slock_lock(spec->lock);
+   if (spec->fresh)
+   {
+      unsigned tmp = spec->display;
+      spec->display = spec->ready;
+      spec->ready = tmp;
+      spec->fresh = false;
+   }
+   const uint32_t *ret = spec->buffers[spec->display];
+   slock_unlock(spec->lock);
+
+   return ret;
+}
+
@@ -0,0 +1,44 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPECTRUM_H__
+#define SPECTRUM_H__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Software counterpart to GLFFT for builds without GL.
+// Renders a scrolling spectrogram of the audio into an XRGB8888 buffer on a worker thread.
+typedef struct spectrum spectrum_t;
+
+spectrum_t *spectrum_new(unsigned fft_steps, unsigned width, unsigned height);
+void spectrum_free(spectrum_t *spec);
+
+// Pushes interleaved stereo audio into the sliding window and kicks off rendering.
+void spectrum_step(spectrum_t *spec, const int16_t *buffer, unsigned frames);
+
+// Latest completed frame, width * height pixels, tightly packed.
+// Valid until the next call to spectrum_render().
+const uint32_t *spectrum_render(spectrum_t *spec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -22,6 +22,9 @@ struct fifo_buffer
    size_t bufsize;
    size_t first;
    size_t end;
+   // Bytes behind first which are kept intact for fifo_unread().
+   size_t history;
+   size_t history_size;
 };
 
 fifo_buffer_t *fifo_new(size_t size)
@@ -44,6 +47,25 @@ fifo_buffer_t *fifo_new(size_t size)
 void fifo_clear(fifo_buffer_t *buffer)
 {
    buffer->first = buffer->end = 0;
+   buffer->history = 0;
+}
+
+void fifo_set_history(fifo_buffer_t *buffer, size_t size)
+{
+   buffer->history_size = size;
+   if (buffer->history > size)
+      buffer->history = size;
+}
+
+size_t fifo_history_avail(fifo_buffer_t *buffer)
+{
+   return buffer->history;
+}
+
+void fifo_unread(fifo_buffer_t *buffer, size_t size)
+{
+   buffer->first = (buffer->first + buffer->bufsize - size) % buffer->bufsize;
+   buffer->history -= size;
 }
 
 void fifo_free(fifo_buffer_t *buffer)
@@ -68,7 +90,7 @@ size_t fifo_write_avail(fifo_buffer_t *buffer)
    if (end < first)
       end += buffer->bufsize;
 
-   return (buffer->bufsize - 1) - (end - first);
+   return (buffer->bufsize - 1) - (end - first) - buffer->history;
 }
 
 void fifo_write(fifo_buffer_t *buffer, const void *in_buf, size_t size)
@@ -102,5 +124,9 @@ void fifo_read(fifo_buffer_t *buffer, void *in_buf, size_t size)
    memcpy((uint8_t*)in_buf + first_read, buffer->buffer, rest_read);
 
    buffer->first = (buffer->first + size) % buffer->bufsize;
+
+   buffer->history += size;
+   if (buffer->history > buffer->history_size)
+      buffer->history = buffer->history_size;
 }
 
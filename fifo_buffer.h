@@ -33,4 +33,10 @@ void fifo_free(fifo_buffer_t *buffer);
 size_t fifo_read_avail(fifo_buffer_t *buffer);
 size_t fifo_write_avail(fifo_buffer_t *buffer);
 
+// Keeps up to size bytes of already read data around, at the cost of as much write space.
+void fifo_set_history(fifo_buffer_t *buffer, size_t size);
+size_t fifo_history_avail(fifo_buffer_t *buffer);
+// Puts back size bytes of history, which must not exceed fifo_history_avail().
+void fifo_unread(fifo_buffer_t *buffer, size_t size);
+
 #endif
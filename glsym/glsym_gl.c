@@ -1008,6 +1008,7 @@ const struct rglgen_sym_map rglgen_symbol_map[] = {
     SYM(ClearDepthfOES),
     SYM(GetClipPlanefOES),
     SYM(QueryMatrixxOES),
+    SYM(BufferStorage),
 
     { NULL, NULL },
 };
@@ -2017,4 +2018,5 @@ RGLSYMGLCLIPPLANEFOESPROC __rglgen_glClipPlanefOES;
 RGLSYMGLCLEARDEPTHFOESPROC __rglgen_glClearDepthfOES;
 RGLSYMGLGETCLIPPLANEFOESPROC __rglgen_glGetClipPlanefOES;
 RGLSYMGLQUERYMATRIXXOESPROC __rglgen_glQueryMatrixxOES;
+RGLSYMGLBUFFERSTORAGEPROC __rglgen_glBufferStorage;
 
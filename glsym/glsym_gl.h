@@ -1031,6 +1031,7 @@ typedef void (APIENTRYP RGLSYMGLCLIPPLANEFOESPROC) (GLenum plane, const GLfloat
 typedef void (APIENTRYP RGLSYMGLCLEARDEPTHFOESPROC) (GLclampf depth);
 typedef void (APIENTRYP RGLSYMGLGETCLIPPLANEFOESPROC) (GLenum plane, GLfloat *equation);
 typedef GLbitfield (APIENTRYP RGLSYMGLQUERYMATRIXXOESPROC) (GLfixed *mantissa, GLint *exponent);
+typedef void (APIENTRYP RGLSYMGLBUFFERSTORAGEPROC) (GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
 
 #define glBlendColor __rglgen_glBlendColor
 #define glBlendEquation __rglgen_glBlendEquation
@@ -2028,6 +2029,7 @@ typedef GLbitfield (APIENTRYP RGLSYMGLQUERYMATRIXXOESPROC) (GLfixed *mantissa, G
 #define glClearDepthfOES __rglgen_glClearDepthfOES
 #define glGetClipPlanefOES __rglgen_glGetClipPlanefOES
 #define glQueryMatrixxOES __rglgen_glQueryMatrixxOES
+#define glBufferStorage __rglgen_glBufferStorage
 
 extern RGLSYMGLBLENDCOLORPROC __rglgen_glBlendColor;
 extern RGLSYMGLBLENDEQUATIONPROC __rglgen_glBlendEquation;
@@ -3035,6 +3037,7 @@ extern RGLSYMGLCLIPPLANEFOESPROC __rglgen_glClipPlanefOES;
 extern RGLSYMGLCLEARDEPTHFOESPROC __rglgen_glClearDepthfOES;
 extern RGLSYMGLGETCLIPPLANEFOESPROC __rglgen_glGetClipPlanefOES;
 extern RGLSYMGLQUERYMATRIXXOESPROC __rglgen_glQueryMatrixxOES;
+extern RGLSYMGLBUFFERSTORAGEPROC __rglgen_glBufferStorage;
 
 struct rglgen_sym_map { const char *sym; void *ptr; };
 extern const struct rglgen_sym_map rglgen_symbol_map[];
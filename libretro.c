@@ -1,6 +1,9 @@
 #include "libretro.h"
 #include "thread.h"
 #include "fifo_buffer.h"
+#include "readahead.h"
+#include "probe_cache.h"
+#include "tonemap.h"
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,6 +11,8 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <math.h>
 
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -16,6 +21,13 @@
 #include <libavutil/opt.h>
 #include <libavdevice/avdevice.h>
 #include <libswresample/swresample.h>
+#include <libavutil/cpu.h>
+#include <libavutil/avstring.h>
+#ifdef HAVE_FILTERS
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+#endif
 #ifdef HAVE_SSA
 #include <ass/ass.h>
 #endif
@@ -24,8 +36,51 @@
 #include "fft/fft.h"
 #endif
 
+#ifdef HAVE_CPU_FFT
+#include "fft/spectrum.h"
+#endif
+
+#ifdef HAVE_MOTION_INTERP
+#include "motion_interp.h"
+#endif
+
 #ifdef HAVE_GL
 #include "glsym/glsym.h"
+
+#if !defined(GLES) || defined(HAVE_OPENGLES3)
+#define HAVE_PBO_UPLOAD
+#endif
+
+// Decoding straight into mapped buffers needs persistent mapping.
+#if defined(HAVE_PBO_UPLOAD) && !defined(GLES)
+#define HAVE_DIRECT_UPLOAD
+#endif
+
+// Subtitles as an instanced overlay, needs single channel textures and instancing.
+#if defined(HAVE_SSA) && (!defined(GLES) || defined(HAVE_OPENGLES3))
+#define HAVE_SUBTITLE_OVERLAY
+#endif
+
+#ifdef GLES
+// Get format as GL_RGBA/GL_UNSIGNED_BYTE, the shader swizzles.
+#define UPLOAD_FORMAT GL_RGBA
+#define UPLOAD_TYPE GL_UNSIGNED_BYTE
+#else
+#define UPLOAD_FORMAT GL_BGRA
+#define UPLOAD_TYPE GL_UNSIGNED_INT_8_8_8_8_REV
+#endif
+
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_TEXTURE_SRGB_DECODE_EXT
+#define GL_TEXTURE_SRGB_DECODE_EXT 0x8A48
+#define GL_DECODE_EXT 0x8A49
+#define GL_SKIP_DECODE_EXT 0x8A4A
+#endif
 #endif
 
 static void fallback_log(enum retro_log_level level, const char *fmt, ...)
@@ -56,6 +111,66 @@ static int video_stream;
 
 static enum AVColorSpace colorspace;
 
+enum scaler_profile
+{
+   SCALER_AUTO = 0,
+   SCALER_FAST,
+   SCALER_BALANCED,
+   SCALER_QUALITY,
+};
+static enum scaler_profile scaler_profile = SCALER_BALANCED;
+// Auto picks the best profile whose conversion fits in this share of a source frame interval.
+#define SCALER_BUDGET_FRACTION 0.25
+#define SCALER_BENCHMARK_RUNS 3
+
+#ifdef HAVE_FILTERS
+// libavfilter graph between decoding and conversion, NULL to pass pictures straight through.
+static const char *video_filter;
+
+static const struct
+{
+   const char *name;
+   const char *graph;
+} video_filter_presets[] = {
+   // Outputs one picture per field, so interlaced material keeps its full motion.
+   { "deinterlace", "yadif=mode=send_field:deint=interlaced" },
+   { "deinterlace (bwdif)", "bwdif=mode=send_field:deint=interlaced" },
+   { "deinterlace (half rate)", "yadif=mode=send_frame:deint=interlaced" },
+   { "denoise", "hqdn3d" },
+   { "deinterlace + denoise", "yadif=mode=send_field:deint=interlaced,hqdn3d" },
+};
+
+// Decoded pictures queued for the filter thread.
+#define FILTER_QUEUE_SIZE 8
+static struct
+{
+   AVFrame *queue[FILTER_QUEUE_SIZE];
+   unsigned read_ptr;
+   unsigned count;
+   // No more pictures are coming.
+   bool eof;
+   // Graph state must be reset before the next picture.
+   bool flush;
+   // A picture is being filtered and output.
+   bool busy;
+
+   slock_t *lock;
+   scond_t *cond;
+   sthread_t *thread;
+} filter;
+#endif
+
+// Background read-ahead between the file and the demuxer.
+#define READAHEAD_AVIO_SIZE (64 * 1024)
+static size_t readahead_window;
+static readahead_t *readahead;
+static AVIOContext *readahead_avio;
+
+// Stream probing limits, 0 means FFmpeg defaults.
+static unsigned probe_size;
+static unsigned probe_duration;
+static bool probe_cache;
+
 #define MAX_STREAMS 8
 static AVCodecContext *actx[MAX_STREAMS];
 static AVCodecContext *sctx[MAX_STREAMS];
@@ -66,6 +181,24 @@ static int subtitle_streams[MAX_STREAMS];
 static int subtitle_streams_num;
 static int subtitle_streams_ptr;
 
+// Only the initially selected tracks are opened at load.
+// The rest are opened on first use by the decode thread, or prewarmed
+// in the background once the first frame has been presented.
+static bool actx_failed[MAX_STREAMS];
+static bool sctx_failed[MAX_STREAMS];
+static slock_t *codec_open_lock;
+static sthread_t *codec_prewarm_handle;
+static volatile bool codec_prewarm_dead;
+static void codec_prewarm_thread(void *data);
+
+static int64_t load_start_time;
+static bool first_frame_presented;
+static unsigned first_frame_runs;
+static bool fast_start;
+
+// 0 means the native rate of the first audio track.
+static unsigned output_sample_rate;
+
 // AAS/SSA subtitles.
 #ifdef HAVE_SSA
 static ASS_Library *ass;
@@ -73,78 +206,372 @@ static ASS_Renderer *ass_render;
 static ASS_Track *ass_track[MAX_STREAMS];
 static uint8_t *ass_extra_data[MAX_STREAMS];
 static size_t ass_extra_data_size[MAX_STREAMS];
+
+// Tracks are set up during load, fonts on ass_init_handle while the decode thread is already running.
+// Nothing is rendered before ass_fonts_ready. Both are signalled on ass_ready_cond.
+static sthread_t *ass_init_handle;
+static scond_t *ass_ready_cond;
+static bool ass_ready;
+static bool ass_fonts_ready;
+static char ass_font_config[1024];
+
+// libass tracks are fed by the decode thread and rendered by the subtitle thread.
+static slock_t *ass_lock;
+
+// Every SSA track is demuxed into a lightweight event store, inactive ones included,
+// so switching tracks shows its events right away. A libass track is rebuilt from
+// its store when it missed events while inactive. Protected by ass_lock.
+struct subtitle_event
+{
+   int64_t start;
+   size_t text;
+   size_t text_len;
+};
+
+static struct subtitle_events
+{
+   // Sorted by start.
+   struct subtitle_event *events;
+   size_t count;
+   size_t cap;
+   char *text;
+   size_t text_size;
+   size_t text_cap;
+   // All events are in the libass track.
+   bool synced;
+} sub_events[MAX_STREAMS];
+
+// Bitmap tracks keep their last decoded events instead, and expand an event's palette
+// once when it's first shown. An event lasts until the next one starts. Protected by ass_lock.
+#define BITMAP_EVENTS_MAX 32
+static bool subtitle_is_bitmap[MAX_STREAMS];
+
+struct bitmap_event
+{
+   int64_t start;
+   int64_t end;
+   // Size rects are positioned in, 0 if unknown.
+   unsigned canvas_width;
+   unsigned canvas_height;
+   AVSubtitle sub;
+   bool expanded;
+   // NULL if there is nothing to show.
+   struct subtitle_images *images;
+};
+
+static struct
+{
+   // Sorted by start.
+   struct bitmap_event events[BITMAP_EVENTS_MAX];
+   unsigned count;
+} bitmap_events[MAX_STREAMS];
+
+// Subtitles are rasterized on their own thread ahead of the video, into a cache keyed
+// by timestamp in ms. Entries share image data while libass reports no change.
+#define SUBTITLE_CACHE_SIZE 64
+#define SUBTITLE_PENDING_SIZE 16
+// Frames predicted past the last requested timestamp.
+#define SUBTITLE_LOOKAHEAD 8
+#define SUBTITLE_TIME_TOLERANCE 2
+
+// Premultiplied XRGB8888 at output size.
+struct subtitle_bitmap
+{
+   int x, y;
+   int w, h;
+   const uint32_t *pixels;
+};
+
+struct subtitle_images
+{
+   unsigned refs;
+   // Changes whenever the images do.
+   unsigned serial;
+   ASS_Image *head;
+   struct subtitle_bitmap *bitmaps;
+   unsigned bitmaps_count;
+};
+
+struct subtitle_entry
+{
+   int64_t time;
+   // NULL if there is nothing to show.
+   struct subtitle_images *images;
+};
+
+static struct
+{
+   struct subtitle_entry cache[SUBTITLE_CACHE_SIZE];
+   unsigned cache_count;
+   int64_t pending[SUBTITLE_PENDING_SIZE];
+   unsigned pending_count;
+   int64_t last_request;
+   double interval;
+   // Bumped when events change, renders started before are thrown away.
+   unsigned generation;
+   unsigned serial;
+   bool dead;
+
+   slock_t *lock;
+   scond_t *cond;
+   sthread_t *thread;
+} sub_cache;
 #endif
 
+// Font attachments, pointing into the stream extradata.
+// They are only handed to libass once a style or event asks for the font.
 struct attachment
 {
-   uint8_t *data;
+   const uint8_t *data;
    size_t size;
+   bool loaded;
 };
 static struct attachment *attachments;
 static size_t attachments_size;
 
 #ifdef HAVE_GL_FFT
 static glfft_t *fft;
+unsigned fft_multisample;
+#endif
+
+#ifdef HAVE_CPU_FFT
+static spectrum_t *spectrum;
+#endif
+
+#if defined(HAVE_GL_FFT) || defined(HAVE_CPU_FFT)
 unsigned fft_width;
 unsigned fft_height;
-unsigned fft_multisample;
 #endif
 
 // A/V timing.
-static uint64_t frame_cnt;
+// play_time is the presentation clock in seconds. It advances by the real frame time
+// when the frontend provides it, and by 1 / interpolate_fps otherwise.
+static double play_time;
 static uint64_t audio_frames;
 static double pts_bias;
+static retro_usec_t frame_time_usec;
+// Longer frame times (e.g. after the frontend paused) are clamped.
+#define MAX_FRAME_TIME_FRAMES 4
+#define MAX_AUDIO_PUSH_FRAMES 8192
+
+// Small A/V drift is corrected by stretching audio in the resampler
+// rather than by moving pts_bias, which makes video hitch.
+#define AUDIO_DRIFT_RESYNC 0.25
+#define AUDIO_DRIFT_TIME 2.0
+#define AUDIO_DRIFT_SMOOTHING 0.05
+#define AUDIO_MAX_SKEW 0.005
+static bool audio_clock_valid;
+static double audio_drift;
+// Extra output samples per second of output, applied by the decode thread.
+static int audio_drift_delta;
+
+// With the audio callback, the frontend's audio thread pulls straight from the
+// decode FIFO and video follows the audio clock. retro_run() still pushes audio
+// whenever the frontend has the callback disabled.
+#define AUDIO_CALLBACK_FRAMES 512
+static bool use_audio_callback;
+static bool audio_callback_registered;
+static bool audio_callback_enabled;
+static bool audio_callback_in_use;
+static bool audio_callback_pts_valid;
+static double audio_callback_pts;
+// If retro_run() stalls for longer than this, the decoder drops video to keep audio going.
+#define AUDIO_CALLBACK_STALL 100000
+static int64_t main_run_time;
+
+// Audio FIFOs only grow beyond the minimum for files which interleave
+// audio far ahead of video.
+#define AUDIO_FIFO_MIN_SECONDS 0.25
+#define AUDIO_FIFO_MAX_SECONDS 20.0
+
+// Recently consumed audio and pictures stay in the FIFOs, so rewind and runahead,
+// which restore a state a few frames back all the time, don't have to seek.
+#define AUDIO_HISTORY_SECONDS 1.0
+#define VIDEO_HISTORY_ENTRIES 8
+static uint64_t video_entries_read;
+// Bumped whenever audio_frames/video_entries_read stop lining up with the FIFO history.
+static unsigned playback_epoch;
 
 // Threaded FIFOs.
 static volatile bool decode_thread_dead;
 static fifo_buffer_t *video_decode_fifo;
-static fifo_buffer_t *audio_decode_fifo;
+// With decode_all_audio, every audio track is decoded into its own FIFO
+// so switching tracks is instant. Otherwise only index 0 is used.
+static fifo_buffer_t *audio_decode_fifo[MAX_STREAMS];
 static scond_t *fifo_cond;
 static scond_t *fifo_decode_cond;
 static slock_t *fifo_lock;
 static slock_t *decode_thread_lock;
 static sthread_t *decode_thread_handle;
 static double decode_last_video_time;
-static double decode_last_audio_time;
-
-static uint32_t *video_frame_temp_buffer;
+static double decode_last_audio_time[MAX_STREAMS];
+static int decode_audio_drift_delta[MAX_STREAMS];
+// swr drops the compensation after its distance, so it's re-armed once these output samples are used up.
+static int64_t decode_audio_compensation_left[MAX_STREAMS];
+static bool decode_all_audio;
+
+static void *video_frame_temp_buffer;
+
+// Pictures larger than this are scaled down at decode time, so
+// the FIFO, subtitle blending and upload only handle the reduced size.
+static unsigned max_output_width;
+static unsigned max_output_height;
+
+// Software output format. RGB565 halves the size of every frame copy.
+// With dithering, sws still outputs RGB32 and rows are dithered down while
+// being written to the FIFO.
+static bool rgb565_output;
+static bool rgb565_dither;
+static enum AVPixelFormat conv_pix_fmt = AV_PIX_FMT_RGB32;
+static size_t video_pixel_size = sizeof(uint32_t);
 
 static bool main_sleeping;
 
 // Seeking.
 static bool do_seek;
 static double seek_time;
+// Bumped by every queue_seek(), so the decode thread notices seeks queued while it was seeking.
+static unsigned seek_serial;
+
+// Save states. Positions within the FIFO history are restored from memory, anything else seeks.
+#define SERIALIZE_VERSION 3
+struct serialized_state
+{
+   uint32_t version;
+   int32_t audio_streams_ptr;
+   int32_t subtitle_streams_ptr;
+   int32_t colorspace;
+   double play_time;
+   uint64_t audio_frames;
+   double pts_bias;
+   // Only meaningful within the session and epoch they were saved in.
+   int64_t session;
+   uint32_t epoch;
+   uint64_t video_entries;
+};
 
 // GL stuff
 struct frame
 {
 #if defined(HAVE_GL)
    GLuint tex;
-#if !defined(GLES)
-   GLuint pbo;
-#endif
+   bool srgb_decode;
+#elif defined(HAVE_MOTION_INTERP)
+   // Only allocated while interpolating.
+   uint32_t *pixels;
 #endif
    double pts;
 };
 
 static struct frame frames[2];
 
+#ifdef HAVE_MOTION_INTERP
+// Software counterpart to temporal interpolation. The last two decoded pictures
+// are kept in frames[] and pictures in between are synthesized along block motion.
+// Frames further apart than this (i.e. across a seek) are not interpolated.
+#define MOTION_INTERP_MAX_GAP 0.25
+static bool use_motion_interp;
+static motion_interp_t *motion_interp;
+static bool motion_interp_valid;
+static uint32_t *motion_interp_output;
+static const void *motion_interp_shown;
+#endif
+
 #ifdef HAVE_GL
 static bool temporal_interpolation;
 static struct retro_hw_render_callback hw_render;
 static GLuint prog;
+// Shows a single frame, used when there is nothing to blend.
+static GLuint copy_prog;
 static GLuint vbo;
 static GLint vertex_loc;
 static GLint tex_loc;
 static GLint mix_loc;
+
+// Blending happens in linear light. With sRGB textures the texture unit
+// linearizes, and an sRGB framebuffer encodes the result again.
+static bool srgb_textures;
+static bool srgb_framebuffer;
+// EXT_texture_sRGB_decode, lets copy_prog read sRGB textures as is.
+static bool srgb_skip_decode;
+#endif
+
+#ifdef HAVE_SUBTITLE_OVERLAY
+// Subtitle images are packed into an atlas and drawn as instanced quads after the video,
+// so the decode thread never blends subtitles into frames.
+// Without instancing support, subtitles are blended on the CPU as before.
+#define OVERLAY_INSTANCE_FLOATS 12
+#define OVERLAY_ATLAS_ALIGN 256
+static bool subtitle_overlay;
+static GLuint overlay_prog;
+static GLuint overlay_atlas;
+static GLuint overlay_instance_vbo;
+static unsigned overlay_atlas_height;
+// Holds bitmap subtitles rather than libass masks.
+static bool overlay_atlas_rgba;
+static GLint overlay_bitmap_uniform;
+static unsigned overlay_instances;
+static uint8_t *overlay_staging;
+static size_t overlay_staging_size;
+static GLfloat *overlay_instance_data;
+static unsigned overlay_instance_cap;
+static unsigned overlay_serial;
+#endif
+
+#ifdef HAVE_PBO_UPLOAD
+// Frames are uploaded through a ring of PBOs. With buffer storage they stay
+// persistently mapped and fences guard reuse, otherwise every upload orphans its buffer.
+#define UPLOAD_RING_SIZE 3
+#define UPLOAD_FENCE_TIMEOUT 100000000
+struct upload_buffer
+{
+   GLuint pbo;
+   void *ptr;
+   GLsync fence;
+};
+static struct upload_buffer upload_ring[UPLOAD_RING_SIZE];
+static unsigned upload_ring_index;
+static bool upload_persistent;
+#endif
+
+#ifdef HAVE_DIRECT_UPLOAD
+// With direct upload, the decode thread scales into a pool of persistently mapped PBOs
+// and the video FIFO carries slot indices instead of pixels.
+// The pool only exists while there is a context, so the FIFO format follows direct_upload_active.
+// Everything but the mapped memory is guarded by fifo_lock.
+#define DIRECT_UPLOAD_SLOTS 8
+enum direct_slot_state
+{
+   DIRECT_SLOT_FREE = 0,
+   DIRECT_SLOT_WRITING,
+   DIRECT_SLOT_QUEUED,
+   DIRECT_SLOT_UPLOADING
+};
+
+struct direct_slot
+{
+   GLuint pbo;
+   void *ptr;
+   GLsync fence;
+   enum direct_slot_state state;
+};
+static struct direct_slot direct_slots[DIRECT_UPLOAD_SLOTS];
+static bool use_direct_upload;
+static bool direct_upload_active;
+// Bumped whenever the pool comes or goes, so the decode thread can tell its picture went stale.
+static unsigned direct_upload_generation;
 #endif
 
 ////
 
 static struct
 {
+   // Output size, possibly capped by max_output_width/height.
    unsigned width;
    unsigned height;
+   // Size of decoded pictures.
+   unsigned src_width;
+   unsigned src_height;
 
    double interpolate_fps;
    unsigned sample_rate;
@@ -165,13 +592,176 @@ static void append_attachment(const uint8_t *data, size_t size)
 {
    attachments = av_realloc(attachments, (attachments_size + 1) * sizeof(*attachments));
 
-   attachments[attachments_size].data = av_malloc(size);
+   attachments[attachments_size].data = data;
    attachments[attachments_size].size = size;
-   memcpy(attachments[attachments_size].data, data, size);
+   attachments[attachments_size].loaded = false;
 
    attachments_size++;
 }
 
+#ifdef HAVE_SSA
+static unsigned read_be16(const uint8_t *p)
+{
+   return (p[0] << 8) | p[1];
+}
+
+static uint32_t read_be32(const uint8_t *p)
+{
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Name table strings are UTF-16BE on the Unicode and Windows platforms, else 8-bit.
+static void decode_font_name(const uint8_t *str, size_t len, bool utf16, char *out, size_t size)
+{
+   size_t pos = 0;
+   if (utf16)
+   {
+      for (size_t i = 0; i + 1 < len && pos + 4 < size; i += 2)
+      {
+         unsigned c = read_be16(str + i);
+         if (c < 0x80)
+            out[pos++] = c;
+         else if (c < 0x800)
+         {
+            out[pos++] = 0xc0 | (c >> 6);
+            out[pos++] = 0x80 | (c & 0x3f);
+         }
+         else if (c < 0xd800 || c >= 0xe000)
+         {
+            out[pos++] = 0xe0 | (c >> 12);
+            out[pos++] = 0x80 | ((c >> 6) & 0x3f);
+            out[pos++] = 0x80 | (c & 0x3f);
+         }
+      }
+   }
+   else
+   {
+      for (size_t i = 0; i < len && pos + 1 < size; i++)
+         out[pos++] = str[i];
+   }
+   out[pos] = '\0';
+}
+
+// Looks for name among the family and full names of the font at offset.
+// Returns -1 if the font can't be parsed.
+static int sfnt_has_name(const uint8_t *data, size_t size, size_t offset, const char *name)
+{
+   if (offset > size || size - offset < 12)
+      return -1;
+
+   unsigned num_tables = read_be16(data + offset + 4);
+   if ((size - offset - 12) / 16 < num_tables)
+      return -1;
+
+   for (unsigned i = 0; i < num_tables; i++)
+   {
+      const uint8_t *rec = data + offset + 12 + i * 16;
+      if (memcmp(rec, "name", 4))
+         continue;
+
+      size_t table = read_be32(rec + 8);
+      size_t len = read_be32(rec + 12);
+      if (table > size || len > size - table || len < 6)
+         return -1;
+
+      const uint8_t *names = data + table;
+      unsigned count = read_be16(names + 2);
+      size_t strings = read_be16(names + 4);
+      if ((len - 6) / 12 < count)
+         return -1;
+
+      for (unsigned j = 0; j < count; j++)
+      {
+         const uint8_t *r = names + 6 + j * 12;
+         unsigned platform = read_be16(r);
+         unsigned name_id = read_be16(r + 6);
+         size_t str_len = read_be16(r + 8);
+         size_t str_offset = strings + read_be16(r + 10);
+
+         // Family, full name and typographic family.
+         if (name_id != 1 && name_id != 4 && name_id != 16)
+            continue;
+         if (str_offset > len || str_len > len - str_offset)
+            continue;
+
+         char str[256];
+         decode_font_name(names + str_offset, str_len, platform == 0 || platform == 3, str, sizeof(str));
+         if (!av_strcasecmp(str, name))
+            return 1;
+      }
+      return 0;
+   }
+
+   return -1;
+}
+
+static int font_has_name(const uint8_t *data, size_t size, const char *name)
+{
+   if (size < 12 || memcmp(data, "ttcf", 4))
+      return sfnt_has_name(data, size, 0, name);
+
+   // Collections hold several fonts, any of them will do.
+   uint32_t fonts = read_be32(data + 8);
+   if ((size - 12) / 4 < fonts)
+      return -1;
+
+   int ret = -1;
+   for (uint32_t i = 0; i < fonts; i++)
+   {
+      int found = sfnt_has_name(data, size, read_be32(data + 12 + i * 4), name);
+      if (found > 0)
+         return 1;
+      if (found == 0)
+         ret = 0;
+   }
+   return ret;
+}
+
+// Hands the attachments providing name to libass. Must hold ass_lock.
+// libass picks up fonts added after ass_set_fonts() on the next render.
+static void load_attachment_fonts(const char *name)
+{
+   // '@' selects the vertical variant of the same font.
+   if (*name == '@')
+      name++;
+   if (!*name)
+      return;
+
+   for (size_t i = 0; i < attachments_size; i++)
+   {
+      if (attachments[i].loaded || font_has_name(attachments[i].data, attachments[i].size, name) <= 0)
+         continue;
+
+      ass_add_font(ass, (char*)"", (char*)attachments[i].data, attachments[i].size);
+      attachments[i].loaded = true;
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Loaded attached font for \"%s\".\n", name);
+   }
+}
+
+// Events can switch fonts with \fn override tags.
+static void load_event_fonts(const char *text)
+{
+   while ((text = strstr(text, "\\fn")))
+   {
+      text += 3;
+      while (*text == ' ')
+         text++;
+
+      size_t len = strcspn(text, "\\}");
+      while (len && text[len - 1] == ' ')
+         len--;
+
+      char name[256];
+      if (len && len < sizeof(name))
+      {
+         memcpy(name, text, len);
+         name[len] = '\0';
+         load_attachment_fonts(name);
+      }
+   }
+}
+#endif
+
 void retro_init(void)
 {
    av_register_all();
@@ -212,7 +802,7 @@ void retro_get_system_av_info(struct retro_system_av_info *info)
    unsigned height = vctx ? media.height : 240;
    float aspect = vctx ? media.aspect : 0.0;
 
-#ifdef HAVE_GL_FFT
+#if defined(HAVE_GL_FFT) || defined(HAVE_CPU_FFT)
    if (audio_streams_num > 0 && video_stream < 0)
    {
       width = fft_width;
@@ -238,11 +828,35 @@ void retro_set_environment(retro_environment_t cb)
 #ifdef HAVE_GL
       { "ffmpeg_temporal_interp", "Temporal Interpolation; enabled|disabled" },
 #endif
+#ifdef HAVE_DIRECT_UPLOAD
+      { "ffmpeg_direct_upload", "Decode Into GPU Memory (restart); disabled|enabled" },
+#endif
 #ifdef HAVE_GL_FFT
       { "ffmpeg_fft_resolution", "GLFFT Resolution; 1280x720|1920x1080|640x360|320x180" },
       { "ffmpeg_fft_multisample", "GLFFT Multisample; 1x|2x|4x" },
+#endif
+#ifdef HAVE_CPU_FFT
+      { "ffmpeg_fft_resolution", "FFT Resolution; 640x360|1280x720|320x180" },
 #endif
       { "ffmpeg_color_space", "Colorspace; auto|BT.709|BT.601|FCC|SMPTE240M" },
+      { "ffmpeg_scaler", "Scaler Profile; balanced|auto|fast|quality" },
+      { "ffmpeg_max_resolution", "Max Output Resolution (restart); unlimited|2160p|1440p|1080p|720p|480p" },
+#ifndef HAVE_GL
+      { "ffmpeg_pixel_format", "Output Pixel Format (restart); XRGB8888|RGB565|RGB565 (dithered)" },
+#endif
+#ifdef HAVE_MOTION_INTERP
+      { "ffmpeg_motion_interp", "Motion Interpolation (restart); disabled|enabled" },
+#endif
+#ifdef HAVE_FILTERS
+      { "ffmpeg_video_filter", "Video Filter (restart); disabled|deinterlace|deinterlace (bwdif)|deinterlace (half rate)|denoise|deinterlace + denoise" },
+#endif
+      { "ffmpeg_readahead", "Read-ahead Buffer; disabled|2 MB|8 MB|32 MB|128 MB" },
+      { "ffmpeg_probe", "Stream Probing; full|fast|minimal" },
+      { "ffmpeg_probe_cache", "Cache Stream Info; enabled|disabled" },
+      { "ffmpeg_fast_start", "Fast Startup; enabled|disabled" },
+      { "ffmpeg_sample_rate", "Audio Output Rate (restart); native|48000|44100|32000|96000" },
+      { "ffmpeg_decode_all_audio", "Instant Audio Track Switching (restart); disabled|enabled" },
+      { "ffmpeg_audio_callback", "Threaded Audio Output (restart); disabled|enabled" },
       { NULL, NULL },
    };
 
@@ -299,14 +913,18 @@ static void check_variables(void)
    }
 #endif
 
-#ifdef HAVE_GL_FFT
+#if defined(HAVE_GL_FFT) || defined(HAVE_CPU_FFT)
    struct retro_variable fft_var = {
       .key = "ffmpeg_fft_resolution",
    };
 
+#ifdef HAVE_GL_FFT
    fft_width = 1280;
    fft_height = 720;
-   fft_multisample = 1;
+#else
+   fft_width = 640;
+   fft_height = 360;
+#endif
    if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &fft_var) && fft_var.value)
    {
       unsigned w, h;
@@ -316,7 +934,10 @@ static void check_variables(void)
          fft_height = h;
       }
    }
+#endif
 
+#ifdef HAVE_GL_FFT
+   fft_multisample = 1;
    struct retro_variable fft_ms_var = {
       .key = "ffmpeg_fft_multisample",
    };
@@ -344,633 +965,3328 @@ static void check_variables(void)
          colorspace = AVCOL_SPC_UNSPECIFIED;
       slock_unlock(decode_thread_lock);
    }
-}
 
-void retro_run(void)
-{
-   bool updated = false;
+   struct retro_variable readahead_var = {
+      .key = "ffmpeg_readahead",
+   };
 
-#ifdef HAVE_GL_FFT
-   unsigned old_fft_width = fft_width;
-   unsigned old_fft_height = fft_height;
-   unsigned old_fft_multisample = fft_multisample;
-#endif
+   // Only takes effect on next load.
+   readahead_window = 0;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &readahead_var) && readahead_var.value)
+      readahead_window = strtoul(readahead_var.value, NULL, 0) * 1024 * 1024;
 
-   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
-      check_variables();
+   struct retro_variable probe_var = {
+      .key = "ffmpeg_probe",
+   };
 
-#ifdef HAVE_GL_FFT
-   if (fft_width != old_fft_width || fft_height != old_fft_height)
+   probe_size = 0;
+   probe_duration = 0;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &probe_var) && probe_var.value)
    {
-      struct retro_system_av_info info;
-      retro_get_system_av_info(&info);
-      if (!environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info))
+      if (!strcmp(probe_var.value, "fast"))
       {
-         fft_width = old_fft_width;
-         fft_height = old_fft_height;
+         probe_size = 1024 * 1024;
+         probe_duration = AV_TIME_BASE;
+      }
+      else if (!strcmp(probe_var.value, "minimal"))
+      {
+         probe_size = 128 * 1024;
+         probe_duration = AV_TIME_BASE / 5;
       }
    }
 
-   if (fft && (old_fft_multisample != fft_multisample))
-      glfft_init_multisample(fft, fft_width, fft_height, fft_multisample);
-#endif
+   struct retro_variable probe_cache_var = {
+      .key = "ffmpeg_probe_cache",
+   };
 
-   input_poll_cb();
+   probe_cache = true;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &probe_cache_var) && probe_cache_var.value)
+      probe_cache = !strcmp(probe_cache_var.value, "enabled");
 
-   int seek_frames = 0;
-   static bool last_left;
-   static bool last_right;
-   static bool last_up;
-   static bool last_down;
-   static bool last_l;
-   static bool last_r;
-   bool left = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
-         RETRO_DEVICE_ID_JOYPAD_LEFT);
-   bool right = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
-         RETRO_DEVICE_ID_JOYPAD_RIGHT);
-   bool up = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
-         RETRO_DEVICE_ID_JOYPAD_UP);
-   bool down = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
-         RETRO_DEVICE_ID_JOYPAD_DOWN);
-   bool l = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
-         RETRO_DEVICE_ID_JOYPAD_L);
-   bool r = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
-         RETRO_DEVICE_ID_JOYPAD_R);
+   struct retro_variable fast_start_var = {
+      .key = "ffmpeg_fast_start",
+   };
 
-   if (left && !last_left)
-      seek_frames -= 10 * media.interpolate_fps;
-   if (right && !last_right)
-      seek_frames += 10 * media.interpolate_fps;
-   if (up && !last_up)
-      seek_frames += 60 * media.interpolate_fps;
-   if (down && !last_down)
-      seek_frames -= 60 * media.interpolate_fps;
+   fast_start = true;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &fast_start_var) && fast_start_var.value)
+      fast_start = !strcmp(fast_start_var.value, "enabled");
 
-   if (l && !last_l && audio_streams_num > 0)
-   {
-      slock_lock(decode_thread_lock);
-      audio_streams_ptr = (audio_streams_ptr + 1) % audio_streams_num;
-      slock_unlock(decode_thread_lock);
+   struct retro_variable rate_var = {
+      .key = "ffmpeg_sample_rate",
+   };
 
-      char msg[256];
-      snprintf(msg, sizeof(msg), "Audio Track #%d.", audio_streams_ptr);
-      environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &(struct retro_message) { .msg = msg, .frames = 180 });
+   // Only takes effect on next load.
+   output_sample_rate = 0;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &rate_var) && rate_var.value)
+      output_sample_rate = strtoul(rate_var.value, NULL, 0);
+
+   struct retro_variable decode_all_var = {
+      .key = "ffmpeg_decode_all_audio",
+   };
+
+   // FIFO layout depends on this, so it can only change on next load.
+   if (!decode_thread_handle)
+   {
+      decode_all_audio = false;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &decode_all_var) && decode_all_var.value)
+         decode_all_audio = !strcmp(decode_all_var.value, "enabled");
    }
-   else if (r && !last_r && subtitle_streams_num > 0)
+
+   struct retro_variable scaler_var = {
+      .key = "ffmpeg_scaler",
+   };
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &scaler_var) && scaler_var.value)
    {
       slock_lock(decode_thread_lock);
-      subtitle_streams_ptr = (subtitle_streams_ptr + 1) % subtitle_streams_num;
+      if (!strcmp(scaler_var.value, "auto"))
+         scaler_profile = SCALER_AUTO;
+      else if (!strcmp(scaler_var.value, "fast"))
+         scaler_profile = SCALER_FAST;
+      else if (!strcmp(scaler_var.value, "quality"))
+         scaler_profile = SCALER_QUALITY;
+      else
+         scaler_profile = SCALER_BALANCED;
       slock_unlock(decode_thread_lock);
-
-      char msg[256];
-      snprintf(msg, sizeof(msg), "Subtitle Track #%d.", subtitle_streams_ptr);
-      environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &(struct retro_message) { .msg = msg, .frames = 180 });
    }
 
-   last_left = left;
-   last_right = right;
-   last_up = up;
-   last_down = down;
-   last_l = l;
-   last_r = r;
+   struct retro_variable max_res_var = {
+      .key = "ffmpeg_max_resolution",
+   };
 
-   // Push seek request to thread,
-   // wait for seek to complete.
-   if (seek_frames)
+   if (!decode_thread_handle)
    {
-      if (seek_frames < 0 && (unsigned)-seek_frames > frame_cnt)
-         frame_cnt = 0;
-      else
-         frame_cnt += seek_frames;
-
-      slock_lock(fifo_lock);
+      max_output_width = 0;
+      max_output_height = 0;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &max_res_var) && max_res_var.value)
+      {
+         unsigned lines = strtoul(max_res_var.value, NULL, 0);
+         if (lines)
+         {
+            max_output_width = (lines * 16 + 8) / 9;
+            max_output_height = lines;
+         }
+      }
+   }
 
-      do_seek = true;
-      seek_time = frame_cnt / media.interpolate_fps;
+#ifndef HAVE_GL
+   struct retro_variable pixel_format_var = {
+      .key = "ffmpeg_pixel_format",
+   };
 
-      char msg[256];
+   if (!decode_thread_handle)
+   {
+      rgb565_output = false;
+      rgb565_dither = false;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &pixel_format_var) && pixel_format_var.value)
+      {
+         rgb565_output = !strncmp(pixel_format_var.value, "RGB565", 6);
+         rgb565_dither = !strcmp(pixel_format_var.value, "RGB565 (dithered)");
+      }
+   }
+#endif
+
+#ifdef HAVE_MOTION_INTERP
+   struct retro_variable motion_interp_var = {
+      .key = "ffmpeg_motion_interp",
+   };
+
+   if (!decode_thread_handle)
+   {
+      use_motion_interp = false;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &motion_interp_var) && motion_interp_var.value)
+         use_motion_interp = !strcmp(motion_interp_var.value, "enabled");
+   }
+#endif
+
+#ifdef HAVE_FILTERS
+   struct retro_variable video_filter_var = {
+      .key = "ffmpeg_video_filter",
+   };
+
+   if (!decode_thread_handle)
+   {
+      video_filter = NULL;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &video_filter_var) && video_filter_var.value)
+      {
+         for (unsigned i = 0; i < sizeof(video_filter_presets) / sizeof(video_filter_presets[0]); i++)
+         {
+            if (!strcmp(video_filter_var.value, video_filter_presets[i].name))
+               video_filter = video_filter_presets[i].graph;
+         }
+      }
+   }
+#endif
+
+#ifdef HAVE_DIRECT_UPLOAD
+   struct retro_variable direct_upload_var = {
+      .key = "ffmpeg_direct_upload",
+   };
+
+   if (!decode_thread_handle)
+   {
+      use_direct_upload = false;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &direct_upload_var) && direct_upload_var.value)
+         use_direct_upload = !strcmp(direct_upload_var.value, "enabled");
+   }
+#endif
+
+   struct retro_variable audio_callback_var = {
+      .key = "ffmpeg_audio_callback",
+   };
+
+   if (!decode_thread_handle)
+   {
+      use_audio_callback = false;
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &audio_callback_var) && audio_callback_var.value)
+         use_audio_callback = !strcmp(audio_callback_var.value, "enabled");
+   }
+}
+
+static void fifo_discard(fifo_buffer_t *fifo, size_t size)
+{
+   uint8_t discard[4096];
+   while (size)
+   {
+      size_t chunk = size > sizeof(discard) ? sizeof(discard) : size;
+      fifo_read(fifo, discard, chunk);
+      size -= chunk;
+   }
+}
+
+// Size of one picture in the video FIFO.
+// Caller holds fifo_lock.
+static size_t video_entry_size(void)
+{
+#ifdef HAVE_DIRECT_UPLOAD
+   if (direct_upload_active)
+      return sizeof(double) + sizeof(uint32_t);
+#endif
+   return sizeof(double) + media.width * media.height * video_pixel_size;
+}
+
+// Caller holds fifo_lock.
+static void clear_video_fifo(void)
+{
+   fifo_clear(video_decode_fifo);
+#ifdef HAVE_DIRECT_UPLOAD
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      if (direct_slots[i].state == DIRECT_SLOT_QUEUED)
+         direct_slots[i].state = DIRECT_SLOT_FREE;
+   }
+#endif
+}
+
+// Drops the oldest picture in the video FIFO.
+// Caller holds fifo_lock.
+static void drop_video_frame(void)
+{
+#ifdef HAVE_DIRECT_UPLOAD
+   if (direct_upload_active)
+   {
+      double pts;
+      uint32_t index;
+      fifo_read(video_decode_fifo, &pts, sizeof(pts));
+      fifo_read(video_decode_fifo, &index, sizeof(index));
+      direct_slots[index].state = DIRECT_SLOT_FREE;
+      return;
+   }
+#endif
+   fifo_discard(video_decode_fifo, video_entry_size());
+}
+
+// Seeks to play_time. Doesn't wait for the decode thread, retro_run() does that.
+// Caller holds fifo_lock.
+static void queue_seek(void)
+{
+   do_seek = true;
+   seek_time = play_time;
+   seek_serial++;
+   playback_epoch++;
+   audio_frames = play_time * media.sample_rate;
+   audio_clock_valid = false;
+   audio_callback_pts_valid = false;
+
+   if (video_decode_fifo)
+      clear_video_fifo();
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      if (audio_decode_fifo[i])
+         fifo_clear(audio_decode_fifo[i]);
+   }
+   scond_broadcast(fifo_decode_cond);
+}
+
+static unsigned audio_fifo_index(int track)
+{
+   return decode_all_audio ? track : 0;
+}
+
+static size_t audio_history_size(void)
+{
+   return AUDIO_HISTORY_SECONDS * media.sample_rate * sizeof(int16_t) * 2;
+}
+
+// Puts back audio and pictures read since audio_frames/video_entries_read were at the given values.
+// Returns false if that is no longer in the FIFO history.
+// Caller holds fifo_lock.
+static bool rewind_fifos(uint64_t to_audio_frames, uint64_t to_video_entries)
+{
+   if (audio_callback_in_use || to_audio_frames > audio_frames || to_video_entries > video_entries_read)
+      return false;
+#ifdef HAVE_DIRECT_UPLOAD
+   // Slots are handed back to the decoder once uploaded.
+   if (direct_upload_active)
+      return false;
+#endif
+
+   fifo_buffer_t *audio_fifo = audio_streams_num > 0 ?
+      audio_decode_fifo[audio_fifo_index(audio_streams_ptr)] : NULL;
+   size_t audio_bytes = (audio_frames - to_audio_frames) * sizeof(int16_t) * 2;
+   if (audio_bytes && (!audio_fifo || fifo_history_avail(audio_fifo) < audio_bytes))
+      return false;
+
+   // frames[0] and frames[1] hold later pictures by now, so those two are read again as well.
+   uint64_t entries = 0;
+   if (video_stream >= 0 && video_decode_fifo)
+   {
+      entries = video_entries_read - to_video_entries + (to_video_entries < 2 ? to_video_entries : 2);
+      if (fifo_history_avail(video_decode_fifo) < entries * video_entry_size())
+         return false;
+      fifo_unread(video_decode_fifo, entries * video_entry_size());
+   }
+
+   if (audio_bytes)
+   {
+      fifo_unread(audio_fifo, audio_bytes);
+
+      // Inactive tracks only need to be roughly in place, drop_inactive_audio() aligns them.
+      for (int i = 0; decode_all_audio && i < audio_streams_num; i++)
+      {
+         fifo_buffer_t *fifo = audio_decode_fifo[i];
+         if (!fifo || fifo == audio_fifo)
+            continue;
+
+         size_t bytes = fifo_history_avail(fifo);
+         fifo_unread(fifo, bytes < audio_bytes ? bytes : audio_bytes);
+      }
+   }
+
+   audio_frames = to_audio_frames;
+   video_entries_read -= entries;
+   frames[0].pts = 0.0;
+   frames[1].pts = 0.0;
+   return true;
+}
+
+// Keeps FIFOs of inactive tracks aligned with the playback position
+// so they are ready to be switched to. active is the FIFO being played.
+static void drop_inactive_audio(unsigned active, double reading_pts)
+{
+   if (!decode_all_audio)
+      return;
+
+   for (int i = 0; i < audio_streams_num; i++)
+   {
+      fifo_buffer_t *fifo = audio_decode_fifo[i];
+      if (i == (int)active || !fifo)
+         continue;
+
+      size_t avail = fifo_read_avail(fifo);
+      double track_pts = decode_last_audio_time[i] -
+         (double)avail / (media.sample_rate * sizeof(int16_t) * 2);
+      if (track_pts >= reading_pts)
+         continue;
+
+      size_t to_drop = (size_t)((reading_pts - track_pts) * media.sample_rate) * sizeof(int16_t) * 2;
+      if (to_drop > avail)
+         to_drop = avail;
+
+      fifo_discard(fifo, to_drop);
+   }
+}
+
+// Caller holds fifo_lock.
+static bool audio_callback_starving(unsigned fifo_index)
+{
+   fifo_buffer_t *fifo = audio_decode_fifo[fifo_index];
+   return fifo && fifo_read_avail(fifo) < 4 * AUDIO_CALLBACK_FRAMES * sizeof(int16_t) * 2 &&
+      av_gettime() - main_run_time > AUDIO_CALLBACK_STALL;
+}
+
+// Runs on the frontend's audio thread.
+static void audio_callback(void)
+{
+   int16_t buffer[2 * AUDIO_CALLBACK_FRAMES];
+   size_t frames = 0;
+
+   slock_lock(decode_thread_lock);
+   unsigned fifo_index = audio_fifo_index(audio_streams_ptr);
+   slock_unlock(decode_thread_lock);
+
+   slock_lock(fifo_lock);
+   fifo_buffer_t *fifo = audio_decode_fifo[fifo_index];
+   if (fifo && !do_seek && !decode_thread_dead)
+   {
+      frames = fifo_read_avail(fifo) / (sizeof(int16_t) * 2);
+      if (frames > AUDIO_CALLBACK_FRAMES)
+         frames = AUDIO_CALLBACK_FRAMES;
+
+      if (frames)
+      {
+         fifo_read(fifo, buffer, frames * sizeof(int16_t) * 2);
+
+         audio_callback_pts = decode_last_audio_time[fifo_index] -
+            (double)fifo_read_avail(fifo) / (media.sample_rate * sizeof(int16_t) * 2);
+         audio_callback_pts_valid = true;
+         drop_inactive_audio(fifo_index, audio_callback_pts);
+      }
+
+      // Let the clock run over gaps in the audio, e.g. when it ends before the video.
+      if (audio_callback_pts_valid && !fifo_read_avail(fifo))
+         audio_callback_pts += (double)(AUDIO_CALLBACK_FRAMES - frames) / media.sample_rate;
+      scond_broadcast(fifo_decode_cond);
+   }
+   slock_unlock(fifo_lock);
+
+   // Keep the device fed on underrun.
+   memset(buffer + frames * 2, 0, (AUDIO_CALLBACK_FRAMES - frames) * sizeof(int16_t) * 2);
+   audio_batch_cb(buffer, AUDIO_CALLBACK_FRAMES);
+}
+
+static void frame_time_callback(retro_usec_t usec)
+{
+   frame_time_usec = usec;
+}
+
+static void audio_callback_set_state(bool enable)
+{
+   slock_lock(fifo_lock);
+   audio_callback_enabled = enable;
+   slock_unlock(fifo_lock);
+}
+
+#ifdef HAVE_DIRECT_UPLOAD
+// True if retro_run() still has to hand slots back.
+// Caller holds fifo_lock.
+static bool direct_upload_uploading(void)
+{
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      if (direct_slots[i].state == DIRECT_SLOT_UPLOADING)
+         return true;
+   }
+   return false;
+}
+
+// Hands slots whose upload has finished back to the decode thread.
+// Only this thread fences slots, so the fences are waited on without fifo_lock.
+static void direct_upload_reclaim(bool wait)
+{
+   bool done[DIRECT_UPLOAD_SLOTS] = {false};
+   bool any = false;
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      struct direct_slot *slot = &direct_slots[i];
+      if (!slot->fence)
+         continue;
+
+      GLenum status = glClientWaitSync(slot->fence,
+            wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? UPLOAD_FENCE_TIMEOUT : 0);
+      if (status == GL_TIMEOUT_EXPIRED)
+         continue;
+
+      glDeleteSync(slot->fence);
+      slot->fence = NULL;
+      done[i] = true;
+      any = true;
+   }
+
+   if (!any)
+      return;
+
+   slock_lock(fifo_lock);
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      if (done[i])
+         direct_slots[i].state = DIRECT_SLOT_FREE;
+   }
+   scond_broadcast(fifo_decode_cond);
+   slock_unlock(fifo_lock);
+}
+#endif
+
+#ifdef HAVE_SSA
+static void subtitle_images_release(struct subtitle_images *images)
+{
+   if (images && --images->refs == 0)
+      av_free(images);
+}
+
+static void subtitle_images_put(struct subtitle_images *images)
+{
+   slock_lock(sub_cache.lock);
+   subtitle_images_release(images);
+   slock_unlock(sub_cache.lock);
+}
+
+// Deep copy, the images libass returns only live until the next render.
+static struct subtitle_images *copy_ass_images(ASS_Image *img)
+{
+   unsigned count = 0;
+   size_t bitmap_size = 0;
+   for (ASS_Image *i = img; i; i = i->next)
+   {
+      count++;
+      bitmap_size += i->w * i->h;
+   }
+
+   size_t header_size = sizeof(struct subtitle_images) + count * sizeof(ASS_Image);
+   struct subtitle_images *images = av_malloc(header_size + bitmap_size);
+   if (!images)
+      return NULL;
+
+   images->refs = 1;
+   images->head = count ? (ASS_Image*)(images + 1) : NULL;
+   images->bitmaps = NULL;
+   images->bitmaps_count = 0;
+
+   uint8_t *bitmap = (uint8_t*)images + header_size;
+   ASS_Image *dst = images->head;
+   for (ASS_Image *i = img; i; i = i->next, dst++)
+   {
+      *dst = *i;
+      dst->bitmap = bitmap;
+      dst->stride = i->w;
+      dst->next = i->next ? dst + 1 : NULL;
+
+      for (int y = 0; y < i->h; y++, bitmap += i->w)
+         memcpy(bitmap, i->bitmap + y * i->stride, i->w);
+   }
+
+   return images;
+}
+
+// Maps an output coordinate range to the rect's pixels, clipped to the output.
+static int bitmap_rect_span(int pos, int size, unsigned canvas, unsigned output, int *dst_pos, int *src_index)
+{
+   int start = (int)((int64_t)pos * output / canvas);
+   int end = (int)((int64_t)(pos + size) * output / canvas);
+   if (start < 0)
+      start = 0;
+   if (end > (int)output)
+      end = output;
+
+   for (int i = start; i < end; i++)
+   {
+      int index = (int)(((int64_t)i * canvas + canvas / 2) / output) - pos;
+      src_index[i - start] = index < 0 ? 0 : index >= size ? size - 1 : index;
+   }
+
+   *dst_pos = start;
+   return end > start ? end - start : 0;
+}
+
+// Expands palettized rects to premultiplied pixels at output size.
+// Rects are positioned on the subtitle canvas, which is normally the size of the decoded video.
+static struct subtitle_images *expand_bitmap_subtitle(const struct bitmap_event *event)
+{
+   unsigned canvas_width = event->canvas_width ? event->canvas_width : media.src_width;
+   unsigned canvas_height = event->canvas_height ? event->canvas_height : media.src_height;
+   const AVSubtitle *sub = &event->sub;
+   if (!canvas_width || !canvas_height || !media.width || !media.height)
+      return NULL;
+
+   int *cols = av_malloc(media.width * sizeof(*cols));
+   int *rows = av_malloc(media.height * sizeof(*rows));
+   struct subtitle_images *images = NULL;
+   if (!cols || !rows)
+      goto end;
+
+   unsigned count = 0;
+   size_t pixels_size = 0;
+   for (unsigned i = 0; i < sub->num_rects; i++)
+   {
+      const AVSubtitleRect *rect = sub->rects[i];
+      if (rect->type != SUBTITLE_BITMAP || rect->w <= 0 || rect->h <= 0 || !rect->pict.data[1])
+         continue;
+
+      int x, y;
+      int w = bitmap_rect_span(rect->x, rect->w, canvas_width, media.width, &x, cols);
+      int h = bitmap_rect_span(rect->y, rect->h, canvas_height, media.height, &y, rows);
+      if (!w || !h)
+         continue;
+
+      pixels_size += (size_t)w * h * sizeof(uint32_t);
+      count++;
+   }
+   if (!count)
+      goto end;
+
+   size_t header_size = sizeof(struct subtitle_images) + count * sizeof(struct subtitle_bitmap);
+   images = av_malloc(header_size + pixels_size);
+   if (!images)
+      goto end;
+
+   images->refs = 1;
+   images->head = NULL;
+   images->bitmaps = (struct subtitle_bitmap*)(images + 1);
+   images->bitmaps_count = count;
+
+   uint32_t *pixels = (uint32_t*)((uint8_t*)images + header_size);
+   count = 0;
+   for (unsigned i = 0; i < sub->num_rects; i++)
+   {
+      const AVSubtitleRect *rect = sub->rects[i];
+      if (rect->type != SUBTITLE_BITMAP || rect->w <= 0 || rect->h <= 0 || !rect->pict.data[1])
+         continue;
+
+      struct subtitle_bitmap *bitmap = &images->bitmaps[count];
+      bitmap->w = bitmap_rect_span(rect->x, rect->w, canvas_width, media.width, &bitmap->x, cols);
+      bitmap->h = bitmap_rect_span(rect->y, rect->h, canvas_height, media.height, &bitmap->y, rows);
+      if (!bitmap->w || !bitmap->h)
+         continue;
+
+      uint32_t palette[256] = {0};
+      const uint32_t *src_palette = (const uint32_t*)rect->pict.data[1];
+      for (int c = 0; c < rect->nb_colors && c < 256; c++)
+      {
+         uint32_t color = src_palette[c];
+         unsigned a = color >> 24;
+         unsigned r = (((color >> 16) & 0xff) * a + 127) / 255;
+         unsigned g = (((color >>  8) & 0xff) * a + 127) / 255;
+         unsigned b = (((color >>  0) & 0xff) * a + 127) / 255;
+         palette[c] = (a << 24) | (r << 16) | (g << 8) | b;
+      }
+
+      bitmap->pixels = pixels;
+      for (int y = 0; y < bitmap->h; y++)
+      {
+         const uint8_t *src = rect->pict.data[0] + rows[y] * rect->pict.linesize[0];
+         for (int x = 0; x < bitmap->w; x++)
+            *pixels++ = palette[src[cols[x]]];
+      }
+      count++;
+   }
+
+end:
+   av_free(cols);
+   av_free(rows);
+   return images;
+}
+
+// Caller holds sub_cache.lock.
+static int subtitle_cache_find(int64_t time)
+{
+   for (unsigned i = 0; i < sub_cache.cache_count; i++)
+   {
+      int64_t delta = sub_cache.cache[i].time - time;
+      if (delta >= -SUBTITLE_TIME_TOLERANCE && delta <= SUBTITLE_TIME_TOLERANCE)
+         return i;
+   }
+   return -1;
+}
+
+// Caller holds sub_cache.lock.
+static void subtitle_cache_remove(unsigned index)
+{
+   subtitle_images_release(sub_cache.cache[index].images);
+   sub_cache.cache[index] = sub_cache.cache[--sub_cache.cache_count];
+}
+
+// Caller holds sub_cache.lock.
+static void subtitle_cache_add_pending(int64_t time)
+{
+   for (unsigned i = 0; i < sub_cache.pending_count; i++)
+   {
+      if (sub_cache.pending[i] == time)
+         return;
+   }
+
+   if (sub_cache.pending_count == SUBTITLE_PENDING_SIZE)
+   {
+      memmove(sub_cache.pending, sub_cache.pending + 1, (SUBTITLE_PENDING_SIZE - 1) * sizeof(int64_t));
+      sub_cache.pending_count--;
+   }
+   sub_cache.pending[sub_cache.pending_count++] = time;
+   scond_broadcast(sub_cache.cond);
+}
+
+// Requested times first, then the frames expected after the last request.
+// Caller holds sub_cache.lock.
+static bool subtitle_cache_next(int64_t *time)
+{
+   while (sub_cache.pending_count)
+   {
+      *time = sub_cache.pending[0];
+      memmove(sub_cache.pending, sub_cache.pending + 1, --sub_cache.pending_count * sizeof(int64_t));
+      if (subtitle_cache_find(*time) < 0)
+         return true;
+   }
+
+   if (sub_cache.last_request < 0 || sub_cache.interval <= 0.0 ||
+         sub_cache.cache_count >= SUBTITLE_CACHE_SIZE - SUBTITLE_PENDING_SIZE)
+      return false;
+
+   for (unsigned i = 1; i <= SUBTITLE_LOOKAHEAD; i++)
+   {
+      *time = sub_cache.last_request + (int64_t)(i * sub_cache.interval + 0.5);
+      if (subtitle_cache_find(*time) < 0)
+         return true;
+   }
+   return false;
+}
+
+// Returns false if the event is already stored, e.g. when packets are read again after a seek.
+static bool subtitle_events_add(struct subtitle_events *store, int64_t start, const char *text)
+{
+   size_t len = strlen(text);
+
+   size_t lo = 0, hi = store->count;
+   while (lo < hi)
+   {
+      size_t mid = (lo + hi) / 2;
+      if (store->events[mid].start <= start)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (size_t i = lo; i > 0 && store->events[i - 1].start == start; i--)
+   {
+      const struct subtitle_event *event = &store->events[i - 1];
+      if (event->text_len == len && !memcmp(store->text + event->text, text, len))
+         return false;
+   }
+
+   if (store->count == store->cap)
+   {
+      size_t cap = store->cap ? store->cap * 2 : 256;
+      struct subtitle_event *events = av_realloc(store->events, cap * sizeof(*events));
+      if (!events)
+         return false;
+      store->events = events;
+      store->cap = cap;
+   }
+
+   if (store->text_cap - store->text_size < len + 1)
+   {
+      size_t cap = store->text_cap ? store->text_cap : 16 * 1024;
+      while (cap - store->text_size < len + 1)
+         cap *= 2;
+      char *buf = av_realloc(store->text, cap);
+      if (!buf)
+         return false;
+      store->text = buf;
+      store->text_cap = cap;
+   }
+
+   memmove(store->events + lo + 1, store->events + lo, (store->count - lo) * sizeof(*store->events));
+   store->events[lo].start = start;
+   store->events[lo].text = store->text_size;
+   store->events[lo].text_len = len;
+   store->count++;
+
+   memcpy(store->text + store->text_size, text, len + 1);
+   store->text_size += len + 1;
+   return true;
+}
+
+// Replays the stored events into a libass track which missed some. Must hold ass_lock.
+static void subtitle_track_sync(int ptr)
+{
+   struct subtitle_events *store = &sub_events[ptr];
+   if (store->synced)
+      return;
+
+   int64_t start = av_gettime();
+   ass_flush_events(ass_track[ptr]);
+   for (size_t i = 0; i < store->count; i++)
+   {
+      char *text = store->text + store->events[i].text;
+      ass_process_data(ass_track[ptr], text, store->events[i].text_len);
+      if (ass_fonts_ready)
+         load_event_fonts(text);
+   }
+   store->synced = true;
+
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Rebuilt subtitle track #%d from %u events in %.1f ms.\n",
+         ptr, (unsigned)store->count, (av_gettime() - start) / 1000.0);
+}
+
+static void subtitle_events_free(void)
+{
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      av_freep(&sub_events[i].events);
+      av_freep(&sub_events[i].text);
+   }
+   memset(sub_events, 0, sizeof(sub_events));
+}
+
+static void bitmap_event_free(struct bitmap_event *event)
+{
+   avsubtitle_free(&event->sub);
+   subtitle_images_put(event->images);
+   event->images = NULL;
+}
+
+// Takes ownership of sub. Returns false if there already is an event at start, e.g. when
+// packets are read again after a seek. Must hold ass_lock.
+static bool bitmap_events_add(int ptr, int64_t start, int64_t end,
+      unsigned canvas_width, unsigned canvas_height, AVSubtitle *sub)
+{
+   struct bitmap_event *events = bitmap_events[ptr].events;
+   unsigned count = bitmap_events[ptr].count;
+
+   unsigned pos = 0;
+   while (pos < count && events[pos].start < start)
+      pos++;
+   if (pos < count && events[pos].start == start)
+   {
+      avsubtitle_free(sub);
+      return false;
+   }
+
+   // Drop the event furthest away from the new one, playback is around here.
+   if (count == BITMAP_EVENTS_MAX)
+   {
+      unsigned drop = pos == 0 ? count - 1 : 0;
+      bitmap_event_free(&events[drop]);
+      memmove(events + drop, events + drop + 1, (count - drop - 1) * sizeof(*events));
+      count--;
+      if (drop < pos)
+         pos--;
+   }
+
+   memmove(events + pos + 1, events + pos, (count - pos) * sizeof(*events));
+   memset(&events[pos], 0, sizeof(events[pos]));
+   events[pos].start = start;
+   events[pos].end = end;
+   events[pos].canvas_width = canvas_width;
+   events[pos].canvas_height = canvas_height;
+   events[pos].sub = *sub;
+   bitmap_events[ptr].count = count + 1;
+   return true;
+}
+
+// Returns the images of the event shown at time, owned by the event. Must hold ass_lock.
+static struct subtitle_images *bitmap_subtitle_at(int ptr, int64_t time)
+{
+   struct bitmap_event *event = NULL;
+   for (unsigned i = 0; i < bitmap_events[ptr].count && bitmap_events[ptr].events[i].start <= time; i++)
+      event = &bitmap_events[ptr].events[i];
+
+   if (!event || time >= event->end)
+      return NULL;
+
+   if (!event->expanded)
+   {
+      event->images = expand_bitmap_subtitle(event);
+      event->expanded = true;
+   }
+   return event->images;
+}
+
+static void bitmap_events_free(void)
+{
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      // Nothing else is running anymore.
+      for (unsigned j = 0; j < bitmap_events[i].count; j++)
+      {
+         avsubtitle_free(&bitmap_events[i].events[j].sub);
+         subtitle_images_release(bitmap_events[i].events[j].images);
+      }
+      bitmap_events[i].count = 0;
+   }
+   memset(subtitle_is_bitmap, 0, sizeof(subtitle_is_bitmap));
+}
+
+static bool subtitle_event_at(const ASS_Track *track, int64_t time)
+{
+   for (int i = 0; i < track->n_events; i++)
+   {
+      const ASS_Event *event = &track->events[i];
+      if (event->Start <= time && time < event->Start + event->Duration)
+         return true;
+   }
+   return false;
+}
+
+static void subtitle_render_thread(void *data)
+{
+   (void)data;
+
+   // Result of the previous render, reused while libass reports no change.
+   // libass only compares against its own last output, so bitmap results never count.
+   struct subtitle_images *last = NULL;
+   bool last_from_ass = false;
+
+   slock_lock(sub_cache.lock);
+   for (;;)
+   {
+      int64_t time = 0;
+      while (!sub_cache.dead && !subtitle_cache_next(&time))
+         scond_wait(sub_cache.cond, sub_cache.lock);
+      if (sub_cache.dead)
+         break;
+
+      unsigned generation = sub_cache.generation;
+      slock_unlock(sub_cache.lock);
+
+      slock_lock(decode_thread_lock);
+      int ptr = subtitle_streams_ptr;
+      ASS_Track *track = ass_ready ? ass_track[ptr] : NULL;
+      bool fonts_ready = ass_fonts_ready;
+      slock_unlock(decode_thread_lock);
+
+      // Switched to a track which was fed while inactive.
+      if (track)
+      {
+         slock_lock(ass_lock);
+         subtitle_track_sync(ptr);
+         slock_unlock(ass_lock);
+      }
+
+      // Fonts are still being set up. Only wait for them if something is actually shown.
+      if (track && !fonts_ready)
+      {
+         slock_lock(ass_lock);
+         bool visible = subtitle_event_at(track, time);
+         slock_unlock(ass_lock);
+
+         if (visible)
+         {
+            slock_lock(decode_thread_lock);
+            while (!ass_fonts_ready)
+               scond_wait(ass_ready_cond, decode_thread_lock);
+            slock_unlock(decode_thread_lock);
+         }
+         else
+            track = NULL;
+      }
+
+      bool reuse = false;
+      bool from_ass = false;
+      struct subtitle_images *images = NULL;
+      if (subtitle_is_bitmap[ptr])
+      {
+         // Expanded once, then the same images are shown for the whole event.
+         slock_lock(ass_lock);
+         struct subtitle_images *shown = bitmap_subtitle_at(ptr, time);
+         slock_lock(sub_cache.lock);
+         reuse = shown && shown == last;
+         if (shown && !reuse)
+         {
+            shown->refs++;
+            images = shown;
+         }
+         slock_unlock(sub_cache.lock);
+         slock_unlock(ass_lock);
+      }
+      else if (track && ass_render)
+      {
+         slock_lock(ass_lock);
+         int change = 0;
+         ASS_Image *img = ass_render_frame(ass_render, track, time, &change);
+         reuse = !change && last && last_from_ass;
+         if (!reuse)
+            images = copy_ass_images(img);
+         from_ass = true;
+         slock_unlock(ass_lock);
+      }
+
+      slock_lock(sub_cache.lock);
+      if (reuse)
+      {
+         images = last;
+         images->refs++;
+      }
+      else
+      {
+         if (images)
+         {
+            images->serial = ++sub_cache.serial;
+            images->refs++;
+         }
+         subtitle_images_release(last);
+         last = images;
+         last_from_ass = from_ass;
+      }
+
+      // Events changed meanwhile, this might be stale.
+      if (generation != sub_cache.generation)
+      {
+         subtitle_images_release(images);
+         continue;
+      }
+
+      if (sub_cache.cache_count == SUBTITLE_CACHE_SIZE)
+      {
+         unsigned oldest = 0;
+         for (unsigned i = 1; i < sub_cache.cache_count; i++)
+         {
+            if (sub_cache.cache[i].time < sub_cache.cache[oldest].time)
+               oldest = i;
+         }
+         subtitle_cache_remove(oldest);
+      }
+
+      sub_cache.cache[sub_cache.cache_count].time = time;
+      sub_cache.cache[sub_cache.cache_count].images = images;
+      sub_cache.cache_count++;
+      scond_broadcast(sub_cache.cond);
+   }
+   subtitle_images_release(last);
+   slock_unlock(sub_cache.lock);
+}
+
+static void subtitle_cache_init(void)
+{
+   memset(&sub_cache, 0, sizeof(sub_cache));
+   sub_cache.last_request = -1;
+   sub_cache.lock = slock_new();
+   sub_cache.cond = scond_new();
+   sub_cache.thread = sthread_create(subtitle_render_thread, NULL);
+}
+
+static void subtitle_cache_deinit(void)
+{
+   if (!sub_cache.thread)
+      return;
+
+   slock_lock(sub_cache.lock);
+   sub_cache.dead = true;
+   scond_broadcast(sub_cache.cond);
+   slock_unlock(sub_cache.lock);
+   sthread_join(sub_cache.thread);
+
+   while (sub_cache.cache_count)
+      subtitle_cache_remove(0);
+   slock_free(sub_cache.lock);
+   scond_free(sub_cache.cond);
+   memset(&sub_cache, 0, sizeof(sub_cache));
+}
+
+// Queues the timestamp of an upcoming frame.
+static void subtitle_cache_request(double time)
+{
+   if (!sub_cache.thread)
+      return;
+
+   int64_t ms = (int64_t)(time * 1000.0 + 0.5);
+   slock_lock(sub_cache.lock);
+   if (sub_cache.last_request >= 0)
+   {
+      // Smoothed, timestamps in ms alternate around fractional frame durations.
+      double delta = ms - sub_cache.last_request;
+      if (delta > 0.0 && delta < 1000.0)
+         sub_cache.interval = sub_cache.interval > 0.0 ?
+            sub_cache.interval + 0.25 * (delta - sub_cache.interval) : delta;
+   }
+   sub_cache.last_request = ms;
+
+   if (subtitle_cache_find(ms) < 0)
+      subtitle_cache_add_pending(ms);
+   slock_unlock(sub_cache.lock);
+}
+
+// Returns the images to show at time, with a reference the caller has to release.
+// Earlier entries are dropped, the caller is not going back.
+// Without wait, returns false if they are not rendered yet.
+static bool subtitle_cache_get(double time, bool wait, struct subtitle_images **images)
+{
+   *images = NULL;
+   if (!sub_cache.thread)
+      return false;
+
+   int64_t ms = (int64_t)(time * 1000.0 + 0.5);
+   slock_lock(sub_cache.lock);
+   for (unsigned i = 0; i < sub_cache.cache_count; )
+   {
+      if (sub_cache.cache[i].time < ms - SUBTITLE_TIME_TOLERANCE)
+         subtitle_cache_remove(i);
+      else
+         i++;
+   }
+
+   int index;
+   while ((index = subtitle_cache_find(ms)) < 0 && !sub_cache.dead)
+   {
+      subtitle_cache_add_pending(ms);
+      if (!wait)
+         break;
+      scond_wait(sub_cache.cond, sub_cache.lock);
+   }
+
+   if (index >= 0)
+   {
+      *images = sub_cache.cache[index].images;
+      if (*images)
+         (*images)->refs++;
+   }
+   slock_unlock(sub_cache.lock);
+   return index >= 0;
+}
+
+// Drops everything rendered for [start, end] ms, after events there changed.
+static void subtitle_cache_invalidate(int64_t start, int64_t end)
+{
+   if (!sub_cache.thread)
+      return;
+
+   slock_lock(sub_cache.lock);
+   for (unsigned i = 0; i < sub_cache.cache_count; )
+   {
+      if (sub_cache.cache[i].time >= start && sub_cache.cache[i].time <= end)
+         subtitle_cache_remove(i);
+      else
+         i++;
+   }
+   sub_cache.generation++;
+   scond_broadcast(sub_cache.cond);
+   slock_unlock(sub_cache.lock);
+}
+
+// After a seek, nothing queued or predicted is of use anymore.
+static void subtitle_cache_flush(void)
+{
+   if (!sub_cache.thread)
+      return;
+
+   slock_lock(sub_cache.lock);
+   while (sub_cache.cache_count)
+      subtitle_cache_remove(0);
+   sub_cache.pending_count = 0;
+   sub_cache.last_request = -1;
+   sub_cache.generation++;
+   slock_unlock(sub_cache.lock);
+}
+#endif
+
+#ifdef HAVE_GL
+static void set_srgb_decode(struct frame *frame, bool decode)
+{
+   if (!srgb_skip_decode || frame->srgb_decode == decode)
+      return;
+
+   glBindTexture(GL_TEXTURE_2D, frame->tex);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SRGB_DECODE_EXT, decode ? GL_DECODE_EXT : GL_SKIP_DECODE_EXT);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   frame->srgb_decode = decode;
+}
+
+// Uploads are split so that only copying out of the video FIFO happens under fifo_lock.
+// upload_begin() and upload_end() may wait for the GPU and are called without it.
+struct upload
+{
+   // Where upload_read() puts the picture, NULL if there is nowhere to put it.
+   void *dst;
+   bool read;
+#ifdef HAVE_PBO_UPLOAD
+   struct upload_buffer *buf;
+#endif
+#ifdef HAVE_DIRECT_UPLOAD
+   int slot;
+#endif
+};
+
+static void upload_begin(struct upload *up)
+{
+   memset(up, 0, sizeof(*up));
+#ifdef HAVE_DIRECT_UPLOAD
+   up->slot = -1;
+   // Already in GPU memory.
+   if (direct_upload_active)
+      return;
+#endif
+
+#ifdef HAVE_PBO_UPLOAD
+   size_t size = media.width * media.height * sizeof(uint32_t);
+   struct upload_buffer *buf = &upload_ring[upload_ring_index];
+   upload_ring_index = (upload_ring_index + 1) % UPLOAD_RING_SIZE;
+   up->buf = buf;
+
+   if (upload_persistent)
+   {
+      if (buf->fence)
+      {
+         // The buffer is mapped for good, so it can't be written while the GPU still reads it.
+         GLenum status = glClientWaitSync(buf->fence, GL_SYNC_FLUSH_COMMANDS_BIT, UPLOAD_FENCE_TIMEOUT);
+         while (status == GL_TIMEOUT_EXPIRED)
+            status = glClientWaitSync(buf->fence, 0, UPLOAD_FENCE_TIMEOUT);
+         if (status == GL_WAIT_FAILED)
+            glFinish();
+         glDeleteSync(buf->fence);
+         buf->fence = NULL;
+      }
+      up->dst = buf->ptr;
+   }
+   else
+   {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buf->pbo);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+      up->dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+   }
+#else
+   up->dst = video_frame_temp_buffer;
+#endif
+}
+
+// Takes the next picture out of the video FIFO.
+// Caller holds fifo_lock.
+static void upload_read(struct upload *up)
+{
+   up->read = true;
+
+#ifdef HAVE_DIRECT_UPLOAD
+   if (direct_upload_active)
+   {
+      uint32_t index;
+      fifo_read(video_decode_fifo, &index, sizeof(index));
+      // Out of the queue, so clear_video_fifo() leaves it alone. upload_end() fences it.
+      direct_slots[index].state = DIRECT_SLOT_UPLOADING;
+      up->slot = index;
+      return;
+   }
+#endif
+
+   size_t size = media.width * media.height * sizeof(uint32_t);
+   if (up->dst)
+      fifo_read(video_decode_fifo, up->dst, size);
+   else
+      fifo_discard(video_decode_fifo, size);
+}
+
+// Copies what upload_read() got into tex.
+static void upload_end(struct upload *up, GLuint tex)
+{
+#ifdef HAVE_DIRECT_UPLOAD
+   if (up->slot >= 0)
+   {
+      struct direct_slot *slot = &direct_slots[up->slot];
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+      glBindTexture(GL_TEXTURE_2D, tex);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, media.width, media.height,
+            UPLOAD_FORMAT, UPLOAD_TYPE, NULL);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+      slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      return;
+   }
+#endif
+
+#ifdef HAVE_PBO_UPLOAD
+   if (!up->buf)
+      return;
+
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, up->buf->pbo);
+   if (!upload_persistent && up->dst)
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+   if (up->read && up->dst)
+   {
+      glBindTexture(GL_TEXTURE_2D, tex);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, media.width, media.height,
+            UPLOAD_FORMAT, UPLOAD_TYPE, NULL);
+      glBindTexture(GL_TEXTURE_2D, 0);
+
+      if (upload_persistent)
+         up->buf->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+   }
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+#else
+   if (!up->read)
+      return;
+
+   glBindTexture(GL_TEXTURE_2D, tex);
+   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, media.width, media.height,
+         UPLOAD_FORMAT, UPLOAD_TYPE, up->dst);
+   glBindTexture(GL_TEXTURE_2D, 0);
+#endif
+}
+
+#ifdef HAVE_SUBTITLE_OVERLAY
+struct overlay_image
+{
+   int dst_x, dst_y;
+   int w, h;
+   const uint8_t *src;
+   // In bytes.
+   int stride;
+   uint32_t color;
+};
+
+// Shelf packs the images into the atlas and rebuilds the per-quad data.
+// libass masks go into a single channel atlas, bitmap subtitles into an RGBA one.
+static void update_subtitle_overlay(const struct subtitle_images *images)
+{
+   bool bitmap = images->bitmaps_count > 0;
+   unsigned pixel_size = bitmap ? sizeof(uint32_t) : 1;
+
+   unsigned count = 0;
+   for (ASS_Image *i = images->head; i; i = i->next)
+      count++;
+   count += images->bitmaps_count;
+
+   struct overlay_image *items = av_malloc(count * sizeof(*items) + 1);
+   if (!items)
+   {
+      overlay_instances = 0;
+      return;
+   }
+
+   count = 0;
+   if (bitmap)
+   {
+      for (unsigned i = 0; i < images->bitmaps_count; i++)
+      {
+         const struct subtitle_bitmap *b = &images->bitmaps[i];
+         items[count++] = (struct overlay_image) {
+            b->x, b->y, b->w, b->h, (const uint8_t*)b->pixels, b->w * sizeof(uint32_t), 0,
+         };
+      }
+   }
+   else
+   {
+      for (ASS_Image *i = images->head; i; i = i->next)
+      {
+         if (i->w && i->h)
+            items[count++] = (struct overlay_image) {
+               i->dst_x, i->dst_y, i->w, i->h, i->bitmap, i->stride, i->color,
+            };
+      }
+   }
+
+   unsigned width = media.width;
+   unsigned x = 0, y = 0, row_height = 0;
+   for (unsigned i = 0; i < count; i++)
+   {
+      if (x + items[i].w > width)
+      {
+         x = 0;
+         y += row_height;
+         row_height = 0;
+      }
+      x += items[i].w;
+      if ((unsigned)items[i].h > row_height)
+         row_height = items[i].h;
+   }
+
+   overlay_instances = count;
+   if (!count)
+   {
+      av_free(items);
+      return;
+   }
+
+   // Changing the format needs new storage.
+   unsigned height = y + row_height;
+   if (height > overlay_atlas_height || bitmap != overlay_atlas_rgba)
+   {
+      overlay_atlas_height = (height + OVERLAY_ATLAS_ALIGN - 1) & ~(OVERLAY_ATLAS_ALIGN - 1);
+      overlay_atlas_rgba = bitmap;
+      glBindTexture(GL_TEXTURE_2D, overlay_atlas);
+      if (bitmap)
+         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, overlay_atlas_height, 0,
+               UPLOAD_FORMAT, UPLOAD_TYPE, NULL);
+      else
+         glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, overlay_atlas_height, 0,
+               GL_RED, GL_UNSIGNED_BYTE, NULL);
+      glBindTexture(GL_TEXTURE_2D, 0);
+   }
+
+   if (width * height * pixel_size > overlay_staging_size)
+   {
+      overlay_staging_size = width * overlay_atlas_height * pixel_size;
+      av_freep(&overlay_staging);
+      overlay_staging = av_malloc(overlay_staging_size);
+   }
+   if (count > overlay_instance_cap)
+   {
+      overlay_instance_cap = count * 2;
+      av_freep(&overlay_instance_data);
+      overlay_instance_data = av_malloc(overlay_instance_cap * OVERLAY_INSTANCE_FLOATS * sizeof(GLfloat));
+   }
+   if (!overlay_staging || !overlay_instance_data)
+   {
+      overlay_instances = 0;
+      av_free(items);
+      return;
+   }
+
+   GLfloat *data = overlay_instance_data;
+   x = y = row_height = 0;
+   for (unsigned n = 0; n < count; n++)
+   {
+      const struct overlay_image *i = &items[n];
+      if (x + i->w > width)
+      {
+         x = 0;
+         y += row_height;
+         row_height = 0;
+      }
+
+      for (int line = 0; line < i->h; line++)
+         memcpy(overlay_staging + ((y + line) * width + x) * pixel_size,
+               i->src + line * i->stride, i->w * pixel_size);
+
+      // Quad in clip space, where the viewport covers the frame.
+      *data++ = 2.0f * i->dst_x / media.width - 1.0f;
+      *data++ = 2.0f * i->dst_y / media.height - 1.0f;
+      *data++ = 2.0f * i->w / media.width;
+      *data++ = 2.0f * i->h / media.height;
+
+      *data++ = (GLfloat)x / width;
+      *data++ = (GLfloat)y / overlay_atlas_height;
+      *data++ = (GLfloat)i->w / width;
+      *data++ = (GLfloat)i->h / overlay_atlas_height;
+
+      // RGBA, with alpha stored as transparency. Unused for bitmaps.
+      *data++ = ((i->color >> 24) & 0xff) / 255.0f;
+      *data++ = ((i->color >> 16) & 0xff) / 255.0f;
+      *data++ = ((i->color >>  8) & 0xff) / 255.0f;
+      *data++ = (255 - (i->color & 0xff)) / 255.0f;
+
+      x += i->w;
+      if ((unsigned)i->h > row_height)
+         row_height = i->h;
+   }
+   av_free(items);
+
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+   glBindTexture(GL_TEXTURE_2D, overlay_atlas);
+   if (bitmap)
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, UPLOAD_FORMAT, UPLOAD_TYPE, overlay_staging);
+   else
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RED, GL_UNSIGNED_BYTE, overlay_staging);
+   glBindTexture(GL_TEXTURE_2D, 0);
+   glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+   glBindBuffer(GL_ARRAY_BUFFER, overlay_instance_vbo);
+   glBufferData(GL_ARRAY_BUFFER, count * OVERLAY_INSTANCE_FLOATS * sizeof(GLfloat),
+         overlay_instance_data, GL_STREAM_DRAW);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Draws the subtitles of the frame at time over the current framebuffer.
+static void render_subtitle_overlay(double time)
+{
+   // Keeps showing the previous images if these aren't rendered yet.
+   struct subtitle_images *images;
+   if (subtitle_cache_get(time, false, &images))
+   {
+      if (!images)
+         overlay_instances = 0;
+      else if (images->serial != overlay_serial)
+      {
+         update_subtitle_overlay(images);
+         overlay_serial = images->serial;
+      }
+      subtitle_images_put(images);
+   }
+
+   if (!overlay_instances)
+      return;
+
+   glUseProgram(overlay_prog);
+   glUniform1f(overlay_bitmap_uniform, overlay_atlas_rgba ? 1.0f : 0.0f);
+   glBindTexture(GL_TEXTURE_2D, overlay_atlas);
+   glEnable(GL_BLEND);
+   glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+   // The texture coordinates of the video quad double as the unit quad.
+   glBindBuffer(GL_ARRAY_BUFFER, vbo);
+   glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE,
+         4 * sizeof(GLfloat), (const GLvoid*)(2 * sizeof(GLfloat)));
+   glEnableVertexAttribArray(0);
+
+   glBindBuffer(GL_ARRAY_BUFFER, overlay_instance_vbo);
+   for (unsigned i = 0; i < 3; i++)
+   {
+      glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE,
+            OVERLAY_INSTANCE_FLOATS * sizeof(GLfloat), (const GLvoid*)(4 * i * sizeof(GLfloat)));
+      glVertexAttribDivisor(2 + i, 1);
+      glEnableVertexAttribArray(2 + i);
+   }
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+   glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, overlay_instances);
+
+   for (unsigned i = 0; i < 3; i++)
+   {
+      glVertexAttribDivisor(2 + i, 0);
+      glDisableVertexAttribArray(2 + i);
+   }
+   glDisableVertexAttribArray(0);
+   glDisable(GL_BLEND);
+}
+#endif
+#endif
+
+#ifdef HAVE_MOTION_INTERP
+// Returns the picture to show at min_pts, NULL to dupe the last one.
+static const void *interpolate_frame(double min_pts, bool fresh)
+{
+   if (fresh)
+   {
+      double gap = frames[1].pts - frames[0].pts;
+      motion_interp_valid = gap > 0.0 && gap < MOTION_INTERP_MAX_GAP &&
+         motion_interp_set_frames(motion_interp, frames[0].pixels, frames[1].pixels);
+   }
+
+   float phase = (min_pts - frames[0].pts) / (frames[1].pts - frames[0].pts);
+   const void *frame;
+   if (motion_interp_valid && phase > 0.0f && phase < 1.0f)
+   {
+      motion_interp_render(motion_interp, motion_interp_output, phase);
+      frame = motion_interp_output;
+   }
+   else
+      frame = phase <= 0.0f ? frames[0].pixels : frames[1].pixels;
+
+   if (!fresh && frame == motion_interp_shown && frame != motion_interp_output)
+      return NULL;
+   motion_interp_shown = frame;
+   return frame;
+}
+#endif
+
+void retro_run(void)
+{
+   bool updated = false;
+
+   if (!first_frame_presented)
+      first_frame_runs++;
+
+#if defined(HAVE_GL_FFT) || defined(HAVE_CPU_FFT)
+   unsigned old_fft_width = fft_width;
+   unsigned old_fft_height = fft_height;
+#endif
+#ifdef HAVE_GL_FFT
+   unsigned old_fft_multisample = fft_multisample;
+#endif
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+      check_variables();
+
+#if defined(HAVE_GL_FFT) || defined(HAVE_CPU_FFT)
+   if (fft_width != old_fft_width || fft_height != old_fft_height)
+   {
+      struct retro_system_av_info info;
+      retro_get_system_av_info(&info);
+      if (!environ_cb(RETRO_ENVIRONMENT_SET_SYSTEM_AV_INFO, &info))
+      {
+         fft_width = old_fft_width;
+         fft_height = old_fft_height;
+      }
+#ifdef HAVE_CPU_FFT
+      else if (spectrum)
+      {
+         spectrum_free(spectrum);
+         spectrum = spectrum_new(11, fft_width, fft_height);
+      }
+#endif
+   }
+#endif
+
+#ifdef HAVE_GL_FFT
+   if (fft && (old_fft_multisample != fft_multisample))
+      glfft_init_multisample(fft, fft_width, fft_height, fft_multisample);
+#endif
+
+   input_poll_cb();
+
+   int seek_seconds = 0;
+   static bool last_left;
+   static bool last_right;
+   static bool last_up;
+   static bool last_down;
+   static bool last_l;
+   static bool last_r;
+   bool left = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
+         RETRO_DEVICE_ID_JOYPAD_LEFT);
+   bool right = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
+         RETRO_DEVICE_ID_JOYPAD_RIGHT);
+   bool up = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
+         RETRO_DEVICE_ID_JOYPAD_UP);
+   bool down = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
+         RETRO_DEVICE_ID_JOYPAD_DOWN);
+   bool l = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
+         RETRO_DEVICE_ID_JOYPAD_L);
+   bool r = input_state_cb(0, RETRO_DEVICE_JOYPAD, 0,
+         RETRO_DEVICE_ID_JOYPAD_R);
+
+   if (left && !last_left)
+      seek_seconds -= 10;
+   if (right && !last_right)
+      seek_seconds += 10;
+   if (up && !last_up)
+      seek_seconds += 60;
+   if (down && !last_down)
+      seek_seconds -= 60;
+
+   if (l && !last_l && audio_streams_num > 0)
+   {
+      slock_lock(decode_thread_lock);
+      audio_streams_ptr = (audio_streams_ptr + 1) % audio_streams_num;
+      slock_unlock(decode_thread_lock);
+      audio_clock_valid = false;
+      playback_epoch++;
+
+      char msg[256];
+      snprintf(msg, sizeof(msg), "Audio Track #%d.", audio_streams_ptr);
+      environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &(struct retro_message) { .msg = msg, .frames = 180 });
+   }
+   else if (r && !last_r && subtitle_streams_num > 0)
+   {
+      slock_lock(decode_thread_lock);
+      subtitle_streams_ptr = (subtitle_streams_ptr + 1) % subtitle_streams_num;
+      slock_unlock(decode_thread_lock);
+#ifdef HAVE_SSA
+      subtitle_cache_invalidate(INT64_MIN, INT64_MAX);
+#endif
+
+      char msg[256];
+      snprintf(msg, sizeof(msg), "Subtitle Track #%d.", subtitle_streams_ptr);
+      environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &(struct retro_message) { .msg = msg, .frames = 180 });
+   }
+
+   last_left = left;
+   last_right = right;
+   last_up = up;
+   last_down = down;
+   last_l = l;
+   last_r = r;
+
+   // Push seek request to thread,
+   // wait for seek to complete.
+   if (seek_seconds)
+   {
+      play_time += seek_seconds;
+      if (play_time < 0.0)
+         play_time = 0.0;
+
+      slock_lock(fifo_lock);
+
+      queue_seek();
+
+      char msg[256];
       snprintf(msg, sizeof(msg), "Seek: %u s.", (unsigned)seek_time);
       environ_cb(RETRO_ENVIRONMENT_SET_MESSAGE, &(struct retro_message) { .msg = msg, .frames = 180 });
 
-      if (seek_frames < 0)
+      if (seek_seconds < 0)
+      {
+         log_cb(RETRO_LOG_INFO, "Resetting PTS.\n");
+         frames[0].pts = 0.0;
+         frames[1].pts = 0.0;
+      }
+      slock_unlock(fifo_lock);
+   }
+
+   // Wait for any pending seek, including ones queued by retro_unserialize().
+   slock_lock(fifo_lock);
+   while (!decode_thread_dead && do_seek)
+      scond_wait(fifo_cond, fifo_lock);
+   slock_unlock(fifo_lock);
+
+   if (decode_thread_dead)
+   {
+      environ_cb(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
+      return;
+   }
+
+   if (audio_callback_registered)
+   {
+      slock_lock(fifo_lock);
+      main_run_time = av_gettime();
+      bool enabled = audio_callback_enabled;
+      if (enabled != audio_callback_in_use)
+      {
+         // Push mode counts samples from here on.
+         audio_callback_in_use = enabled;
+         audio_frames = play_time * media.sample_rate;
+         playback_epoch++;
+         audio_clock_valid = false;
+         audio_drift_delta = 0;
+      }
+      slock_unlock(fifo_lock);
+   }
+
+   double frame_time = 1.0 / media.interpolate_fps;
+   if (frame_time_usec > 0)
+   {
+      frame_time = frame_time_usec / 1000000.0;
+      if (frame_time > MAX_FRAME_TIME_FRAMES / media.interpolate_fps)
+         frame_time = MAX_FRAME_TIME_FRAMES / media.interpolate_fps;
+   }
+   play_time += frame_time;
+
+   static int16_t audio_buffer[2 * MAX_AUDIO_PUSH_FRAMES];
+   size_t to_read_frames = 0;
+   bool presented = video_stream < 0;
+
+   // Have to decode audio before video incase there are PTS fuckups due
+   // to seeking.
+   if (audio_callback_in_use)
+   {
+      // Video follows the audio device. Small drift is smoothed out,
+      // large jumps (stalls, seeks) make video skip ahead.
+      slock_lock(fifo_lock);
+      bool valid = audio_callback_pts_valid;
+      double bias = audio_callback_pts - play_time;
+      slock_unlock(fifo_lock);
+
+      if (valid)
+      {
+         double drift = bias - pts_bias;
+         if (!audio_clock_valid || fabs(drift) > AUDIO_DRIFT_RESYNC)
+         {
+            if (bias < pts_bias - 1.0)
+            {
+               log_cb(RETRO_LOG_INFO, "Resetting PTS (bias).\n");
+               frames[0].pts = 0.0;
+               frames[1].pts = 0.0;
+            }
+
+            pts_bias = bias;
+            audio_clock_valid = true;
+         }
+         else
+            pts_bias += drift * AUDIO_DRIFT_SMOOTHING;
+      }
+   }
+   else if (audio_streams_num > 0)
+   {
+      // Audio
+      uint64_t expected_audio_frames = play_time * media.sample_rate;
+      to_read_frames = expected_audio_frames > audio_frames ? expected_audio_frames - audio_frames : 0;
+      // Anything beyond this is picked up next frame.
+      if (to_read_frames > MAX_AUDIO_PUSH_FRAMES)
+         to_read_frames = MAX_AUDIO_PUSH_FRAMES;
+      size_t to_read_bytes = to_read_frames * sizeof(int16_t) * 2;
+
+      unsigned fifo_index = audio_fifo_index(audio_streams_ptr);
+
+      // The decode thread may replace the FIFO while we sleep.
+      slock_lock(fifo_lock);
+      while (!decode_thread_dead && fifo_read_avail(audio_decode_fifo[fifo_index]) < to_read_bytes)
+      {
+#ifdef HAVE_DIRECT_UPLOAD
+         // The decoder might be stuck on a slot before it gets to the audio.
+         if (direct_upload_uploading())
+         {
+            slock_unlock(fifo_lock);
+            direct_upload_reclaim(true);
+            slock_lock(fifo_lock);
+            continue;
+         }
+#endif
+         main_sleeping = true;
+         scond_broadcast(fifo_decode_cond);
+         scond_wait(fifo_cond, fifo_lock);
+         main_sleeping = false;
+      }
+      fifo_buffer_t *fifo = audio_decode_fifo[fifo_index];
+
+      double reading_pts = decode_last_audio_time[fifo_index] -
+         (double)fifo_read_avail(fifo) / (media.sample_rate * sizeof(int16_t) * 2);
+
+      double expected_pts = (double)audio_frames / media.sample_rate;
+
+      double bias = reading_pts - expected_pts;
+      double drift = bias - pts_bias;
+      if (!audio_clock_valid || fabs(drift) > AUDIO_DRIFT_RESYNC)
+      {
+         if (bias < pts_bias - 1.0)
+         {
+            log_cb(RETRO_LOG_INFO, "Resetting PTS (bias).\n");
+            frames[0].pts = 0.0;
+            frames[1].pts = 0.0;
+         }
+
+         pts_bias = bias;
+         audio_drift = 0.0;
+         audio_drift_delta = 0;
+         audio_clock_valid = true;
+      }
+      else
+      {
+         // Positive drift means audio is ahead, so stretch it out a bit.
+         audio_drift += (drift - audio_drift) * AUDIO_DRIFT_SMOOTHING;
+         double skew = audio_drift / AUDIO_DRIFT_TIME;
+         if (skew > AUDIO_MAX_SKEW)
+            skew = AUDIO_MAX_SKEW;
+         else if (skew < -AUDIO_MAX_SKEW)
+            skew = -AUDIO_MAX_SKEW;
+         audio_drift_delta = lrint(skew * media.sample_rate);
+      }
+
+      if (!decode_thread_dead)
+      {
+         fifo_read(fifo, audio_buffer, to_read_bytes);
+         drop_inactive_audio(fifo_index, reading_pts + (double)to_read_frames / media.sample_rate);
+      }
+      scond_broadcast(fifo_decode_cond);
+
+      slock_unlock(fifo_lock);
+      audio_frames += to_read_frames;
+   }
+
+   double min_pts = play_time + pts_bias;
+   if (video_stream >= 0)
+   {
+#ifndef HAVE_GL
+      bool dupe = true;
+#endif
+      // Video
+      while (!decode_thread_dead && min_pts > frames[1].pts)
+      {
+         // Keep frames[0] the picture right before frames[1], even when catching up.
+         struct frame tmp = frames[1];
+         frames[1] = frames[0];
+         frames[0] = tmp;
+
+#ifdef HAVE_GL
+         struct upload upload;
+         upload_begin(&upload);
+#endif
+
+#ifdef HAVE_DIRECT_UPLOAD
+         direct_upload_reclaim(false);
+#endif
+         slock_lock(fifo_lock);
+         while (!decode_thread_dead && fifo_read_avail(video_decode_fifo) < video_entry_size())
+         {
+#ifdef HAVE_DIRECT_UPLOAD
+            // The decode thread might be out of slots, and only we can hand them back.
+            if (direct_upload_uploading())
+            {
+               slock_unlock(fifo_lock);
+               direct_upload_reclaim(true);
+               slock_lock(fifo_lock);
+               continue;
+            }
+#endif
+            main_sleeping = true;
+            scond_broadcast(fifo_decode_cond);
+            scond_wait(fifo_cond, fifo_lock);
+            main_sleeping = false;
+         }
+
+         double pts = 0.0;
+         if (!decode_thread_dead)
+         {
+            presented = true;
+            video_entries_read++;
+            fifo_read(video_decode_fifo, &pts, sizeof(pts));
+#if defined(HAVE_GL)
+            upload_read(&upload);
+#else
+            void *dst = video_frame_temp_buffer;
+#ifdef HAVE_MOTION_INTERP
+            if (motion_interp)
+               dst = frames[1].pixels;
+#endif
+            fifo_read(video_decode_fifo, dst, media.width * media.height * video_pixel_size);
+            dupe = false;
+#endif
+         }
+
+         scond_broadcast(fifo_decode_cond);
+         slock_unlock(fifo_lock);
+
+#ifdef HAVE_GL
+         upload_end(&upload, frames[1].tex);
+#endif
+         frames[1].pts = pts;
+      }
+
+#ifdef HAVE_GL
+      float mix_factor = (min_pts - frames[0].pts) / (frames[1].pts - frames[0].pts);
+      bool blend = temporal_interpolation && mix_factor > 0.0f && mix_factor < 1.0f;
+
+      glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
+      glClearColor(0, 0, 0, 1);
+      glClear(GL_COLOR_BUFFER_BIT);
+      glViewport(0, 0, media.width, media.height);
+
+      bool framebuffer_encode;
+      if (blend)
+      {
+         glUseProgram(prog);
+         glUniform1f(mix_loc, mix_factor);
+         set_srgb_decode(&frames[0], true);
+         set_srgb_decode(&frames[1], true);
+         glActiveTexture(GL_TEXTURE1);
+         glBindTexture(GL_TEXTURE_2D, frames[1].tex);
+         glActiveTexture(GL_TEXTURE0);
+         glBindTexture(GL_TEXTURE_2D, frames[0].tex);
+         framebuffer_encode = srgb_framebuffer;
+      }
+      else
+      {
+         struct frame *frame = mix_factor <= 0.0f ? &frames[0] : &frames[1];
+         glUseProgram(copy_prog);
+         set_srgb_decode(frame, false);
+         glBindTexture(GL_TEXTURE_2D, frame->tex);
+         framebuffer_encode = srgb_framebuffer && srgb_textures && !srgb_skip_decode;
+      }
+
+#ifndef GLES
+      if (framebuffer_encode)
+         glEnable(GL_FRAMEBUFFER_SRGB);
+#else
+      (void)framebuffer_encode;
+#endif
+
+      glBindBuffer(GL_ARRAY_BUFFER, vbo);
+      glVertexAttribPointer(vertex_loc, 2, GL_FLOAT, GL_FALSE,
+            4 * sizeof(GLfloat), (const GLvoid*)(0 * sizeof(GLfloat)));
+      glVertexAttribPointer(tex_loc, 2, GL_FLOAT, GL_FALSE,
+            4 * sizeof(GLfloat), (const GLvoid*)(2 * sizeof(GLfloat)));
+      glEnableVertexAttribArray(vertex_loc);
+      glEnableVertexAttribArray(tex_loc);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      glDisableVertexAttribArray(vertex_loc);
+      glDisableVertexAttribArray(tex_loc);
+
+#ifndef GLES
+      if (framebuffer_encode)
+         glDisable(GL_FRAMEBUFFER_SRGB);
+#endif
+
+#ifdef HAVE_SUBTITLE_OVERLAY
+      if (subtitle_overlay)
+         render_subtitle_overlay(mix_factor <= 0.0f ? frames[0].pts : frames[1].pts);
+#endif
+
+      glUseProgram(0);
+      glActiveTexture(GL_TEXTURE1);
+      glBindTexture(GL_TEXTURE_2D, 0);
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, 0);
+
+      video_cb(RETRO_HW_FRAME_BUFFER_VALID, media.width, media.height, media.width * sizeof(uint32_t));
+#else
+      const void *frame = dupe ? NULL : video_frame_temp_buffer;
+#ifdef HAVE_MOTION_INTERP
+      if (motion_interp)
+         frame = interpolate_frame(min_pts, !dupe);
+#endif
+      video_cb(frame, media.width, media.height, media.width * video_pixel_size);
+#endif
+   }
+#ifdef HAVE_GL_FFT
+   else if (fft)
+   {
+      unsigned frames = to_read_frames;
+      const int16_t *buffer = audio_buffer;
+      while (frames)
+      {
+         unsigned to_read = frames;
+         if (to_read > (1 << 11)) // FFT size we use (1 << 11). Really shouldn't happen unless we use a crazy high sample rate.
+            to_read = 1 << 11;
+         glfft_step_fft(fft, buffer, to_read);
+         buffer += to_read * 2;
+         frames -= to_read;
+      }
+      glfft_render(fft, hw_render.get_current_framebuffer(), fft_width, fft_height);
+      video_cb(RETRO_HW_FRAME_BUFFER_VALID, fft_width, fft_height, fft_width * sizeof(uint32_t));
+   }
+#endif
+#ifdef HAVE_CPU_FFT
+   else if (spectrum)
+   {
+      if (to_read_frames)
+         spectrum_step(spectrum, audio_buffer, to_read_frames);
+      video_cb(spectrum_render(spectrum), fft_width, fft_height, fft_width * sizeof(uint32_t));
+   }
+#endif
+   else
+      video_cb(NULL, 1, 1, sizeof(uint32_t));
+
+   if (to_read_frames)
+      audio_batch_cb(audio_buffer, to_read_frames);
+
+   if (presented && !first_frame_presented)
+   {
+      first_frame_presented = true;
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Time to first frame: %.1f ms, retro_run() #%u.\n",
+            (av_gettime() - load_start_time) / 1000.0, first_frame_runs);
+
+      if (audio_streams_num > 1 || subtitle_streams_num > 1)
+         codec_prewarm_handle = sthread_create(codec_prewarm_thread, NULL);
+   }
+}
+
+static bool open_codec(AVCodecContext **ctx, unsigned index)
+{
+   AVCodec *codec = avcodec_find_decoder(fctx->streams[index]->codec->codec_id);
+   if (!codec)
+   {
+      log_cb(RETRO_LOG_ERROR, "Couldn't find suitable decoder, exiting ... \n");
+      return false;
+   }
+
+   AVCodecContext *codec_ctx = fctx->streams[index]->codec;
+   if (avcodec_open2(codec_ctx, codec, NULL) < 0)
+      return false;
+
+   *ctx = codec_ctx;
+   return true;
+}
+
+static AVCodecContext *open_codec_lazy(AVCodecContext **ctx, bool *failed, unsigned index)
+{
+   slock_lock(codec_open_lock);
+   if (!*ctx && !*failed && !open_codec(ctx, index))
+   {
+      log_cb(RETRO_LOG_ERROR, "[FFmpeg]: Failed to open codec for stream #%u.\n", index);
+      *failed = true;
+   }
+   AVCodecContext *ret = *ctx;
+   slock_unlock(codec_open_lock);
+   return ret;
+}
+
+static void codec_prewarm_thread(void *data)
+{
+   (void)data;
+   int64_t start = av_gettime();
+
+   for (int i = 0; i < audio_streams_num && !codec_prewarm_dead; i++)
+      open_codec_lazy(&actx[i], &actx_failed[i], audio_streams[i]);
+   for (int i = 0; i < subtitle_streams_num && !codec_prewarm_dead; i++)
+      open_codec_lazy(&sctx[i], &sctx_failed[i], subtitle_streams[i]);
+
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Prewarmed remaining codecs in %.1f ms.\n",
+         (av_gettime() - start) / 1000.0);
+}
+
+static bool codec_is_image(enum AVCodecID id)
+{
+   switch (id)
+   {
+      case AV_CODEC_ID_MJPEG:
+      case AV_CODEC_ID_PNG:
+         return true;
+
+      default:
+         return false;
+   }
+}
+
+static bool exceeds_max_output(unsigned width, unsigned height)
+{
+   return max_output_width && (width > max_output_width || height > max_output_height);
+}
+
+// Let the decoder skip work by decoding at 1/2, 1/4, ... size,
+// as long as the result is still at least as large as the cap.
+static void set_video_lowres(AVCodecContext *ctx)
+{
+   AVCodec *codec = avcodec_find_decoder(ctx->codec_id);
+   if (!codec || !exceeds_max_output(ctx->width, ctx->height))
+      return;
+
+   int lowres = 0;
+   while (lowres < codec->max_lowres &&
+         (unsigned)(ctx->width >> (lowres + 1)) >= max_output_width &&
+         (unsigned)(ctx->height >> (lowres + 1)) >= max_output_height)
+      lowres++;
+
+   if (lowres)
+   {
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Decoding video at 1/%d size.\n", 1 << lowres);
+      ctx->lowres = lowres;
+   }
+}
+
+#ifdef HAVE_SSA
+// PGS, DVB and VobSub, composited like libass output.
+static bool codec_is_bitmap_subtitle(enum AVCodecID id)
+{
+   switch (id)
+   {
+      case AV_CODEC_ID_HDMV_PGS_SUBTITLE:
+      case AV_CODEC_ID_DVB_SUBTITLE:
+      case AV_CODEC_ID_DVD_SUBTITLE:
+         return true;
+
+      default:
+         return false;
+   }
+}
+#endif
+
+static bool open_codecs(void)
+{
+   video_stream = -1;
+   memset(audio_streams, 0, sizeof(audio_streams));
+   memset(subtitle_streams, 0, sizeof(subtitle_streams));
+   audio_streams_num = 0;
+   audio_streams_ptr = 0;
+   subtitle_streams_num = 0;
+   subtitle_streams_ptr = 0;
+
+   for (unsigned i = 0; i < fctx->nb_streams; i++)
+   {
+      switch (fctx->streams[i]->codec->codec_type)
+      {
+         case AVMEDIA_TYPE_AUDIO:
+            if (audio_streams_num < MAX_STREAMS)
+            {
+               if (audio_streams_num == 0 && !open_codec(&actx[0], i))
+                  return false;
+               audio_streams[audio_streams_num] = i;
+               audio_streams_num++;
+            }
+            break;
+
+         case AVMEDIA_TYPE_VIDEO:
+            if (!vctx && !codec_is_image(fctx->streams[i]->codec->codec_id))
+            {
+               set_video_lowres(fctx->streams[i]->codec);
+#ifdef HAVE_FILTERS
+               // Decoded pictures are handed over to the filter thread.
+               if (video_filter)
+                  fctx->streams[i]->codec->refcounted_frames = 1;
+#endif
+               if (!open_codec(&vctx, i))
+                  return false;
+               video_stream = i;
+            }
+            break;
+
+         case AVMEDIA_TYPE_SUBTITLE:
+#ifdef HAVE_SSA
+            if (subtitle_streams_num < MAX_STREAMS && (fctx->streams[i]->codec->codec_id == AV_CODEC_ID_SSA ||
+                     codec_is_bitmap_subtitle(fctx->streams[i]->codec->codec_id)))
+            {
+               AVCodecContext *s = fctx->streams[i]->codec;
+               subtitle_streams[subtitle_streams_num] = i;
+               subtitle_is_bitmap[subtitle_streams_num] = codec_is_bitmap_subtitle(s->codec_id);
+               if (subtitle_streams_num == 0 && !open_codec(&sctx[0], i))
+                  return false;
+
+               int size = s->extradata ? s->extradata_size : 0;
+               ass_extra_data_size[subtitle_streams_num] = size;
+
+               if (size)
+               {
+                  ass_extra_data[subtitle_streams_num] = av_malloc(size);
+                  memcpy(ass_extra_data[subtitle_streams_num], s->extradata, size);
+               }
+
+               subtitle_streams_num++;
+            }
+#endif
+            break;
+
+         case AVMEDIA_TYPE_ATTACHMENT:
+         {
+            AVCodecContext *ctx = fctx->streams[i]->codec;
+            if (ctx->codec_id == AV_CODEC_ID_TTF)
+               append_attachment(ctx->extradata, ctx->extradata_size);
+            break;
+         }
+
+         default:
+            break;
+      }
+   }
+
+   return actx[0] || vctx;
+}
+
+static bool init_media_info(void)
+{
+   if (actx[0])
+      media.sample_rate = output_sample_rate ? output_sample_rate : actx[0]->sample_rate;
+
+   media.interpolate_fps = 60.0;
+   if (vctx)
+   {
+      // With lowres, the codec context already reports the reduced size.
+      media.src_width  = vctx->width;
+      media.src_height = vctx->height;
+      media.width  = vctx->width;
+      media.height = vctx->height;
+      media.aspect = (float)vctx->width * av_q2d(vctx->sample_aspect_ratio) / vctx->height;
+
+      if (exceeds_max_output(media.width, media.height))
+      {
+         double scale = (double)max_output_width / media.width;
+         if ((double)max_output_height / media.height < scale)
+            scale = (double)max_output_height / media.height;
+         media.width  = (unsigned)(media.width * scale) & ~1u;
+         media.height = (unsigned)(media.height * scale) & ~1u;
+
+         log_cb(RETRO_LOG_INFO, "[FFmpeg]: Scaling %ux%u video to %ux%u.\n",
+               media.src_width, media.src_height, media.width, media.height);
+      }
+   }
+
+   return true;
+}
+
+#ifdef HAVE_SSA
+// Fontconfig keeps the fonts it scanned in a cache, but often has none configured or can't write it
+// where the core runs, and then scans every font on the system on each load.
+// The config written here adds a cache in the system directory on top of the default config.
+static const char *subtitle_font_config(void)
+{
+   const char *system_dir = NULL;
+   if (!environ_cb(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY, &system_dir) || !system_dir)
+      return NULL;
+
+   snprintf(ass_font_config, sizeof(ass_font_config), "%s/ffmpeg_fonts.conf", system_dir);
+
+   FILE *file = fopen(ass_font_config, "r");
+   if (file)
+   {
+      fclose(file);
+      return ass_font_config;
+   }
+
+   file = fopen(ass_font_config, "w");
+   if (!file)
+      return NULL;
+
+   fprintf(file,
+         "<?xml version=\"1.0\"?>\n"
+         "<!DOCTYPE fontconfig SYSTEM \"fonts.dtd\">\n"
+         "<fontconfig>\n"
+         "   <include ignore_missing=\"yes\">fonts.conf</include>\n"
+         "   <cachedir>%s/ffmpeg_font_cache</cachedir>\n"
+         "</fontconfig>\n", system_dir);
+   bool ok = !ferror(file);
+   if (fclose(file) || !ok)
+      return NULL;
+
+   return ass_font_config;
+}
+
+static void init_subtitle_fonts(void *data)
+{
+   const char *config = data;
+   int64_t start = av_gettime();
+
+   slock_lock(ass_lock);
+   for (size_t i = 0; i < attachments_size; i++)
+   {
+      // Can't tell which font this is, so it might be needed anywhere.
+      if (font_has_name(attachments[i].data, attachments[i].size, "") < 0)
+      {
+         ass_add_font(ass, (char*)"", (char*)attachments[i].data, attachments[i].size);
+         attachments[i].loaded = true;
+      }
+   }
+
+   for (int i = 0; i < subtitle_streams_num; i++)
+      for (int j = 0; ass_track[i] && j < ass_track[i]->n_styles; j++)
+         if (ass_track[i]->styles[j].FontName)
+            load_attachment_fonts(ass_track[i]->styles[j].FontName);
+   slock_unlock(ass_lock);
+
+   // The slow part, the decode thread keeps feeding events meanwhile.
+   ass_set_fonts(ass_render, NULL, NULL, 1, config, 1);
+
+   // Events which came in during the scan didn't load their fonts yet.
+   slock_lock(ass_lock);
+   for (int i = 0; i < subtitle_streams_num; i++)
+      for (int j = 0; ass_track[i] && j < ass_track[i]->n_events; j++)
+         load_event_fonts(ass_track[i]->events[j].Text);
+
+   slock_lock(decode_thread_lock);
+   ass_fonts_ready = true;
+   scond_broadcast(ass_ready_cond);
+   slock_unlock(decode_thread_lock);
+   slock_unlock(ass_lock);
+
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Subtitle fonts initialized in %.1f ms.\n",
+         (av_gettime() - start) / 1000.0);
+
+   // Whatever was rendered before is empty.
+   subtitle_cache_invalidate(INT64_MIN, INT64_MAX);
+}
+
+static void init_subtitles(void)
+{
+   bool text_tracks = false;
+   for (int i = 0; i < subtitle_streams_num; i++)
+      text_tracks |= !subtitle_is_bitmap[i];
+
+   // Bitmap tracks don't need libass, nor fonts.
+   if (text_tracks)
+   {
+      ass = ass_library_init();
+      ass_set_message_cb(ass, ass_msg_cb, NULL);
+
+      ass_render = ass_renderer_init(ass);
+      ass_set_frame_size(ass_render, media.width, media.height);
+      ass_set_extract_fonts(ass, true);
+      ass_set_hinting(ass_render, ASS_HINTING_LIGHT);
+
+      for (int i = 0; i < subtitle_streams_num; i++)
+      {
+         if (subtitle_is_bitmap[i])
+            continue;
+
+         ass_track[i] = ass_new_track(ass);
+         ass_process_codec_private(ass_track[i], (char*)ass_extra_data[i],
+               ass_extra_data_size[i]);
+         sub_events[i].synced = true;
+      }
+   }
+
+   slock_lock(decode_thread_lock);
+   ass_ready = true;
+   scond_broadcast(ass_ready_cond);
+   slock_unlock(decode_thread_lock);
+
+   if (text_tracks)
+      ass_init_handle = sthread_create(init_subtitle_fonts, (void*)subtitle_font_config());
+}
+#endif
+
+static void set_colorspace(struct SwsContext *sws,
+      unsigned width, unsigned height, enum AVColorSpace default_color, int in_range)
+{
+   const int *coeffs = NULL;
+   if (colorspace == AVCOL_SPC_UNSPECIFIED)
+   {
+      if (default_color != AVCOL_SPC_UNSPECIFIED)
+         coeffs = sws_getCoefficients(default_color);
+      else if (width >= 1280 || height > 576)
+         coeffs = sws_getCoefficients(AVCOL_SPC_BT709);
+      else
+         coeffs = sws_getCoefficients(AVCOL_SPC_BT470BG);
+   }
+   else
+      coeffs = sws_getCoefficients(colorspace);
+
+   if (coeffs)
+   {
+      int in_full, out_full, brightness, contrast, saturation;
+      const int *inv_table, *table;
+      sws_getColorspaceDetails(sws, (int**)&inv_table, &in_full,
+            (int**)&table, &out_full,
+            &brightness, &contrast, &saturation);
+
+      if (in_range != AVCOL_RANGE_UNSPECIFIED)
+         in_full = in_range == AVCOL_RANGE_JPEG;
+
+      inv_table = coeffs;
+      sws_setColorspaceDetails(sws, inv_table, in_full,
+            table, out_full,
+            brightness, contrast, saturation);
+   }
+}
+
+static int scaler_flags(enum scaler_profile profile)
+{
+   bool scaling = media.width != media.src_width || media.height != media.src_height;
+
+   switch (profile)
+   {
+      case SCALER_FAST:
+         return scaling ? SWS_FAST_BILINEAR : SWS_POINT;
+
+      case SCALER_QUALITY:
+         return SWS_BICUBIC | SWS_ACCURATE_RND | SWS_FULL_CHR_H_INT | SWS_FULL_CHR_H_INP;
+
+      default:
+         return scaling ? SWS_BILINEAR : SWS_POINT;
+   }
+}
+
+static struct SwsContext *get_scaler(struct SwsContext *sws, int flags)
+{
+   return sws_getCachedContext(sws,
+         media.src_width, media.src_height, vctx->pix_fmt,
+         media.width, media.height, conv_pix_fmt,
+         flags, NULL, NULL, NULL);
+}
+
+static void scale_video(struct SwsContext *sws, AVFrame *frame, AVFrame *conv)
+{
+   set_colorspace(sws, media.src_width, media.src_height,
+         av_frame_get_colorspace(frame), av_frame_get_color_range(frame));
+   sws_scale(sws, (const uint8_t * const*)frame->data, frame->linesize, 0, media.src_height,
+         conv->data, conv->linesize);
+}
+
+// Converts a decoded frame with each profile, best quality first,
+// and returns the flags of the first one which fits the budget.
+static int benchmark_scalers(struct SwsContext **sws, AVFrame *frame, AVFrame *conv)
+{
+   static const enum scaler_profile candidates[] = { SCALER_QUALITY, SCALER_BALANCED };
+
+   double fps = av_q2d(fctx->streams[video_stream]->avg_frame_rate);
+   if (fps <= 0.0)
+      fps = 30.0;
+   int64_t budget = SCALER_BUDGET_FRACTION * 1000000.0 / fps;
+
+   for (unsigned i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+   {
+      int flags = scaler_flags(candidates[i]);
+      *sws = get_scaler(*sws, flags);
+
+      int64_t best = INT64_MAX;
+      for (unsigned run = 0; run < SCALER_BENCHMARK_RUNS; run++)
       {
-         log_cb(RETRO_LOG_INFO, "Resetting PTS.\n");
-         frames[0].pts = 0.0;
-         frames[1].pts = 0.0;
+         int64_t start = av_gettime();
+         scale_video(*sws, frame, conv);
+         int64_t time = av_gettime() - start;
+         if (time < best)
+            best = time;
       }
-      audio_frames = frame_cnt * media.sample_rate / media.interpolate_fps;
 
-      if (video_decode_fifo)
-         fifo_clear(video_decode_fifo);
-      if (audio_decode_fifo)
-         fifo_clear(audio_decode_fifo);
-      scond_signal(fifo_decode_cond);
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Scaler profile %u: %.2f ms (budget %.2f ms).\n",
+            (unsigned)candidates[i], best / 1000.0, budget / 1000.0);
+      if (best <= budget)
+         return flags;
+   }
 
-      while (!decode_thread_dead && do_seek)
-         scond_wait(fifo_cond, fifo_lock);
-      slock_unlock(fifo_lock);
+   int flags = scaler_flags(SCALER_FAST);
+   *sws = get_scaler(*sws, flags);
+   scale_video(*sws, frame, conv);
+   return flags;
+}
+
+static bool decode_video(AVPacket *pkt, AVFrame *frame)
+{
+   int got_ptr = 0;
+   int ret = avcodec_decode_video2(vctx, frame, &got_ptr, pkt);
+   if (ret < 0)
+      return false;
+
+   return got_ptr;
+}
+
+#ifdef HAVE_DIRECT_UPLOAD
+static int direct_upload_free_slot(void)
+{
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      if (direct_slots[i].state == DIRECT_SLOT_FREE)
+         return i;
    }
+   return -1;
+}
 
-   if (decode_thread_dead)
+// Picks the slot the next picture is scaled into, -1 if the pool is not active.
+// Returns false if the picture has to be dropped.
+// Caller holds fifo_lock.
+static bool direct_upload_acquire(int *index)
+{
+   *index = -1;
+   while (direct_upload_active && !decode_thread_dead)
    {
-      environ_cb(RETRO_ENVIRONMENT_SHUTDOWN, NULL);
-      return;
+      int slot = direct_upload_free_slot();
+      if (slot >= 0)
+      {
+         direct_slots[slot].state = DIRECT_SLOT_WRITING;
+         *index = slot;
+         return true;
+      }
+
+      // retro_run() hands back uploaded slots before it sleeps, so while it sleeps
+      // every slot is queued. Waiting only helps if it is waiting for video.
+      if (!main_sleeping || fifo_read_avail(video_decode_fifo) < video_entry_size())
+         scond_wait(fifo_decode_cond, fifo_lock);
+      else
+      {
+         // It waits on audio instead. Free up the oldest picture, not the whole queue.
+         drop_video_frame();
+      }
    }
 
-   frame_cnt++;
+   return !decode_thread_dead;
+}
+#endif
+
+// Called with fifo_lock held when the main thread is starved while an audio FIFO is full,
+// i.e. the file interleaves audio further ahead of video than the FIFO holds.
+static bool grow_audio_fifo(unsigned index)
+{
+   fifo_buffer_t *fifo = audio_decode_fifo[index];
+   size_t avail = fifo_read_avail(fifo);
+   size_t size = avail + fifo_write_avail(fifo);
+   size_t max_size = AUDIO_FIFO_MAX_SECONDS * media.sample_rate * sizeof(int16_t) * 2;
+   if (size >= max_size)
+      return false;
 
-   int16_t audio_buffer[2048];
-   size_t to_read_frames = 0;
+   size *= 2;
+   if (size > max_size)
+      size = max_size;
 
-   // Have to decode audio before video incase there are PTS fuckups due
-   // to seeking.
-   if (audio_streams_num > 0)
+   fifo_buffer_t *new_fifo = fifo_new(size + audio_history_size());
+   uint8_t *tmp = av_malloc(avail + 1);
+   if (!new_fifo || !tmp)
    {
-      // Audio
-      uint64_t expected_audio_frames = frame_cnt * media.sample_rate / media.interpolate_fps;
-      to_read_frames = expected_audio_frames - audio_frames;
-      size_t to_read_bytes = to_read_frames * sizeof(int16_t) * 2;
+      if (new_fifo)
+         fifo_free(new_fifo);
+      av_free(tmp);
+      return false;
+   }
 
-      slock_lock(fifo_lock);
-      while (!decode_thread_dead && fifo_read_avail(audio_decode_fifo) < to_read_bytes)
+   // The history doesn't move over, rewinding past this point seeks.
+   fifo_set_history(new_fifo, audio_history_size());
+   fifo_read(fifo, tmp, avail);
+   fifo_write(new_fifo, tmp, avail);
+   av_free(tmp);
+   fifo_free(fifo);
+   audio_decode_fifo[index] = new_fifo;
+
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Audio buffer grown to %.2f s.\n",
+         (double)size / (media.sample_rate * sizeof(int16_t) * 2));
+   return true;
+}
+
+static int16_t *decode_audio(int track, AVCodecContext *ctx, AVPacket *pkt, AVFrame *frame, int16_t *buffer, size_t *buffer_cap,
+      SwrContext *swr)
+{
+   unsigned fifo_index = audio_fifo_index(track);
+
+   AVPacket pkt_tmp = *pkt;
+
+   int got_ptr = 0;
+
+   for (;;)
+   {
+      int ret = 0;
+      ret = avcodec_decode_audio4(ctx, frame, &got_ptr, &pkt_tmp);
+      if (ret < 0)
+         return buffer;
+
+      pkt_tmp.data += ret;
+      pkt_tmp.size -= ret;
+
+      if (!got_ptr)
+         break;
+
+      // Output can be larger than input when upsampling.
+      int out_samples = av_rescale_rnd(swr_get_delay(swr, ctx->sample_rate) + frame->nb_samples,
+            media.sample_rate, ctx->sample_rate, AV_ROUND_UP);
+
+      size_t max_buffer = out_samples * sizeof(int16_t) * 2;
+      if (max_buffer > *buffer_cap)
       {
-         main_sleeping = true;
-         scond_signal(fifo_decode_cond);
-         scond_wait(fifo_cond, fifo_lock);
-         main_sleeping = false;
+         buffer = av_realloc(buffer, max_buffer);
+         *buffer_cap = max_buffer;
       }
 
-      double reading_pts = decode_last_audio_time -
-         (double)fifo_read_avail(audio_decode_fifo) / (media.sample_rate * sizeof(int16_t) * 2);
+      out_samples = swr_convert(swr,
+            (uint8_t*[]) { (uint8_t*)buffer },
+            out_samples,
+            (const uint8_t**)frame->data,
+            frame->nb_samples);
+      if (out_samples < 0)
+         continue;
 
-      double expected_pts = (double)audio_frames / media.sample_rate;
+      size_t required_buffer = out_samples * sizeof(int16_t) * 2;
+
+      int64_t pts = av_frame_get_best_effort_timestamp(frame);
 
-      double old_pts_bias = pts_bias;
-      pts_bias = reading_pts - expected_pts;
-      if (pts_bias < old_pts_bias - 1.0)
+      slock_lock(fifo_lock);
+      while (!decode_thread_dead && fifo_write_avail(audio_decode_fifo[fifo_index]) < required_buffer)
       {
-         log_cb(RETRO_LOG_INFO, "Resetting PTS (bias).\n");
-         frames[0].pts = 0.0;
-         frames[1].pts = 0.0;
+         if (!main_sleeping)
+            scond_wait(fifo_decode_cond, fifo_lock);
+         else if (!grow_audio_fifo(fifo_index))
+         {
+            log_cb(RETRO_LOG_ERROR, "Thread: Audio deadlock detected ...\n");
+            fifo_clear(audio_decode_fifo[fifo_index]);
+            break;
+         }
       }
 
+      // Time at the end of what we just wrote, so the reader can subtract the fill level directly.
+      decode_last_audio_time[fifo_index] = pts * av_q2d(fctx->streams[audio_streams[track]]->time_base) +
+         (double)out_samples / media.sample_rate;
       if (!decode_thread_dead)
-         fifo_read(audio_decode_fifo, audio_buffer, to_read_bytes);
-      scond_signal(fifo_decode_cond);
+         fifo_write(audio_decode_fifo[fifo_index], buffer, required_buffer);
 
+      int drift_delta = audio_drift_delta;
+
+      scond_signal(fifo_cond);
       slock_unlock(fifo_lock);
-      audio_frames += to_read_frames;
+
+      decode_audio_compensation_left[track] -= out_samples;
+      if (drift_delta != decode_audio_drift_delta[track] ||
+            (drift_delta && decode_audio_compensation_left[track] <= 0))
+      {
+         swr_set_compensation(swr, drift_delta, drift_delta ? (int)media.sample_rate : 0);
+         decode_audio_drift_delta[track] = drift_delta;
+         decode_audio_compensation_left[track] = media.sample_rate;
+      }
    }
 
-   double min_pts = frame_cnt / media.interpolate_fps + pts_bias;
-   if (video_stream >= 0)
+   return buffer;
+}
+
+static void decode_thread_seek(double time)
+{
+   int64_t seek_to = time * AV_TIME_BASE;
+   if (seek_to < 0)
+      seek_to = 0;
+
+   decode_last_video_time = time;
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+      decode_last_audio_time[i] = time;
+
+   int ret = avformat_seek_file(fctx, -1, INT64_MIN, seek_to, INT64_MAX, 0);
+   if (ret < 0)
+      log_cb(RETRO_LOG_ERROR, "av_seek_frame() failed.\n");
+
+   slock_lock(decode_thread_lock);
+   int audio_ptr = audio_streams_ptr;
+   slock_unlock(decode_thread_lock);
+
+   slock_lock(codec_open_lock);
+   for (int i = 0; i < audio_streams_num; i++)
    {
-#ifndef HAVE_GL
-      bool dupe = true;
+      if (actx[i] && (decode_all_audio || i == audio_ptr))
+         avcodec_flush_buffers(actx[i]);
+   }
+   if (vctx)
+      avcodec_flush_buffers(vctx);
+   for (int i = 0; i < subtitle_streams_num; i++)
+   {
+      if (sctx[i])
+         avcodec_flush_buffers(sctx[i]);
+   }
+   slock_unlock(codec_open_lock);
+#ifdef HAVE_SSA
+   // Events are kept, packets read again are recognized as duplicates.
+   subtitle_cache_flush();
 #endif
-      // Video
-      if (min_pts > frames[1].pts)
-      {
-         struct frame tmp = frames[1];
-         frames[1] = frames[0];
-         frames[0] = tmp;
-      }
+}
 
-      while (!decode_thread_dead && min_pts > frames[1].pts)
+#ifdef HAVE_SSA
+// Straight CPU alpha blending.
+// Should probably do in GL.
+static void render_ass_img(AVFrame *conv_frame, ASS_Image *img)
+{
+   uint32_t *frame = (uint32_t*)conv_frame->data[0];
+   int stride = conv_frame->linesize[0] / sizeof(uint32_t);
+
+   for (; img; img = img->next)
+   {
+      if (img->w == 0 && img->h == 0)
+         continue;
+
+      const uint8_t *bitmap = img->bitmap;
+      uint32_t *dst = frame + img->dst_x + img->dst_y * stride;
+
+      unsigned r = (img->color >> 24) & 0xff;
+      unsigned g = (img->color >> 16) & 0xff;
+      unsigned b = (img->color >>  8) & 0xff;
+      unsigned a = 255 - (img->color & 0xff);
+
+      for (int y = 0; y < img->h; y++,
+            bitmap += img->stride, dst += stride)
       {
-         slock_lock(fifo_lock);
-         size_t to_read_frame_bytes = media.width * media.height * sizeof(uint32_t) + sizeof(int64_t);
-         while (!decode_thread_dead && fifo_read_avail(video_decode_fifo) < to_read_frame_bytes)
+         for (int x = 0; x < img->w; x++)
          {
-            main_sleeping = true;
-            scond_signal(fifo_decode_cond);
-            scond_wait(fifo_cond, fifo_lock);
-            main_sleeping = false;
-         }
+            unsigned src_alpha = ((bitmap[x] * (a + 1)) >> 8) + 1;
+            unsigned dst_alpha = 256 - src_alpha;
 
-         int64_t pts = 0;
-         if (!decode_thread_dead)
-         {
-            fifo_read(video_decode_fifo, &pts, sizeof(int64_t));
-#if defined(HAVE_GL)
-#if defined(GLES)
-            fifo_read(video_decode_fifo, video_frame_temp_buffer, media.width * media.height * sizeof(uint32_t));
-            glBindTexture(GL_TEXTURE_2D, frames[1].tex);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-                  media.width, media.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, video_frame_temp_buffer);
-            glBindTexture(GL_TEXTURE_2D, 0);
-#else
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frames[1].pbo);
-            uint32_t *data = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
-                  0, media.width * media.height, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            uint32_t dst_color = dst[x];
+            unsigned dst_r = (dst_color >> 16) & 0xff;
+            unsigned dst_g = (dst_color >>  8) & 0xff;
+            unsigned dst_b = (dst_color >>  0) & 0xff;
 
-            fifo_read(video_decode_fifo, data, media.width * media.height * sizeof(uint32_t));
+            dst_r = (r * src_alpha + dst_r * dst_alpha) >> 8;
+            dst_g = (g * src_alpha + dst_g * dst_alpha) >> 8;
+            dst_b = (b * src_alpha + dst_b * dst_alpha) >> 8;
 
-            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
-            glBindTexture(GL_TEXTURE_2D, frames[1].tex);
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA,
-                  media.width, media.height, 0, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
-            glBindTexture(GL_TEXTURE_2D, 0);
-            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-#endif
-#else
-            fifo_read(video_decode_fifo, video_frame_temp_buffer, media.width * media.height * sizeof(uint32_t));
-            dupe = false;
-#endif
+            dst[x] = (0xffu << 24) | (dst_r << 16) | (dst_g << 8) | (dst_b << 0);
          }
+      }
+   }
+}
 
-         scond_signal(fifo_decode_cond);
-         slock_unlock(fifo_lock);
+static void render_ass_img_rgb565(AVFrame *conv_frame, ASS_Image *img)
+{
+   uint16_t *frame = (uint16_t*)conv_frame->data[0];
+   int stride = conv_frame->linesize[0] / sizeof(uint16_t);
 
-         frames[1].pts = av_q2d(fctx->streams[video_stream]->time_base) * pts;
-      }
+   for (; img; img = img->next)
+   {
+      if (img->w == 0 && img->h == 0)
+         continue;
 
-#ifdef HAVE_GL
-      float mix_factor = (min_pts - frames[0].pts) / (frames[1].pts - frames[0].pts);
-      if (!temporal_interpolation)
-         mix_factor = 1.0f;
+      const uint8_t *bitmap = img->bitmap;
+      uint16_t *dst = frame + img->dst_x + img->dst_y * stride;
 
-      glBindFramebuffer(GL_FRAMEBUFFER, hw_render.get_current_framebuffer());
-      glClearColor(0, 0, 0, 1);
-      glClear(GL_COLOR_BUFFER_BIT);
-      glViewport(0, 0, media.width, media.height);
-      glUseProgram(prog);
+      unsigned r = (img->color >> 27) & 0x1f;
+      unsigned g = (img->color >> 18) & 0x3f;
+      unsigned b = (img->color >> 11) & 0x1f;
+      unsigned a = 255 - (img->color & 0xff);
 
-      glUniform1f(mix_loc, mix_factor);
-      glActiveTexture(GL_TEXTURE1);
-      glBindTexture(GL_TEXTURE_2D, frames[1].tex);
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, frames[0].tex);
+      for (int y = 0; y < img->h; y++,
+            bitmap += img->stride, dst += stride)
+      {
+         for (int x = 0; x < img->w; x++)
+         {
+            unsigned src_alpha = ((bitmap[x] * (a + 1)) >> 8) + 1;
+            unsigned dst_alpha = 256 - src_alpha;
 
+            uint16_t dst_color = dst[x];
+            unsigned dst_r = (dst_color >> 11) & 0x1f;
+            unsigned dst_g = (dst_color >>  5) & 0x3f;
+            unsigned dst_b = (dst_color >>  0) & 0x1f;
 
-      glBindBuffer(GL_ARRAY_BUFFER, vbo);
-      glVertexAttribPointer(vertex_loc, 2, GL_FLOAT, GL_FALSE,
-            4 * sizeof(GLfloat), (const GLvoid*)(0 * sizeof(GLfloat)));
-      glVertexAttribPointer(tex_loc, 2, GL_FLOAT, GL_FALSE,
-            4 * sizeof(GLfloat), (const GLvoid*)(2 * sizeof(GLfloat)));
-      glEnableVertexAttribArray(vertex_loc);
-      glEnableVertexAttribArray(tex_loc);
-      glBindBuffer(GL_ARRAY_BUFFER, 0);
+            dst_r = (r * src_alpha + dst_r * dst_alpha) >> 8;
+            dst_g = (g * src_alpha + dst_g * dst_alpha) >> 8;
+            dst_b = (b * src_alpha + dst_b * dst_alpha) >> 8;
 
-      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-      glDisableVertexAttribArray(vertex_loc);
-      glDisableVertexAttribArray(tex_loc);
+            dst[x] = (dst_r << 11) | (dst_g << 5) | (dst_b << 0);
+         }
+      }
+   }
+}
 
-      glUseProgram(0);
-      glActiveTexture(GL_TEXTURE1);
-      glBindTexture(GL_TEXTURE_2D, 0);
-      glActiveTexture(GL_TEXTURE0);
-      glBindTexture(GL_TEXTURE_2D, 0);
+// Bitmap subtitles are premultiplied, only the destination is scaled.
+static void render_bitmap_img(AVFrame *conv_frame, const struct subtitle_images *images)
+{
+   uint32_t *frame = (uint32_t*)conv_frame->data[0];
+   int stride = conv_frame->linesize[0] / sizeof(uint32_t);
 
-      video_cb(RETRO_HW_FRAME_BUFFER_VALID, media.width, media.height, media.width * sizeof(uint32_t));
-#else
-      video_cb(dupe ? NULL : video_frame_temp_buffer, media.width, media.height, media.width * sizeof(uint32_t));
-#endif
+   for (unsigned i = 0; i < images->bitmaps_count; i++)
+   {
+      const struct subtitle_bitmap *bitmap = &images->bitmaps[i];
+      const uint32_t *src = bitmap->pixels;
+      uint32_t *dst = frame + bitmap->x + bitmap->y * stride;
+
+      for (int y = 0; y < bitmap->h; y++, src += bitmap->w, dst += stride)
+      {
+         for (int x = 0; x < bitmap->w; x++)
+         {
+            uint32_t src_color = src[x];
+            unsigned src_alpha = src_color >> 24;
+            if (!src_alpha)
+               continue;
+
+            unsigned dst_alpha = 256 - src_alpha;
+            uint32_t dst_color = dst[x];
+            unsigned dst_r = ((src_color >> 16) & 0xff) + ((((dst_color >> 16) & 0xff) * dst_alpha) >> 8);
+            unsigned dst_g = ((src_color >>  8) & 0xff) + ((((dst_color >>  8) & 0xff) * dst_alpha) >> 8);
+            unsigned dst_b = ((src_color >>  0) & 0xff) + ((((dst_color >>  0) & 0xff) * dst_alpha) >> 8);
+
+            dst[x] = (0xffu << 24) | (dst_r << 16) | (dst_g << 8) | (dst_b << 0);
+         }
+      }
    }
-#ifdef HAVE_GL_FFT
-   else if (fft)
+}
+
+static void render_bitmap_img_rgb565(AVFrame *conv_frame, const struct subtitle_images *images)
+{
+   uint16_t *frame = (uint16_t*)conv_frame->data[0];
+   int stride = conv_frame->linesize[0] / sizeof(uint16_t);
+
+   for (unsigned i = 0; i < images->bitmaps_count; i++)
    {
-      unsigned frames = to_read_frames;
-      const int16_t *buffer = audio_buffer;
-      while (frames)
+      const struct subtitle_bitmap *bitmap = &images->bitmaps[i];
+      const uint32_t *src = bitmap->pixels;
+      uint16_t *dst = frame + bitmap->x + bitmap->y * stride;
+
+      for (int y = 0; y < bitmap->h; y++, src += bitmap->w, dst += stride)
       {
-         unsigned to_read = frames;
-         if (to_read > (1 << 11)) // FFT size we use (1 << 11). Really shouldn't happen unless we use a crazy high sample rate.
-            to_read = 1 << 11;
-         glfft_step_fft(fft, buffer, to_read);
-         buffer += to_read * 2;
-         frames -= to_read;
+         for (int x = 0; x < bitmap->w; x++)
+         {
+            uint32_t src_color = src[x];
+            unsigned src_alpha = src_color >> 24;
+            if (!src_alpha)
+               continue;
+
+            unsigned dst_alpha = 256 - src_alpha;
+            uint16_t dst_color = dst[x];
+            unsigned dst_r = ((src_color >> 19) & 0x1f) + ((((dst_color >> 11) & 0x1f) * dst_alpha) >> 8);
+            unsigned dst_g = ((src_color >> 10) & 0x3f) + ((((dst_color >>  5) & 0x3f) * dst_alpha) >> 8);
+            unsigned dst_b = ((src_color >>  3) & 0x1f) + ((((dst_color >>  0) & 0x1f) * dst_alpha) >> 8);
+
+            dst[x] = (dst_r << 11) | (dst_g << 5) | (dst_b << 0);
+         }
       }
-      glfft_render(fft, hw_render.get_current_framebuffer(), fft_width, fft_height);
-      video_cb(RETRO_HW_FRAME_BUFFER_VALID, fft_width, fft_height, fft_width * sizeof(uint32_t));
    }
+}
 #endif
-   else
-      video_cb(NULL, 1, 1, sizeof(uint32_t));
 
-   if (to_read_frames)
-      audio_batch_cb(audio_buffer, to_read_frames);
+// 4x4 ordered dither, one row of XRGB8888 to RGB565.
+static void dither_rgb565(uint16_t *dst, const uint32_t *src, unsigned width, unsigned y)
+{
+   static const uint8_t bayer[4][4] = {
+      {  0,  8,  2, 10 },
+      { 12,  4, 14,  6 },
+      {  3, 11,  1,  9 },
+      { 15,  7, 13,  5 },
+   };
+   const uint8_t *row = bayer[y & 3];
+
+   for (unsigned x = 0; x < width; x++)
+   {
+      // Thresholds scaled to the 8 (5-bit) and 4 (6-bit) quantization steps.
+      unsigned t = row[x & 3];
+      unsigned r = ((src[x] >> 16) & 0xff) + (t >> 1);
+      unsigned g = ((src[x] >>  8) & 0xff) + (t >> 2);
+      unsigned b = ((src[x] >>  0) & 0xff) + (t >> 1);
+      if (r > 0xff)
+         r = 0xff;
+      if (g > 0xff)
+         g = 0xff;
+      if (b > 0xff)
+         b = 0xff;
+
+      dst[x] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+   }
 }
 
-static bool open_codec(AVCodecContext **ctx, unsigned index)
+static SwrContext *alloc_resampler(AVCodecContext *ctx)
 {
-   AVCodec *codec = avcodec_find_decoder(fctx->streams[index]->codec->codec_id);
-   if (!codec)
+   SwrContext *swr = swr_alloc();
+
+   av_opt_set_int(swr, "in_channel_layout", ctx->channel_layout, 0);
+   av_opt_set_int(swr, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+   av_opt_set_int(swr, "in_sample_rate", ctx->sample_rate, 0);
+   av_opt_set_int(swr, "out_sample_rate", media.sample_rate, 0);
+   av_opt_set_int(swr, "in_sample_fmt", ctx->sample_fmt, 0);
+   av_opt_set_int(swr, "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+
+   // Drift correction needs the resampler active even when rates match,
+   // otherwise enabling compensation reinitializes it mid-stream.
+   av_opt_set_int(swr, "flags", SWR_FLAG_RESAMPLE, 0);
+
+   // This is the only resampling pass when the output rate matches the audio device,
+   // so spend a bit more on quality than the defaults.
+   if (ctx->sample_rate != (int)media.sample_rate)
    {
-      log_cb(RETRO_LOG_ERROR, "Couldn't find suitable decoder, exiting ... \n");
-      return false;
+      av_opt_set_int(swr, "filter_size", 64, 0);
+      av_opt_set_int(swr, "linear_interp", 1, 0);
+      av_opt_set_double(swr, "cutoff", 0.97, 0);
    }
+   swr_init(swr);
 
-   *ctx = fctx->streams[index]->codec;
-   if (avcodec_open2(*ctx, codec, NULL) < 0)
-      return false;
-
-   return true;
+   return swr;
 }
 
-static bool codec_is_image(enum AVCodecID id)
+// Returns the subtitle track a packet belongs to, or -1.
+// All of them are decoded, see sub_events.
+static int subtitle_track_for_stream(int stream_index)
 {
-   switch (id)
+   for (int i = 0; i < subtitle_streams_num; i++)
    {
-      case CODEC_ID_MJPEG:
-      case CODEC_ID_PNG:
-         return true;
-
-      default:
-         return false;
+      if (subtitle_streams[i] == stream_index)
+         return i;
    }
+   return -1;
 }
 
-static bool open_codecs(void)
+// Returns the audio track a packet should be decoded for, or -1.
+static int audio_track_for_stream(int stream_index, int active_ptr)
 {
-   video_stream = -1;
-   memset(audio_streams, 0, sizeof(audio_streams));
-   memset(subtitle_streams, 0, sizeof(subtitle_streams));
-   audio_streams_num = 0;
-   audio_streams_ptr = 0;
-   subtitle_streams_num = 0;
-   subtitle_streams_ptr = 0;
+   if (!decode_all_audio)
+      return audio_streams_num > 0 && audio_streams[active_ptr] == stream_index ? active_ptr : -1;
 
-   for (unsigned i = 0; i < fctx->nb_streams; i++)
+   for (int i = 0; i < audio_streams_num; i++)
    {
-      switch (fctx->streams[i]->codec->codec_type)
-      {
-         case AVMEDIA_TYPE_AUDIO:
-            if (audio_streams_num < MAX_STREAMS)
-            {
-               if (!open_codec(&actx[audio_streams_num], i))
-                  return false;
-               audio_streams[audio_streams_num] = i;
-               audio_streams_num++;
-            }
-            break;
+      if (audio_streams[i] == stream_index)
+         return i;
+   }
+   return -1;
+}
 
-         case AVMEDIA_TYPE_VIDEO:
-            if (!vctx && !codec_is_image(fctx->streams[i]->codec->codec_id))
-            {
-               if (!open_codec(&vctx, i))
-                  return false;
-               video_stream = i;
-            }
-            break;
+// Everything between a decoded picture and the video FIFO.
+// Owned by the thread producing pictures, which is the filter thread when filtering.
+struct video_output
+{
+   struct SwsContext *sws;
+   enum scaler_profile sws_profile;
+   // Result of the auto benchmark, 0 until it has run.
+   int auto_sws_flags;
+   // With fast startup, don't hold back the first picture for the benchmark.
+   bool defer_benchmark;
+
+   AVFrame *conv_frame;
+   void *conv_frame_buf;
+   uint16_t *dither_row;
+#ifdef HAVE_DIRECT_UPLOAD
+   // Points into a mapped PBO when the pool is active.
+   AVFrame *direct_frame;
+#endif
 
-         case AVMEDIA_TYPE_SUBTITLE:
-#ifdef HAVE_SSA
-            if (subtitle_streams_num < MAX_STREAMS && fctx->streams[i]->codec->codec_id == CODEC_ID_SSA)
-            {
-               AVCodecContext **s = &sctx[subtitle_streams_num];
-               subtitle_streams[subtitle_streams_num] = i;
-               if (!open_codec(s, i))
-                  return false;
+   // HDR pictures bypass swscale, set up on the first one.
+   tonemap_t *tonemap;
+   // Tone mapped picture at source size when the output is scaled or RGB565.
+   struct SwsContext *tonemap_sws;
+   AVFrame *tonemap_frame;
+   void *tonemap_frame_buf;
+};
 
-               int size = (*s)->extradata ? (*s)->extradata_size : 0;
-               ass_extra_data_size[subtitle_streams_num] = size;
+static void video_output_init(struct video_output *out)
+{
+   memset(out, 0, sizeof(*out));
+   out->sws_profile = SCALER_BALANCED;
+   out->sws = get_scaler(NULL, scaler_flags(out->sws_profile));
+   out->defer_benchmark = fast_start;
 
-               if (size)
-               {
-                  ass_extra_data[subtitle_streams_num] = av_malloc(size);
-                  memcpy(ass_extra_data[subtitle_streams_num], (*s)->extradata, size);
-               }
+#ifdef HAVE_DIRECT_UPLOAD
+   out->direct_frame = av_frame_alloc();
+#endif
+   out->conv_frame = av_frame_alloc();
+   out->conv_frame_buf = av_malloc(avpicture_get_size(conv_pix_fmt, media.width, media.height));
+   avpicture_fill((AVPicture*)out->conv_frame, out->conv_frame_buf,
+         conv_pix_fmt, media.width, media.height);
+   if (rgb565_dither)
+      out->dither_row = av_malloc(media.width * sizeof(uint16_t));
+}
 
-               subtitle_streams_num++;
-            }
+static void video_output_free(struct video_output *out)
+{
+   if (out->sws)
+      sws_freeContext(out->sws);
+   out->sws = NULL;
+
+   av_frame_free(&out->conv_frame);
+#ifdef HAVE_DIRECT_UPLOAD
+   av_frame_free(&out->direct_frame);
 #endif
-            break;
+   av_freep(&out->conv_frame_buf);
+   av_freep(&out->dither_row);
+
+   tonemap_free(out->tonemap);
+   out->tonemap = NULL;
+   if (out->tonemap_sws)
+      sws_freeContext(out->tonemap_sws);
+   out->tonemap_sws = NULL;
+   av_frame_free(&out->tonemap_frame);
+   av_freep(&out->tonemap_frame_buf);
+}
 
-         case AVMEDIA_TYPE_ATTACHMENT:
-         {
-            AVCodecContext *ctx = fctx->streams[i]->codec;
-            if (ctx->codec_id == CODEC_ID_TTF)
-               append_attachment(ctx->extradata, ctx->extradata_size);
-            break;
-         }
+static void convert_video(struct video_output *out, AVFrame *frame, AVFrame *conv)
+{
+   if (!tonemap_supported(frame))
+   {
+      scale_video(out->sws, frame, conv);
+      return;
+   }
 
-         default:
-            break;
+   if (!out->tonemap)
+   {
+      out->tonemap = tonemap_new(av_cpu_count());
+      if (!out->tonemap)
+      {
+         scale_video(out->sws, frame, conv);
+         return;
       }
+#ifdef TONEMAP_HAVE_HLG
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Tone mapping %s video to SDR.\n",
+            frame->color_trc == AVCOL_TRC_ARIB_STD_B67 ? "HLG" : "HDR10");
+#else
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Tone mapping HDR10 video to SDR.\n");
+#endif
    }
 
-   return actx[0] || vctx;
+   if (frame->width == (int)media.width && frame->height == (int)media.height &&
+         conv_pix_fmt == AV_PIX_FMT_RGB32)
+   {
+      tonemap_convert(out->tonemap, frame, (uint32_t*)conv->data[0], conv->linesize[0]);
+      return;
+   }
+
+   // Scaling 8-bit RGB afterwards is still much cheaper than the high bit depth swscale paths.
+   if (!out->tonemap_frame)
+   {
+      out->tonemap_frame = av_frame_alloc();
+      out->tonemap_frame_buf = av_malloc(avpicture_get_size(AV_PIX_FMT_RGB32, frame->width, frame->height));
+      avpicture_fill((AVPicture*)out->tonemap_frame, out->tonemap_frame_buf,
+            AV_PIX_FMT_RGB32, frame->width, frame->height);
+   }
+
+   tonemap_convert(out->tonemap, frame,
+         (uint32_t*)out->tonemap_frame->data[0], out->tonemap_frame->linesize[0]);
+
+   enum scaler_profile profile = out->sws_profile == SCALER_AUTO ? SCALER_BALANCED : out->sws_profile;
+   out->tonemap_sws = sws_getCachedContext(out->tonemap_sws,
+         frame->width, frame->height, AV_PIX_FMT_RGB32,
+         media.width, media.height, conv_pix_fmt,
+         scaler_flags(profile), NULL, NULL, NULL);
+   sws_scale(out->tonemap_sws, (const uint8_t * const*)out->tonemap_frame->data,
+         out->tonemap_frame->linesize, 0, frame->height,
+         conv->data, conv->linesize);
 }
 
-static bool init_media_info(void)
+// Converts a picture, blends subtitles and queues it for retro_run().
+static void output_video_frame(struct video_output *out, AVFrame *frame, double video_time)
 {
-   if (actx[0])
-      media.sample_rate = actx[0]->sample_rate;
+#ifdef HAVE_SSA
+   subtitle_cache_request(video_time);
+#endif
 
-   media.interpolate_fps = 60.0;
-   if (vctx)
+   slock_lock(decode_thread_lock);
+   enum scaler_profile profile = scaler_profile;
+   unsigned audio_fifo = audio_fifo_index(audio_streams_ptr);
+#ifdef HAVE_SSA
+   bool ass_active = ass_ready;
+#endif
+#ifdef HAVE_SUBTITLE_OVERLAY
+   // Composited in retro_run() instead.
+   if (subtitle_overlay)
+      ass_active = false;
+#endif
+   slock_unlock(decode_thread_lock);
+
+   if (profile != out->sws_profile && (profile != SCALER_AUTO || out->auto_sws_flags))
    {
-      media.width  = vctx->width;
-      media.height = vctx->height;
-      media.aspect = (float)vctx->width * av_q2d(vctx->sample_aspect_ratio) / vctx->height;
+      out->sws_profile = profile;
+      out->sws = get_scaler(out->sws, profile == SCALER_AUTO ? out->auto_sws_flags : scaler_flags(profile));
+   }
+
+   if (profile == SCALER_AUTO && !out->auto_sws_flags && !out->defer_benchmark && !tonemap_supported(frame))
+   {
+      out->auto_sws_flags = benchmark_scalers(&out->sws, frame, out->conv_frame);
+      out->sws_profile = SCALER_AUTO;
    }
+   out->defer_benchmark = false;
 
 #ifdef HAVE_SSA
-   if (sctx[0])
+   struct subtitle_images *images = NULL;
+   if (ass_active && !subtitle_cache_get(video_time, true, &images))
+      images = NULL;
+#endif
+
+   AVFrame *target = out->conv_frame;
+   bool drop = false;
+#ifdef HAVE_DIRECT_UPLOAD
+   int slot = -1;
+   slock_lock(fifo_lock);
+   unsigned generation = direct_upload_generation;
+   drop = !direct_upload_acquire(&slot);
+   slock_unlock(fifo_lock);
+
+   bool blend = false;
+#ifdef HAVE_SSA
+   blend = images != NULL;
+#endif
+   // Blending reads back the picture, which the write-only mapping can't do.
+   // Such pictures are put together in conv_frame and copied over.
+   if (slot >= 0 && !blend)
    {
-      ass = ass_library_init();
-      ass_set_message_cb(ass, ass_msg_cb, NULL);
-      for (size_t i = 0; i < attachments_size; i++)
-         ass_add_font(ass, (char*)"", (char*)attachments[i].data, attachments[i].size);
+      avpicture_fill((AVPicture*)out->direct_frame, direct_slots[slot].ptr,
+            conv_pix_fmt, media.width, media.height);
+      target = out->direct_frame;
+   }
+#endif
 
-      ass_render = ass_renderer_init(ass);
-      ass_set_frame_size(ass_render, media.width, media.height);
-      ass_set_extract_fonts(ass, true);
-      ass_set_fonts(ass_render, NULL, NULL, 1, NULL, 1);
-      ass_set_hinting(ass_render, ASS_HINTING_LIGHT);
+   if (!drop)
+      convert_video(out, frame, target);
 
-      for (int i = 0; i < subtitle_streams_num; i++)
+#ifdef HAVE_SSA
+   if (images && !drop)
+   {
+      if (conv_pix_fmt == AV_PIX_FMT_RGB565)
       {
-         ass_track[i] = ass_new_track(ass);
-         ass_process_codec_private(ass_track[i], (char*)ass_extra_data[i],
-               ass_extra_data_size[i]);
+         render_ass_img_rgb565(target, images->head);
+         render_bitmap_img_rgb565(target, images);
+      }
+      else
+      {
+         render_ass_img(target, images->head);
+         render_bitmap_img(target, images);
       }
    }
+   if (images)
+      subtitle_images_put(images);
 #endif
 
-   return true;
-}
-
-static void set_colorspace(struct SwsContext *sws,
-      unsigned width, unsigned height, enum AVColorSpace default_color, int in_range)
-{
-   const int *coeffs = NULL;
-   if (colorspace == AVCOL_SPC_UNSPECIFIED)
+#ifdef HAVE_DIRECT_UPLOAD
+   if (!drop && slot >= 0 && target != out->direct_frame)
    {
-      if (default_color != AVCOL_SPC_UNSPECIFIED)
-         coeffs = sws_getCoefficients(default_color);
-      else if (width >= 1280 || height > 576)
-         coeffs = sws_getCoefficients(AVCOL_SPC_BT709);
-      else
-         coeffs = sws_getCoefficients(AVCOL_SPC_BT470BG);
+      const uint8_t *src = target->data[0];
+      uint8_t *dst = direct_slots[slot].ptr;
+      size_t row_size = media.width * video_pixel_size;
+      for (unsigned y = 0; y < media.height; y++, src += target->linesize[0], dst += row_size)
+         memcpy(dst, src, row_size);
    }
-   else
-      coeffs = sws_getCoefficients(colorspace);
+#endif
 
-   if (coeffs)
+   slock_lock(fifo_lock);
+#ifdef HAVE_DIRECT_UPLOAD
+   // Only queued once there is room, context_destroy() waits for this.
+   if (slot >= 0)
    {
-      int in_full, out_full, brightness, contrast, saturation;
-      const int *inv_table, *table;
-      sws_getColorspaceDetails(sws, (int**)&inv_table, &in_full,
-            (int**)&table, &out_full,
-            &brightness, &contrast, &saturation);
+      direct_slots[slot].state = DIRECT_SLOT_FREE;
+      scond_signal(fifo_cond);
+   }
+#endif
+   while (!drop && !decode_thread_dead && fifo_write_avail(video_decode_fifo) < video_entry_size())
+   {
+      // Stale once a seek is pending, the FIFO is cleared for it anyway.
+      if (do_seek)
+         drop = true;
+      // The audio thread is about to run dry while retro_run() isn't consuming video.
+      // Drop the oldest picture rather than starve it.
+      else if (audio_callback_in_use && audio_callback_starving(audio_fifo))
+         drop_video_frame();
+      else if (!main_sleeping)
+         scond_wait(fifo_decode_cond, fifo_lock);
+      else
+      {
+         clear_video_fifo();
+         break;
+      }
+   }
 
-      if (in_range != AVCOL_RANGE_UNSPECIFIED)
-         in_full = in_range == AVCOL_RANGE_JPEG;
+#ifdef HAVE_DIRECT_UPLOAD
+   // The pool came or went meanwhile, so the picture is not where the FIFO format expects it.
+   if (generation != direct_upload_generation)
+      drop = true;
+#endif
 
-      inv_table = coeffs;
-      sws_setColorspaceDetails(sws, inv_table, in_full,
-            table, out_full,
-            brightness, contrast, saturation);
+   decode_last_video_time = video_time;
+   if (!drop && !decode_thread_dead)
+   {
+      fifo_write(video_decode_fifo, &video_time, sizeof(video_time));
+#ifdef HAVE_DIRECT_UPLOAD
+      if (slot >= 0)
+      {
+         uint32_t index = slot;
+         direct_slots[slot].state = DIRECT_SLOT_QUEUED;
+         fifo_write(video_decode_fifo, &index, sizeof(index));
+      }
+      else
+#endif
+      {
+         const uint8_t *src = out->conv_frame->data[0];
+         int stride = out->conv_frame->linesize[0];
+         for (unsigned y = 0; y < media.height; y++, src += stride)
+         {
+            if (out->dither_row)
+            {
+               dither_rgb565(out->dither_row, (const uint32_t*)src, media.width, y);
+               fifo_write(video_decode_fifo, out->dither_row, media.width * sizeof(uint16_t));
+            }
+            else
+               fifo_write(video_decode_fifo, src, media.width * video_pixel_size);
+         }
+      }
    }
+   scond_signal(fifo_cond);
+   slock_unlock(fifo_lock);
 }
 
-static bool decode_video(AVPacket *pkt, AVFrame *frame, AVFrame *conv, struct SwsContext *sws)
+#ifdef HAVE_FILTERS
+static bool create_filter_graph(AVFilterGraph *graph, const AVFrame *frame,
+      AVFilterContext **src, AVFilterContext **sink)
 {
-   int got_ptr = 0;
-   int ret = avcodec_decode_video2(vctx, frame, &got_ptr, pkt);
-   if (ret < 0)
+   AVRational time_base = fctx->streams[video_stream]->time_base;
+   AVRational aspect = frame->sample_aspect_ratio;
+   if (!aspect.num || !aspect.den)
+      aspect = (AVRational) { 1, 1 };
+
+   char args[256];
+   snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+         frame->width, frame->height, frame->format,
+         time_base.num, time_base.den, aspect.num, aspect.den);
+
+   // Slice threads inside each filter on top of the pipelining against the decoder.
+   graph->nb_threads = av_cpu_count();
+   graph->thread_type = AVFILTER_THREAD_SLICE;
+
+   if (avfilter_graph_create_filter(src, avfilter_get_by_name("buffer"), "in", args, NULL, graph) < 0)
+      return false;
+   if (avfilter_graph_create_filter(sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, graph) < 0)
       return false;
 
-   if (got_ptr)
-   {
-      set_colorspace(sws, media.width, media.height,
-            av_frame_get_colorspace(frame), av_frame_get_color_range(frame));
-      sws_scale(sws, (const uint8_t * const*)frame->data, frame->linesize, 0, media.height,
-            conv->data, conv->linesize);
-      return true;
-   }
-   else
+   // The scaler is set up for the decoder's format. If a filter needs another one,
+   // libavfilter converts back before the sink instead of handing out foreign planes.
+   enum AVPixelFormat pix_fmts[] = { vctx->pix_fmt, AV_PIX_FMT_NONE };
+   if (av_opt_set_int_list(*sink, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) < 0)
+      return false;
+
+   AVFilterInOut *outputs = avfilter_inout_alloc();
+   AVFilterInOut *inputs = avfilter_inout_alloc();
+   outputs->name = av_strdup("in");
+   outputs->filter_ctx = *src;
+   inputs->name = av_strdup("out");
+   inputs->filter_ctx = *sink;
+
+   int ret = avfilter_graph_parse_ptr(graph, video_filter, &inputs, &outputs, NULL);
+   avfilter_inout_free(&inputs);
+   avfilter_inout_free(&outputs);
+   if (ret < 0)
       return false;
+
+   return avfilter_graph_config(graph, NULL) >= 0;
 }
 
-static int16_t *decode_audio(AVCodecContext *ctx, AVPacket *pkt, AVFrame *frame, int16_t *buffer, size_t *buffer_cap,
-      SwrContext *swr)
+static bool filter_flush_pending(void)
 {
-   AVPacket pkt_tmp = *pkt;
+   slock_lock(filter.lock);
+   bool flush = filter.flush;
+   slock_unlock(filter.lock);
+   return flush;
+}
 
-   int got_ptr = 0;
+// Runs the filter graph on its own thread, fed by the decode thread through a small queue.
+static void filter_thread(void *data)
+{
+   (void)data;
 
-   for (;;)
-   {
-      int ret = 0;
-      ret = avcodec_decode_audio4(ctx, frame, &got_ptr, &pkt_tmp);
-      if (ret < 0)
-         return buffer;
+   struct video_output out;
+   video_output_init(&out);
 
-      pkt_tmp.data += ret;
-      pkt_tmp.size -= ret;
+   AVFilterGraph *graph = NULL;
+   AVFilterContext *src = NULL, *sink = NULL;
+   AVFrame *filtered = av_frame_alloc();
+   bool graph_failed = false;
 
-      if (!got_ptr)
-         break;
+   for (;;)
+   {
+      slock_lock(filter.lock);
+      while (!filter.count && !filter.eof)
+         scond_wait(filter.cond, filter.lock);
 
-      size_t required_buffer = frame->nb_samples * sizeof(int16_t) * 2;
-      if (required_buffer > *buffer_cap)
+      // Filters like yadif keep history, which is stale after a seek.
+      if (filter.flush)
       {
-         buffer = av_realloc(buffer, required_buffer);
-         *buffer_cap = required_buffer;
+         avfilter_graph_free(&graph);
+         filter.flush = false;
       }
 
-      swr_convert(swr,
-            (uint8_t*[]) { (uint8_t*)buffer },
-            frame->nb_samples,
-            (const uint8_t**)frame->data,
-            frame->nb_samples);
+      AVFrame *frame = NULL;
+      if (filter.count)
+      {
+         frame = filter.queue[filter.read_ptr];
+         filter.read_ptr = (filter.read_ptr + 1) % FILTER_QUEUE_SIZE;
+         filter.count--;
+      }
+      filter.busy = frame != NULL;
+      scond_broadcast(filter.cond);
+      slock_unlock(filter.lock);
 
-      int64_t pts = av_frame_get_best_effort_timestamp(frame);
+      bool eof = !frame;
+      if (frame && !graph && !graph_failed)
+      {
+         graph = avfilter_graph_alloc();
+         if (!create_filter_graph(graph, frame, &src, &sink))
+         {
+            log_cb(RETRO_LOG_ERROR, "[FFmpeg]: Failed to set up video filter \"%s\", not filtering.\n",
+                  video_filter);
+            avfilter_graph_free(&graph);
+            graph_failed = true;
+         }
+      }
 
-      slock_lock(fifo_lock);
-      while (!decode_thread_dead && fifo_write_avail(audio_decode_fifo) < required_buffer)
+      if (graph)
       {
-         if (!main_sleeping)
-            scond_wait(fifo_decode_cond, fifo_lock);
-         else
+         // A NULL frame drains the last pictures at the end of the stream.
+         if (av_buffersrc_add_frame_flags(src, frame, 0) < 0)
+            log_cb(RETRO_LOG_ERROR, "[FFmpeg]: Failed to feed video filter.\n");
+
+         AVRational time_base = sink->inputs[0]->time_base;
+         while (!filter_flush_pending() && !decode_thread_dead && av_buffersink_get_frame(sink, filtered) >= 0)
          {
-            log_cb(RETRO_LOG_ERROR, "Thread: Audio deadlock detected ...\n");
-            fifo_clear(audio_decode_fifo);
-            break;
+            output_video_frame(&out, filtered, filtered->pts * av_q2d(time_base));
+            av_frame_unref(filtered);
          }
       }
+      else if (frame)
+         output_video_frame(&out, frame, frame->pts * av_q2d(fctx->streams[video_stream]->time_base));
+      av_frame_free(&frame);
 
-      decode_last_audio_time = pts * av_q2d(fctx->streams[audio_streams[audio_streams_ptr]]->time_base);
-      if (!decode_thread_dead)
-         fifo_write(audio_decode_fifo, buffer, required_buffer);
+      if (eof)
+         break;
 
-      scond_signal(fifo_cond);
-      slock_unlock(fifo_lock);
+      slock_lock(filter.lock);
+      filter.busy = false;
+      scond_broadcast(filter.cond);
+      slock_unlock(filter.lock);
    }
 
-   return buffer;
+   av_frame_free(&filtered);
+   avfilter_graph_free(&graph);
+   video_output_free(&out);
 }
 
-static void decode_thread_seek(double time)
+static void filter_stage_init(void)
 {
-   int64_t seek_to = time * AV_TIME_BASE;
-   if (seek_to < 0)
-      seek_to = 0;
-
-   decode_last_video_time = time;
-   decode_last_audio_time = time;
-
-   int ret = avformat_seek_file(fctx, -1, INT64_MIN, seek_to, INT64_MAX, 0);
-   if (ret < 0)
-      log_cb(RETRO_LOG_ERROR, "av_seek_frame() failed.\n");
-
-   if (actx[audio_streams_ptr])
-      avcodec_flush_buffers(actx[audio_streams_ptr]);
-   if (vctx)
-      avcodec_flush_buffers(vctx);
-   if (sctx[subtitle_streams_ptr])
-      avcodec_flush_buffers(sctx[subtitle_streams_ptr]);
-#ifdef HAVE_SSA
-   if (ass_track[subtitle_streams_ptr])
-      ass_flush_events(ass_track[subtitle_streams_ptr]);
-#endif
+   memset(&filter, 0, sizeof(filter));
+   filter.lock = slock_new();
+   filter.cond = scond_new();
+   filter.thread = sthread_create(filter_thread, NULL);
 }
 
-#ifdef HAVE_SSA
-// Straight CPU alpha blending.
-// Should probably do in GL.
-static void render_ass_img(AVFrame *conv_frame, ASS_Image *img)
+// Caller holds filter.lock.
+static void filter_stage_drop_queue(void)
 {
-   uint32_t *frame = (uint32_t*)conv_frame->data[0];
-   int stride = conv_frame->linesize[0] / sizeof(uint32_t);
-
-   for (; img; img = img->next)
+   for (; filter.count; filter.count--)
    {
-      if (img->w == 0 && img->h == 0)
-         continue;
+      av_frame_free(&filter.queue[filter.read_ptr]);
+      filter.read_ptr = (filter.read_ptr + 1) % FILTER_QUEUE_SIZE;
+   }
+}
 
-      const uint8_t *bitmap = img->bitmap;
-      uint32_t *dst = frame + img->dst_x + img->dst_y * stride;
+// Takes over the references of frame.
+static void filter_stage_push(AVFrame *frame)
+{
+   AVFrame *queued = av_frame_alloc();
+   av_frame_move_ref(queued, frame);
 
-      unsigned r = (img->color >> 24) & 0xff;
-      unsigned g = (img->color >> 16) & 0xff;
-      unsigned b = (img->color >>  8) & 0xff;
-      unsigned a = 255 - (img->color & 0xff);
+   slock_lock(filter.lock);
+   while (filter.count == FILTER_QUEUE_SIZE && !decode_thread_dead)
+      scond_wait(filter.cond, filter.lock);
 
-      for (int y = 0; y < img->h; y++,
-            bitmap += img->stride, dst += stride)
-      {
-         for (int x = 0; x < img->w; x++)
-         {
-            unsigned src_alpha = ((bitmap[x] * (a + 1)) >> 8) + 1;
-            unsigned dst_alpha = 256 - src_alpha;
+   if (filter.count < FILTER_QUEUE_SIZE)
+   {
+      filter.queue[(filter.read_ptr + filter.count) % FILTER_QUEUE_SIZE] = queued;
+      filter.count++;
+      queued = NULL;
+   }
+   scond_broadcast(filter.cond);
+   slock_unlock(filter.lock);
 
-            uint32_t dst_color = dst[x];
-            unsigned dst_r = (dst_color >> 16) & 0xff;
-            unsigned dst_g = (dst_color >>  8) & 0xff;
-            unsigned dst_b = (dst_color >>  0) & 0xff;
+   av_frame_free(&queued);
+}
 
-            dst_r = (r * src_alpha + dst_r * dst_alpha) >> 8;
-            dst_g = (g * src_alpha + dst_g * dst_alpha) >> 8;
-            dst_b = (b * src_alpha + dst_b * dst_alpha) >> 8;
+// Drops everything in flight before a seek.
+// Pictures already on their way into the video FIFO are cleared along with it.
+static void filter_stage_flush(void)
+{
+   slock_lock(filter.lock);
+   filter_stage_drop_queue();
+   filter.flush = true;
+   scond_broadcast(filter.cond);
+   while (filter.busy)
+      scond_wait(filter.cond, filter.lock);
+   slock_unlock(filter.lock);
+}
 
-            dst[x] = (0xffu << 24) | (dst_r << 16) | (dst_g << 8) | (dst_b << 0);
-         }
-      }
-   }
+// Lets the filter thread drain at the end of the stream, or drops everything when shutting down.
+static void filter_stage_deinit(void)
+{
+   slock_lock(filter.lock);
+   if (decode_thread_dead)
+      filter_stage_drop_queue();
+   filter.eof = true;
+   scond_broadcast(filter.cond);
+   slock_unlock(filter.lock);
+
+   sthread_join(filter.thread);
+   slock_free(filter.lock);
+   scond_free(filter.cond);
+   memset(&filter, 0, sizeof(filter));
 }
 #endif
 
@@ -978,71 +4294,82 @@ static void decode_thread(void *data)
 {
    (void)data;
 
-   struct SwsContext *sws = NULL;
-   
-   if (video_stream >= 0)
-   {
-      sws = sws_getCachedContext(NULL,
-            media.width, media.height, vctx->pix_fmt,
-            media.width, media.height, PIX_FMT_RGB32,
-            SWS_POINT, NULL, NULL, NULL);
-   }
-
-   SwrContext *swr[audio_streams_num];
-   for (int i = 0; i < audio_streams_num; i++)
-   {
-      swr[i] = swr_alloc();
-
-      av_opt_set_int(swr[i], "in_channel_layout", actx[i]->channel_layout, 0);
-      av_opt_set_int(swr[i], "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
-      av_opt_set_int(swr[i], "in_sample_rate", actx[i]->sample_rate, 0);
-      av_opt_set_int(swr[i], "out_sample_rate", media.sample_rate, 0);
-      av_opt_set_int(swr[i], "in_sample_fmt", actx[i]->sample_fmt, 0);
-      av_opt_set_int(swr[i], "out_sample_fmt", AV_SAMPLE_FMT_S16, 0);
-      swr_init(swr[i]);
-   }
+   // Created when a track is first decoded.
+   SwrContext *swr[MAX_STREAMS] = {NULL};
 
    AVFrame *aud_frame = av_frame_alloc();
    AVFrame *vid_frame = av_frame_alloc();
 
-   AVFrame *conv_frame = NULL;
-   void *conv_frame_buf = NULL;
-   size_t frame_size = 0;
+   bool filtering = false;
+#ifdef HAVE_FILTERS
+   filtering = video_stream >= 0 && video_filter;
+   if (filtering)
+      filter_stage_init();
+#endif
 
-   if (video_stream >= 0)
-   {
-      frame_size = avpicture_get_size(PIX_FMT_RGB32, media.width, media.height);
-      conv_frame = av_frame_alloc();
-      conv_frame_buf = av_malloc(frame_size);
-      avpicture_fill((AVPicture*)conv_frame, conv_frame_buf,
-            PIX_FMT_RGB32, media.width, media.height);
-   }
+   struct video_output out;
+   memset(&out, 0, sizeof(out));
+   if (video_stream >= 0 && !filtering)
+      video_output_init(&out);
 
    int16_t *audio_buffer = NULL;
    size_t audio_buffer_cap = 0;
 
+   // Fast startup skips deblocking of non-reference frames for the first GOP.
+   // Nothing is predicted from those, so the shortcut never carries over.
+   bool fast_gop = fast_start && vctx;
+   bool fast_gop_started = false;
+   enum AVDiscard old_skip_loop_filter = AVDISCARD_DEFAULT;
+   if (fast_gop)
+   {
+      old_skip_loop_filter = vctx->skip_loop_filter;
+      vctx->skip_loop_filter = AVDISCARD_NONREF;
+   }
+
    while (!decode_thread_dead)
    {
       slock_lock(fifo_lock);
       bool seek = do_seek;
       double seek_time_thread = seek_time;
+      unsigned seek_serial_thread = seek_serial;
       slock_unlock(fifo_lock);
 
       if (seek)
       {
+         if (fast_gop)
+         {
+            vctx->skip_loop_filter = old_skip_loop_filter;
+            fast_gop = false;
+         }
+
+#ifdef HAVE_FILTERS
+         if (filtering)
+            filter_stage_flush();
+#endif
          decode_thread_seek(seek_time_thread);
 
          slock_lock(fifo_lock);
-         do_seek = false;
-         seek_time = 0.0;
+         // Another seek may have been queued meanwhile, go around once more for it.
+         bool requeued = seek_serial != seek_serial_thread;
+         if (!requeued)
+         {
+            do_seek = false;
+            seek_time = 0.0;
+         }
 
          if (video_decode_fifo)
-            fifo_clear(video_decode_fifo);
-         if (audio_decode_fifo)
-            fifo_clear(audio_decode_fifo);
+            clear_video_fifo();
+         for (unsigned i = 0; i < MAX_STREAMS; i++)
+         {
+            if (audio_decode_fifo[i])
+               fifo_clear(audio_decode_fifo[i]);
+         }
 
          scond_signal(fifo_cond);
          slock_unlock(fifo_lock);
+
+         if (requeued)
+            continue;
       }
 
       AVPacket pkt;
@@ -1051,88 +4378,135 @@ static void decode_thread(void *data)
          break;
 
       slock_lock(decode_thread_lock);
-      int audio_stream = audio_streams[audio_streams_ptr];
-      int audio_stream_ptr = audio_streams_ptr;
-      int subtitle_stream = subtitle_streams[subtitle_streams_ptr];
-      AVCodecContext *actx_active = actx[audio_streams_ptr];
-      AVCodecContext *sctx_active = sctx[subtitle_streams_ptr];
+      int audio_stream_ptr = audio_track_for_stream(pkt.stream_index, audio_streams_ptr);
+      int subtitle_stream_ptr = subtitle_track_for_stream(pkt.stream_index);
 #ifdef HAVE_SSA
-      ASS_Track *ass_track_active = ass_track[subtitle_streams_ptr];
+      bool subtitle_active = subtitle_stream_ptr == subtitle_streams_ptr;
+      bool ass_active = ass_ready;
 #endif
       slock_unlock(decode_thread_lock);
 
       if (pkt.stream_index == video_stream)
       {
-         if (decode_video(&pkt, vid_frame, conv_frame, sws))
+         if (fast_gop && (pkt.flags & AV_PKT_FLAG_KEY) && fast_gop_started)
          {
-            int64_t pts = av_frame_get_best_effort_timestamp(vid_frame);
+            vctx->skip_loop_filter = old_skip_loop_filter;
+            fast_gop = false;
+         }
+         fast_gop_started = true;
 
-            double video_time = pts * av_q2d(fctx->streams[video_stream]->time_base);
-#ifdef HAVE_SSA
-            if (ass_render)
+         if (decode_video(&pkt, vid_frame))
+         {
+            int64_t pts = av_frame_get_best_effort_timestamp(vid_frame);
+#ifdef HAVE_FILTERS
+            if (filtering)
             {
-               int change = 0;
-               ASS_Image *img = ass_render_frame(ass_render, ass_track_active,
-                     1000 * video_time, &change);
-
-               // Do it on CPU for now.
-               // We're in a thread anyways, so shouldn't really matter.
-               render_ass_img(conv_frame, img);
+               vid_frame->pts = pts;
+               filter_stage_push(vid_frame);
             }
+            else
 #endif
-
-            size_t decoded_size = frame_size + sizeof(pts);
-            slock_lock(fifo_lock);
-            while (!decode_thread_dead && fifo_write_avail(video_decode_fifo) < decoded_size)
-            {
-               if (!main_sleeping)
-                  scond_wait(fifo_decode_cond, fifo_lock);
-               else
-               {
-                  fifo_clear(video_decode_fifo);
-                  break;
-               }
-            }
-
-            decode_last_video_time = video_time;
-            if (!decode_thread_dead)
-            {
-               fifo_write(video_decode_fifo, &pts, sizeof(pts));
-               const uint8_t *src = conv_frame->data[0];
-               int stride = conv_frame->linesize[0];
-               for (unsigned y = 0; y < media.height; y++, src += stride)
-                  fifo_write(video_decode_fifo, src, media.width * sizeof(uint32_t));
-            }
-            scond_signal(fifo_cond);
-            slock_unlock(fifo_lock);
+               output_video_frame(&out, vid_frame, pts * av_q2d(fctx->streams[video_stream]->time_base));
          }
       }
-      else if (pkt.stream_index == audio_stream)
+      else if (audio_stream_ptr >= 0)
       {
-         audio_buffer = decode_audio(actx_active, &pkt, aud_frame,
-               audio_buffer, &audio_buffer_cap,
-               swr[audio_stream_ptr]);
+         AVCodecContext *actx_active = open_codec_lazy(&actx[audio_stream_ptr],
+               &actx_failed[audio_stream_ptr], pkt.stream_index);
+
+         if (actx_active)
+         {
+            if (!swr[audio_stream_ptr])
+               swr[audio_stream_ptr] = alloc_resampler(actx_active);
+
+            audio_buffer = decode_audio(audio_stream_ptr, actx_active, &pkt, aud_frame,
+                  audio_buffer, &audio_buffer_cap,
+                  swr[audio_stream_ptr]);
+         }
       }
-      else if (pkt.stream_index == subtitle_stream)
+      else if (subtitle_stream_ptr >= 0 &&
+            open_codec_lazy(&sctx[subtitle_stream_ptr], &sctx_failed[subtitle_stream_ptr], pkt.stream_index))
       {
+         AVCodecContext *sctx_active = sctx[subtitle_stream_ptr];
          AVSubtitle sub;
          memset(&sub, 0, sizeof(sub));
 
+         // Bitmap display sets span several packets, only the last one completes a subtitle.
          int finished = 0;
-         while (!finished)
+         if (avcodec_decode_subtitle2(sctx_active, &sub, &finished, &pkt) < 0)
+            log_cb(RETRO_LOG_ERROR, "Decode subtitles failed.\n");
+
+#ifdef HAVE_SSA
+         if (!ass_active)
+         {
+            // Can't drop events, wait for libass setup to finish.
+            slock_lock(decode_thread_lock);
+            while (!ass_ready)
+               scond_wait(ass_ready_cond, decode_thread_lock);
+            slock_unlock(decode_thread_lock);
+         }
+
+         int64_t start = INT64_MIN, end = INT64_MAX;
+         if (pkt.pts != AV_NOPTS_VALUE)
+         {
+            AVRational ms = { 1, 1000 };
+            AVRational time_base = fctx->streams[pkt.stream_index]->time_base;
+            start = av_rescale_q(pkt.pts, time_base, ms);
+            if (pkt.duration > 0)
+               end = start + av_rescale_q(pkt.duration, time_base, ms);
+         }
+
+         if (subtitle_is_bitmap[subtitle_stream_ptr])
          {
-            if (avcodec_decode_subtitle2(sctx_active, &sub, &finished, &pkt) < 0)
+            if (finished)
             {
-               log_cb(RETRO_LOG_ERROR, "Decode subtitles failed.\n");
-               break;
+               int64_t shown = start, hidden = INT64_MAX;
+               if (start != INT64_MIN)
+               {
+                  shown += sub.start_display_time;
+                  if (sub.end_display_time > sub.start_display_time && sub.end_display_time != UINT32_MAX)
+                     hidden = start + sub.end_display_time;
+               }
+
+               slock_lock(ass_lock);
+               bool added = bitmap_events_add(subtitle_stream_ptr, shown, hidden,
+                     sctx_active->width, sctx_active->height, &sub);
+               slock_unlock(ass_lock);
+               memset(&sub, 0, sizeof(sub));
+
+               // Shown until the next event, which might not be demuxed yet.
+               if (added && subtitle_active)
+                  subtitle_cache_invalidate(shown, INT64_MAX);
             }
          }
-
-#ifdef HAVE_SSA
-         for (int i = 0; i < sub.num_rects; i++)
+         else
          {
-            if (sub.rects[i]->ass)
-               ass_process_data(ass_track_active, sub.rects[i]->ass, strlen(sub.rects[i]->ass));
+            bool added = false;
+            struct subtitle_events *store = &sub_events[subtitle_stream_ptr];
+            slock_lock(ass_lock);
+            for (int i = 0; i < sub.num_rects; i++)
+            {
+               if (!sub.rects[i]->ass || !subtitle_events_add(store, start, sub.rects[i]->ass))
+                  continue;
+
+               added = true;
+               if (!subtitle_active || !store->synced)
+               {
+                  // Rebuilt once the track is shown.
+                  store->synced = false;
+                  continue;
+               }
+
+               ass_process_data(ass_track[subtitle_stream_ptr], sub.rects[i]->ass, strlen(sub.rects[i]->ass));
+               // Until then, the font thread picks these up once it's done.
+               if (ass_fonts_ready)
+                  load_event_fonts(sub.rects[i]->ass);
+            }
+            slock_unlock(ass_lock);
+
+            // Anything rendered ahead for the time this event covers is missing it.
+            if (added && subtitle_active)
+               subtitle_cache_invalidate(start, end);
          }
 #endif
 
@@ -1142,52 +4516,340 @@ static void decode_thread(void *data)
       av_free_packet(&pkt);
    }
 
-   if (sws)
-      sws_freeContext(sws);
-   sws = NULL;
+#ifdef HAVE_FILTERS
+   if (filtering)
+      filter_stage_deinit();
+#endif
 
-   for (int i = 0; i < audio_streams_num; i++)
+   for (int i = 0; i < MAX_STREAMS; i++)
       swr_free(&swr[i]);
 
-   av_frame_free(&aud_frame);
-   av_frame_free(&vid_frame);
-   av_frame_free(&conv_frame);
-   av_freep(&conv_frame_buf);
-   av_freep(&audio_buffer);
+   av_frame_free(&aud_frame);
+   av_frame_free(&vid_frame);
+   video_output_free(&out);
+   av_freep(&audio_buffer);
+
+   slock_lock(fifo_lock);
+   decode_thread_dead = true;
+   scond_signal(fifo_cond);
+   slock_unlock(fifo_lock);
+}
+
+static int readahead_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+   int ret = readahead_read(opaque, buf, buf_size);
+   if (ret == 0)
+      return AVERROR_EOF;
+   return ret < 0 ? AVERROR(EIO) : ret;
+}
+
+static int64_t readahead_seek_packet(void *opaque, int64_t offset, int whence)
+{
+   if (whence & AVSEEK_SIZE)
+      return readahead_size(opaque);
+   return readahead_seek(opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+static bool open_readahead(const char *path)
+{
+   readahead = readahead_new(path, readahead_window);
+   if (!readahead)
+      return false;
+
+   uint8_t *buf = av_malloc(READAHEAD_AVIO_SIZE);
+   if (!buf)
+      goto error;
+
+   readahead_avio = avio_alloc_context(buf, READAHEAD_AVIO_SIZE, 0, readahead,
+         readahead_read_packet, NULL, readahead_seek_packet);
+   if (!readahead_avio)
+   {
+      av_free(buf);
+      goto error;
+   }
+
+   fctx = avformat_alloc_context();
+   if (!fctx)
+      goto error;
+
+   fctx->pb = readahead_avio;
+   fctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Using %u MB read-ahead.\n",
+         (unsigned)(readahead_window >> 20));
+   return true;
+
+error:
+   if (readahead_avio)
+   {
+      av_freep(&readahead_avio->buffer);
+      av_freep(&readahead_avio);
+   }
+   readahead_free(readahead);
+   readahead = NULL;
+   return false;
+}
+
+#ifdef HAVE_GL
+#ifdef HAVE_PBO_UPLOAD
+static void free_upload_ring(void)
+{
+   for (unsigned i = 0; i < UPLOAD_RING_SIZE; i++)
+   {
+      struct upload_buffer *buf = &upload_ring[i];
+      if (buf->fence)
+         glDeleteSync(buf->fence);
+      if (buf->ptr)
+      {
+         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buf->pbo);
+         glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      }
+      if (buf->pbo)
+         glDeleteBuffers(1, &buf->pbo);
+      memset(buf, 0, sizeof(*buf));
+   }
+   upload_ring_index = 0;
+}
+#endif
+
+#ifdef HAVE_DIRECT_UPLOAD
+static void deinit_direct_upload(void)
+{
+   // Might come after retro_unload_game(), the decode thread is gone then.
+   if (fifo_lock)
+   {
+      slock_lock(fifo_lock);
+      if (direct_upload_active)
+      {
+         direct_upload_active = false;
+         direct_upload_generation++;
+
+         // The decode thread might still be scaling into a buffer.
+         for (;;)
+         {
+            bool writing = false;
+            for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+               writing |= direct_slots[i].state == DIRECT_SLOT_WRITING;
+            if (!writing)
+               break;
+            scond_wait(fifo_cond, fifo_lock);
+         }
+
+         clear_video_fifo();
+         scond_broadcast(fifo_decode_cond);
+      }
+      slock_unlock(fifo_lock);
+   }
+
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      struct direct_slot *slot = &direct_slots[i];
+      if (slot->fence)
+         glDeleteSync(slot->fence);
+      if (slot->ptr)
+      {
+         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+         glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+         glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      }
+      if (slot->pbo)
+         glDeleteBuffers(1, &slot->pbo);
+      memset(slot, 0, sizeof(*slot));
+   }
+}
+#endif
+
+#ifdef HAVE_SUBTITLE_OVERLAY
+static void deinit_subtitle_overlay(void)
+{
+   if (decode_thread_lock)
+   {
+      slock_lock(decode_thread_lock);
+      subtitle_overlay = false;
+      slock_unlock(decode_thread_lock);
+   }
+
+   if (overlay_prog)
+      glDeleteProgram(overlay_prog);
+   if (overlay_atlas)
+      glDeleteTextures(1, &overlay_atlas);
+   if (overlay_instance_vbo)
+      glDeleteBuffers(1, &overlay_instance_vbo);
+   overlay_prog = 0;
+   overlay_atlas = 0;
+   overlay_instance_vbo = 0;
+   overlay_atlas_height = 0;
+   overlay_atlas_rgba = false;
+   overlay_instances = 0;
+   overlay_serial = 0;
+
+   av_freep(&overlay_staging);
+   overlay_staging_size = 0;
+   av_freep(&overlay_instance_data);
+   overlay_instance_cap = 0;
+}
+#endif
+
+static void context_destroy(void)
+{
+#ifdef HAVE_GL_FFT
+   if (fft)
+   {
+      glfft_free(fft);
+      fft = NULL;
+   }
+#endif
+
+#ifdef HAVE_DIRECT_UPLOAD
+   deinit_direct_upload();
+#endif
+#ifdef HAVE_PBO_UPLOAD
+   free_upload_ring();
+#endif
+#ifdef HAVE_SUBTITLE_OVERLAY
+   deinit_subtitle_overlay();
+#endif
+}
+
+static bool gl_has_extension(const char *extension)
+{
+   const char *extensions = (const char*)glGetString(GL_EXTENSIONS);
+   return extensions && strstr(extensions, extension);
+}
+
+#ifndef GLES
+static bool gl_supports(int major, int minor, const char *extension)
+{
+   int gl_major = 0, gl_minor = 0;
+   const char *version = (const char*)glGetString(GL_VERSION);
+   if (version && sscanf(version, "%d.%d", &gl_major, &gl_minor) == 2 &&
+         (gl_major > major || (gl_major == major && gl_minor >= minor)))
+      return true;
+
+   return gl_has_extension(extension);
+}
+
+static bool framebuffer_is_srgb(void)
+{
+   if (!gl_supports(3, 0, "GL_ARB_framebuffer_sRGB"))
+      return false;
+
+   GLuint fb = hw_render.get_current_framebuffer();
+   GLint encoding = GL_LINEAR;
+   glBindFramebuffer(GL_FRAMEBUFFER, fb);
+   glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, fb ? GL_COLOR_ATTACHMENT0 : GL_BACK_LEFT,
+         GL_FRAMEBUFFER_ATTACHMENT_COLOR_ENCODING, &encoding);
+   glBindFramebuffer(GL_FRAMEBUFFER, 0);
+   return encoding == GL_SRGB;
+}
+#endif
+
+#ifdef HAVE_PBO_UPLOAD
+static bool init_upload_buffers(bool persistent)
+{
+   size_t size = media.width * media.height * sizeof(uint32_t);
+
+   for (unsigned i = 0; i < UPLOAD_RING_SIZE; i++)
+   {
+      struct upload_buffer *buf = &upload_ring[i];
+      glGenBuffers(1, &buf->pbo);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buf->pbo);
+
+#ifndef GLES
+      if (persistent)
+      {
+         GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+         glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+         buf->ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+         if (!buf->ptr)
+         {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            free_upload_ring();
+            return false;
+         }
+         continue;
+      }
+#endif
+
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+   }
 
-   slock_lock(fifo_lock);
-   decode_thread_dead = true;
-   scond_signal(fifo_cond);
-   slock_unlock(fifo_lock);
+   glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+   return true;
 }
 
-#ifdef HAVE_GL
-static void context_destroy(void)
+static void init_upload_ring(void)
 {
-#ifdef HAVE_GL_FFT
-   if (fft)
+#ifdef GLES
+   upload_persistent = false;
+#else
+   upload_persistent = glBufferStorage && gl_supports(4, 4, "GL_ARB_buffer_storage");
+#endif
+
+   // Buffer storage is immutable, so a failed mapping means starting over with plain buffers.
+   if (upload_persistent && !init_upload_buffers(true))
    {
-      glfft_free(fft);
-      fft = NULL;
+      log_cb(RETRO_LOG_WARN, "[FFmpeg]: Persistent mapping failed, orphaning PBOs instead.\n");
+      upload_persistent = false;
    }
-#endif
+   if (!upload_persistent)
+      init_upload_buffers(false);
+
+   // Mesa's llvmpipe runs both paths on the CPU, which makes it handy for testing them.
+   const char *renderer = (const char*)glGetString(GL_RENDERER);
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Uploading through %s PBOs on %s%s.\n",
+         upload_persistent ? "persistently mapped" : "orphaned",
+         renderer ? renderer : "unknown renderer",
+         renderer && strstr(renderer, "llvmpipe") ? " (software)" : "");
 }
+#endif
 
-static void context_reset(void)
+#ifdef HAVE_DIRECT_UPLOAD
+static void init_direct_upload(void)
 {
-#ifdef HAVE_GL_FFT
-   if (audio_streams_num > 0 && video_stream < 0)
+   if (!use_direct_upload || video_stream < 0)
+      return;
+
+   if (!upload_persistent)
    {
-      fft = glfft_new(11, hw_render.get_proc_address);
-      if (fft)
-         glfft_init_multisample(fft, fft_width, fft_height, fft_multisample);
+      log_cb(RETRO_LOG_WARN, "[FFmpeg]: Decoding into GPU memory needs persistently mapped buffers.\n");
+      return;
    }
-   // Already inits symbols.
-   if (!fft)
+
+   size_t size = media.width * media.height * sizeof(uint32_t);
+   GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+   for (unsigned i = 0; i < DIRECT_UPLOAD_SLOTS; i++)
+   {
+      struct direct_slot *slot = &direct_slots[i];
+      glGenBuffers(1, &slot->pbo);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->pbo);
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+      slot->ptr = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+      if (!slot->ptr)
+      {
+         log_cb(RETRO_LOG_WARN, "[FFmpeg]: Failed to map buffers for decoding into GPU memory.\n");
+         deinit_direct_upload();
+         return;
+      }
+   }
+
+   // Queued pictures are pixel data, which no longer matches the FIFO format.
+   slock_lock(fifo_lock);
+   clear_video_fifo();
+   direct_upload_active = true;
+   direct_upload_generation++;
+   scond_broadcast(fifo_decode_cond);
+   slock_unlock(fifo_lock);
+
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Decoding into GPU memory.\n");
+}
 #endif
-      rglgen_resolve_symbols(hw_render.get_proc_address);
 
-   prog = glCreateProgram();
+static GLuint create_program(const char *defines)
+{
+   GLuint prog = glCreateProgram();
    GLuint vert = glCreateShader(GL_VERTEX_SHADER);
    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
 
@@ -1206,29 +4868,195 @@ static void context_reset(void)
       "uniform sampler2D sTex1;\n"
       "uniform float uMix;\n"
 #ifdef GLES
-      "void main() { gl_FragColor = vec4(pow(mix(pow(texture2D(sTex0, vTex).bgr, vec3(2.2)), pow(texture2D(sTex1, vTex).bgr, vec3(2.2)), uMix), vec3(1.0 / 2.2)), 1.0); }\n";
       // Get format as GL_RGBA/GL_UNSIGNED_BYTE. Assume little endian, so we get ARGB -> BGRA byte order, and we have to swizzle to .BGR.
+      "vec3 fetch(sampler2D tex) { return texture2D(tex, vTex).bgr; }\n"
 #else
-      "void main() { gl_FragColor = vec4(pow(mix(pow(texture2D(sTex0, vTex).rgb, vec3(2.2)), pow(texture2D(sTex1, vTex).rgb, vec3(2.2)), uMix), vec3(1.0 / 2.2)), 1.0); }\n";
+      "vec3 fetch(sampler2D tex) { return texture2D(tex, vTex).rgb; }\n"
 #endif
+      // Same transfer function as the texture unit and framebuffer use, so the paths match.
+      "#ifdef DECODE\n"
+      "vec3 fetch_linear(sampler2D tex)\n"
+      "{\n"
+      "   vec3 c = fetch(tex);\n"
+      "   return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)), step(0.04045, c));\n"
+      "}\n"
+      "#else\n"
+      "vec3 fetch_linear(sampler2D tex) { return fetch(tex); }\n"
+      "#endif\n"
+      "void main()\n"
+      "{\n"
+      "#ifdef BLEND\n"
+      "   vec3 color = mix(fetch_linear(sTex0), fetch_linear(sTex1), uMix);\n"
+      "#else\n"
+      "   vec3 color = fetch(sTex0);\n"
+      "#endif\n"
+      "#ifdef ENCODE\n"
+      "   color = mix(color * 12.92, 1.055 * pow(color, vec3(1.0 / 2.4)) - 0.055, step(0.0031308, color));\n"
+      "#endif\n"
+      "   gl_FragColor = vec4(color, 1.0);\n"
+      "}\n";
+
+   const char *fragment_sources[] = { defines, fragment_source };
 
    glShaderSource(vert, 1, &vertex_source, NULL);
-   glShaderSource(frag, 1, &fragment_source, NULL);
+   glShaderSource(frag, 2, fragment_sources, NULL);
    glCompileShader(vert);
    glCompileShader(frag);
    glAttachShader(prog, vert);
    glAttachShader(prog, frag);
+
+   // Both programs share one set of vertex attributes.
+   glBindAttribLocation(prog, 0, "aVertex");
+   glBindAttribLocation(prog, 1, "aTexCoord");
    glLinkProgram(prog);
 
    glUseProgram(prog);
-
    glUniform1i(glGetUniformLocation(prog, "sTex0"), 0);
    glUniform1i(glGetUniformLocation(prog, "sTex1"), 1);
+   glUseProgram(0);
+
+   return prog;
+}
+
+#ifdef HAVE_SUBTITLE_OVERLAY
+static void init_subtitle_overlay(void)
+{
+#ifndef GLES
+   if (!glDrawArraysInstanced || !glVertexAttribDivisor ||
+         !gl_supports(3, 3, "GL_ARB_instanced_arrays") || !gl_supports(3, 0, "GL_ARB_texture_rg"))
+   {
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: No instancing, subtitles are blended on the CPU.\n");
+      return;
+   }
+#endif
+
+   static const char *vertex_source =
+      "attribute vec2 aVertex;\n"
+      "attribute vec4 aRect;\n"
+      "attribute vec4 aAtlas;\n"
+      "attribute vec4 aColor;\n"
+      "varying vec2 vTex;\n"
+      "varying vec4 vColor;\n"
+      "void main()\n"
+      "{\n"
+      "   gl_Position = vec4(aRect.xy + aVertex * aRect.zw, 0.0, 1.0);\n"
+      "   vTex = aAtlas.xy + aVertex * aAtlas.zw;\n"
+      "   vColor = aColor;\n"
+      "}\n";
+
+   static const char *fragment_source =
+      "#ifdef GL_ES\n"
+      "precision mediump float;\n"
+      "#endif\n"
+      "varying vec2 vTex;\n"
+      "varying vec4 vColor;\n"
+      "uniform sampler2D sAtlas;\n"
+      "uniform float uBitmap;\n"
+      "void main()\n"
+      "{\n"
+      "   vec4 texel = texture2D(sAtlas, vTex);\n"
+      "   // libass masks are colored per quad, bitmaps are premultiplied already.\n"
+      "   vec4 mask = vec4(vColor.rgb, 1.0) * (vColor.a * texel.r);\n"
+      "#ifdef GL_ES\n"
+      "   texel = texel.bgra;\n"
+      "#endif\n"
+      "   gl_FragColor = mix(mask, texel, uBitmap);\n"
+      "}\n";
+
+   GLuint vert = glCreateShader(GL_VERTEX_SHADER);
+   GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
+   glShaderSource(vert, 1, &vertex_source, NULL);
+   glShaderSource(frag, 1, &fragment_source, NULL);
+   glCompileShader(vert);
+   glCompileShader(frag);
+
+   overlay_prog = glCreateProgram();
+   glAttachShader(overlay_prog, vert);
+   glAttachShader(overlay_prog, frag);
+   glBindAttribLocation(overlay_prog, 0, "aVertex");
+   glBindAttribLocation(overlay_prog, 2, "aRect");
+   glBindAttribLocation(overlay_prog, 3, "aAtlas");
+   glBindAttribLocation(overlay_prog, 4, "aColor");
+   glLinkProgram(overlay_prog);
+   glDeleteShader(vert);
+   glDeleteShader(frag);
+
+   glUseProgram(overlay_prog);
+   glUniform1i(glGetUniformLocation(overlay_prog, "sAtlas"), 0);
+   overlay_bitmap_uniform = glGetUniformLocation(overlay_prog, "uBitmap");
+   glUseProgram(0);
+
+   // Drawn at output resolution, so there is nothing to filter.
+   glGenTextures(1, &overlay_atlas);
+   glBindTexture(GL_TEXTURE_2D, overlay_atlas);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glBindTexture(GL_TEXTURE_2D, 0);
+
+   glGenBuffers(1, &overlay_instance_vbo);
+
+   slock_lock(decode_thread_lock);
+   subtitle_overlay = true;
+   slock_unlock(decode_thread_lock);
+}
+#endif
+
+static void context_reset(void)
+{
+#ifdef HAVE_GL_FFT
+   if (audio_streams_num > 0 && video_stream < 0)
+   {
+      fft = glfft_new(11, hw_render.get_proc_address);
+      if (fft)
+         glfft_init_multisample(fft, fft_width, fft_height, fft_multisample);
+   }
+   // Already inits symbols.
+   if (!fft)
+#endif
+      rglgen_resolve_symbols(hw_render.get_proc_address);
+
+#if defined(GLES) && defined(HAVE_OPENGLES3)
+   srgb_textures = true;
+   srgb_framebuffer = false;
+#elif defined(GLES)
+   srgb_textures = false;
+   srgb_framebuffer = false;
+#else
+   srgb_textures = gl_supports(2, 1, "GL_EXT_texture_sRGB");
+   srgb_framebuffer = framebuffer_is_srgb();
+#endif
+   srgb_skip_decode = srgb_textures && gl_has_extension("GL_EXT_texture_sRGB_decode");
+
+   // Whatever isn't done by the texture unit or framebuffer is left to the shader.
+   char blend_defines[64], copy_defines[64];
+   snprintf(blend_defines, sizeof(blend_defines), "#define BLEND\n%s%s",
+         srgb_textures ? "" : "#define DECODE\n",
+         srgb_framebuffer ? "" : "#define ENCODE\n");
+   snprintf(copy_defines, sizeof(copy_defines), "%s",
+         srgb_textures && !srgb_skip_decode && !srgb_framebuffer ? "#define ENCODE\n" : "");
+
+   prog = create_program(blend_defines);
+   copy_prog = create_program(copy_defines);
+
    vertex_loc = glGetAttribLocation(prog, "aVertex");
    tex_loc = glGetAttribLocation(prog, "aTexCoord");
    mix_loc = glGetUniformLocation(prog, "uMix");
 
-   glUseProgram(0);
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: sRGB textures: %s, sRGB framebuffer: %s.\n",
+         srgb_textures ? "yes" : "no", srgb_framebuffer ? "yes" : "no");
+
+#if defined(GLES) && defined(HAVE_OPENGLES3)
+   bool texture_storage = true;
+#elif !defined(GLES)
+   bool texture_storage = glTexStorage2D && gl_supports(4, 2, "GL_ARB_texture_storage");
+#endif
+#ifdef GLES
+   GLint internal_format = GL_RGBA;
+#else
+   GLint internal_format = srgb_textures ? GL_SRGB8_ALPHA8 : GL_RGBA;
+#endif
 
    for (unsigned i = 0; i < 2; i++)
    {
@@ -1240,14 +5068,25 @@ static void context_reset(void)
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-#ifndef GLES
-      glGenBuffers(1, &frames[i].pbo);
-      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, frames[i].pbo);
-      glBufferData(GL_PIXEL_UNPACK_BUFFER, media.width * media.height * sizeof(uint32_t), NULL, GL_STREAM_DRAW);
-      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      // Storage is allocated once, frames only update it with glTexSubImage2D().
+#if !defined(GLES) || defined(HAVE_OPENGLES3)
+      if (texture_storage)
+         glTexStorage2D(GL_TEXTURE_2D, 1, srgb_textures ? GL_SRGB8_ALPHA8 : GL_RGBA8,
+               media.width, media.height);
+      else
 #endif
+         glTexImage2D(GL_TEXTURE_2D, 0, internal_format, media.width, media.height, 0,
+               UPLOAD_FORMAT, UPLOAD_TYPE, NULL);
+      frames[i].srgb_decode = true;
    }
 
+#ifdef HAVE_PBO_UPLOAD
+   init_upload_ring();
+#endif
+#ifdef HAVE_DIRECT_UPLOAD
+   init_direct_upload();
+#endif
+
    static const GLfloat vertex_data[] = {
       -1, -1, 0, 0,
        1, -1, 1, 0,
@@ -1259,24 +5098,107 @@ static void context_reset(void)
    glBindBuffer(GL_ARRAY_BUFFER, vbo);
    glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_data), vertex_data, GL_STATIC_DRAW);
 
+#ifdef HAVE_SUBTITLE_OVERLAY
+   init_subtitle_overlay();
+#endif
+
    glBindBuffer(GL_ARRAY_BUFFER, 0);
    glBindTexture(GL_TEXTURE_2D, 0);
 }
 #endif
 
+#ifdef HAVE_MOTION_INTERP
+static void deinit_motion_interp(void)
+{
+   motion_interp_free(motion_interp);
+   motion_interp = NULL;
+   av_freep(&motion_interp_output);
+   for (unsigned i = 0; i < 2; i++)
+      av_freep(&frames[i].pixels);
+   motion_interp_valid = false;
+   motion_interp_shown = NULL;
+}
+
+static void init_motion_interp(void)
+{
+   if (rgb565_output)
+   {
+      log_cb(RETRO_LOG_WARN, "[FFmpeg]: Motion interpolation needs XRGB8888 output.\n");
+      return;
+   }
+
+   size_t size = media.width * media.height * sizeof(uint32_t);
+   motion_interp = motion_interp_new(media.width, media.height, av_cpu_count());
+   motion_interp_output = av_malloc(size);
+   for (unsigned i = 0; i < 2; i++)
+      frames[i].pixels = av_mallocz(size);
+
+   if (!motion_interp || !motion_interp_output || !frames[0].pixels || !frames[1].pixels)
+   {
+      log_cb(RETRO_LOG_WARN, "[FFmpeg]: Failed to set up motion interpolation.\n");
+      deinit_motion_interp();
+   }
+}
+#endif
+
 bool retro_load_game(const struct retro_game_info *info)
 {
-   enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-   if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
-      LOG_ERR_GOTO("Cannot set pixel format.", error);
+   load_start_time = av_gettime();
+
+   fifo_cond = scond_new();
+   fifo_decode_cond = scond_new();
+   fifo_lock = slock_new();
+   decode_thread_lock = slock_new();
+   codec_open_lock = slock_new();
+#ifdef HAVE_SSA
+   ass_ready_cond = scond_new();
+   ass_lock = slock_new();
+#endif
 
-   if (avformat_open_input(&fctx, info->path, NULL, NULL) < 0)
+   check_variables();
+
+   if (readahead_window && !open_readahead(info->path))
+      log_cb(RETRO_LOG_WARN, "[FFmpeg]: Read-ahead unavailable, reading directly.\n");
+
+   int64_t probe_start = av_gettime();
+
+   AVDictionary *fmt_opts = NULL;
+   if (probe_size)
+   {
+      char value[32];
+      snprintf(value, sizeof(value), "%u", probe_size);
+      av_dict_set(&fmt_opts, "probesize", value, 0);
+      snprintf(value, sizeof(value), "%u", probe_duration);
+      av_dict_set(&fmt_opts, "analyzeduration", value, 0);
+   }
+
+   int open_ret = avformat_open_input(&fctx, info->path, NULL, &fmt_opts);
+   av_dict_free(&fmt_opts);
+   if (open_ret < 0)
       LOG_ERR_GOTO("Failed to open input.", error);
 
-   if (avformat_find_stream_info(fctx, NULL) < 0)
-      LOG_ERR_GOTO("Failed to find stream info.", error);
+   const char *system_dir = NULL;
+   if (probe_cache && !environ_cb(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY, &system_dir))
+      system_dir = NULL;
+
+   unsigned open_streams = fctx->nb_streams;
+   bool probe_cached = system_dir && probe_cache_load(fctx, system_dir, info->path);
+   if (!probe_cached)
+   {
+      if (avformat_find_stream_info(fctx, NULL) < 0)
+         LOG_ERR_GOTO("Failed to find stream info.", error);
+
+      if (system_dir)
+         probe_cache_save(fctx, system_dir, info->path, open_streams);
+   }
+
+   log_cb(RETRO_LOG_INFO, "[FFmpeg]: Stream info %s in %.1f ms.\n",
+         probe_cached ? "loaded from cache" : "probed",
+         (av_gettime() - probe_start) / 1000.0);
 
-   av_dump_format(fctx, 0, info->path, 0);
+   // Dumping is slow for files with many streams, only do it when we're not in a hurry.
+   if (!probe_size)
+      av_dump_format(fctx, 0, info->path, 0);
 
    if (!open_codecs())
       LOG_ERR_GOTO("Failed to find codec.", error);
@@ -1284,6 +5206,20 @@ bool retro_load_game(const struct retro_game_info *info)
    if (!init_media_info())
       LOG_ERR_GOTO("Failed to init media info.", error);
 
+   // The visualizers always render XRGB8888.
+   enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+   conv_pix_fmt = AV_PIX_FMT_RGB32;
+   video_pixel_size = sizeof(uint32_t);
+   if (rgb565_output && video_stream >= 0)
+   {
+      fmt = RETRO_PIXEL_FORMAT_RGB565;
+      conv_pix_fmt = rgb565_dither ? AV_PIX_FMT_RGB32 : AV_PIX_FMT_RGB565;
+      video_pixel_size = sizeof(uint16_t);
+   }
+
+   if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+      LOG_ERR_GOTO("Cannot set pixel format.", error);
+
    decode_thread_dead = false;
 
    bool is_glfft = false;
@@ -1293,9 +5229,60 @@ bool retro_load_game(const struct retro_game_info *info)
 
    if (video_stream >= 0 || is_glfft)
    {
-      video_decode_fifo = fifo_new(media.width * media.height * sizeof(uint32_t) * 32);
+      size_t entry_size = sizeof(double) + media.width * media.height * video_pixel_size;
+      size_t history = video_stream >= 0 ? VIDEO_HISTORY_ENTRIES * entry_size : 0;
+      video_decode_fifo = fifo_new(media.width * media.height * video_pixel_size * 32 + history);
+      if (video_decode_fifo)
+         fifo_set_history(video_decode_fifo, history);
+   }
+   if (audio_streams_num > 0)
+   {
+      unsigned fifos = decode_all_audio ? audio_streams_num : 1;
+      for (unsigned i = 0; i < fifos; i++)
+      {
+         audio_decode_fifo[i] = fifo_new(AUDIO_FIFO_MIN_SECONDS * media.sample_rate * sizeof(int16_t) * 2 +
+               audio_history_size());
+         if (audio_decode_fifo[i])
+            fifo_set_history(audio_decode_fifo[i], audio_history_size());
+      }
+   }
+
+   struct retro_frame_time_callback frame_time = {
+      .callback = frame_time_callback,
+      .reference = 1000000 / media.interpolate_fps,
+   };
+   if (!environ_cb(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK, &frame_time))
+      log_cb(RETRO_LOG_INFO, "[FFmpeg]: Frontend does not report frame time, assuming %.2f Hz.\n",
+            media.interpolate_fps);
+
+   // The visualizer needs the samples in retro_run(), so only use this with video.
+   if (use_audio_callback && video_stream >= 0 && audio_streams_num > 0)
+   {
+      struct retro_audio_callback audio_cb = {
+         .callback = audio_callback,
+         .set_state = audio_callback_set_state,
+      };
+      audio_callback_registered = environ_cb(RETRO_ENVIRONMENT_SET_AUDIO_CALLBACK, &audio_cb);
+      if (!audio_callback_registered)
+         log_cb(RETRO_LOG_WARN, "[FFmpeg]: Frontend does not support audio callback, pushing audio from retro_run.\n");
+   }
+
+#ifdef HAVE_SSA
+   if (subtitle_streams_num > 0)
+      subtitle_cache_init();
+#endif
+
+   // Get the decoder going before the slower parts of setup.
+   decode_thread_handle = sthread_create(decode_thread, NULL);
+
+#ifdef HAVE_SSA
+   if (subtitle_streams_num > 0)
+      init_subtitles();
+#endif
 
 #ifdef HAVE_GL
+   if (video_stream >= 0 || is_glfft)
+   {
       hw_render.context_reset = context_reset;
       hw_render.context_destroy = context_destroy;
       hw_render.bottom_left_origin = is_glfft;
@@ -1308,24 +5295,24 @@ bool retro_load_game(const struct retro_game_info *info)
 #endif
       if (!environ_cb(RETRO_ENVIRONMENT_SET_HW_RENDER, &hw_render))
          LOG_ERR_GOTO("Cannot initialize HW render.", error);
-#endif
    }
-   if (audio_streams_num > 0)
+#endif
+
+#ifdef HAVE_CPU_FFT
+   if (video_stream < 0 && audio_streams_num > 0)
    {
-      unsigned buffer_seconds = video_stream >= 0 ? 20 : 1;
-      audio_decode_fifo = fifo_new(buffer_seconds * media.sample_rate * sizeof(int16_t) * 2);
+      spectrum = spectrum_new(11, fft_width, fft_height);
+      if (!spectrum)
+         log_cb(RETRO_LOG_WARN, "[FFmpeg]: Failed to create spectrum visualizer.\n");
    }
+#endif
 
-   fifo_cond = scond_new();
-   fifo_decode_cond = scond_new();
-   fifo_lock = slock_new();
-   decode_thread_lock = slock_new();
-
-   check_variables();
-
-   decode_thread_handle = sthread_create(decode_thread, NULL);
+   video_frame_temp_buffer = av_malloc(media.width * media.height * video_pixel_size);
 
-   video_frame_temp_buffer = av_malloc(media.width * media.height * sizeof(uint32_t));
+#ifdef HAVE_MOTION_INTERP
+   if (use_motion_interp && video_stream >= 0)
+      init_motion_interp();
+#endif
 
    pts_bias = 0.0;
 
@@ -1338,16 +5325,45 @@ error:
 
 void retro_unload_game(void)
 {
+#ifdef HAVE_CPU_FFT
+   spectrum_free(spectrum);
+   spectrum = NULL;
+#endif
+
+#ifdef HAVE_MOTION_INTERP
+   deinit_motion_interp();
+#endif
+
+#ifdef HAVE_SSA
+   if (ass_init_handle)
+      sthread_join(ass_init_handle);
+   ass_init_handle = NULL;
+#endif
+
    if (decode_thread_handle)
    {
       slock_lock(fifo_lock);
       decode_thread_dead = true;
-      scond_signal(fifo_decode_cond);
+      scond_broadcast(fifo_decode_cond);
       slock_unlock(fifo_lock);
       sthread_join(decode_thread_handle);
    }
    decode_thread_handle = NULL;
 
+#ifdef HAVE_SSA
+   subtitle_cache_deinit();
+#endif
+
+   if (codec_prewarm_handle)
+   {
+      codec_prewarm_dead = true;
+      sthread_join(codec_prewarm_handle);
+   }
+   codec_prewarm_handle = NULL;
+   codec_prewarm_dead = false;
+   first_frame_presented = false;
+   first_frame_runs = 0;
+
    if (fifo_cond)
       scond_free(fifo_cond);
    if (fifo_decode_cond)
@@ -1356,26 +5372,47 @@ void retro_unload_game(void)
       slock_free(fifo_lock);
    if (decode_thread_lock)
       slock_free(decode_thread_lock);
+   if (codec_open_lock)
+      slock_free(codec_open_lock);
 
    if (video_decode_fifo)
       fifo_free(video_decode_fifo);
-   if (audio_decode_fifo)
-      fifo_free(audio_decode_fifo);
+   for (unsigned i = 0; i < MAX_STREAMS; i++)
+   {
+      if (audio_decode_fifo[i])
+         fifo_free(audio_decode_fifo[i]);
+      audio_decode_fifo[i] = NULL;
+      decode_last_audio_time[i] = 0.0;
+      decode_audio_drift_delta[i] = 0;
+      decode_audio_compensation_left[i] = 0;
+   }
 
    fifo_cond = NULL;
    fifo_decode_cond = NULL;
    fifo_lock = NULL;
    decode_thread_lock = NULL;
+   codec_open_lock = NULL;
    video_decode_fifo = NULL;
-   audio_decode_fifo = NULL;
 
    decode_last_video_time = 0.0;
-   decode_last_audio_time = 0.0;
 
    frames[0].pts = frames[1].pts = 0.0;
    pts_bias = 0.0;
-   frame_cnt = 0;
+   play_time = 0.0;
+   frame_time_usec = 0;
    audio_frames = 0;
+   video_entries_read = 0;
+   audio_clock_valid = false;
+   audio_drift = 0.0;
+   audio_drift_delta = 0;
+#ifdef HAVE_DIRECT_UPLOAD
+   // The pool itself goes away with the context.
+   direct_upload_active = false;
+#endif
+   audio_callback_registered = false;
+   audio_callback_enabled = false;
+   audio_callback_in_use = false;
+   audio_callback_pts_valid = false;
 
    for (unsigned i = 0; i < MAX_STREAMS; i++)
    {
@@ -1385,6 +5422,8 @@ void retro_unload_game(void)
          avcodec_close(actx[i]);
       sctx[i] = NULL;
       actx[i] = NULL;
+      sctx_failed[i] = false;
+      actx_failed[i] = false;
    }
 
    if (vctx)
@@ -1399,8 +5438,15 @@ void retro_unload_game(void)
       fctx = NULL;
    }
 
-   for (size_t i = 0; i < attachments_size; i++)
-      av_freep(&attachments[i].data);
+   // Custom IO is not owned by the format context.
+   if (readahead_avio)
+   {
+      av_freep(&readahead_avio->buffer);
+      av_freep(&readahead_avio);
+   }
+   readahead_free(readahead);
+   readahead = NULL;
+
    av_freep(&attachments);
    attachments_size = 0;
 
@@ -1414,6 +5460,8 @@ void retro_unload_game(void)
       av_freep(&ass_extra_data[i]);
       ass_extra_data_size[i] = 0;
    }
+   subtitle_events_free();
+   bitmap_events_free();
    if (ass_render)
       ass_renderer_done(ass_render);
    if (ass)
@@ -1421,6 +5469,15 @@ void retro_unload_game(void)
 
    ass_render = NULL;
    ass = NULL;
+
+   if (ass_ready_cond)
+      scond_free(ass_ready_cond);
+   ass_ready_cond = NULL;
+   if (ass_lock)
+      slock_free(ass_lock);
+   ass_lock = NULL;
+   ass_ready = false;
+   ass_fonts_ready = false;
 #endif
 
    av_freep(&video_frame_temp_buffer);
@@ -1441,21 +5498,80 @@ bool retro_load_game_special(unsigned type, const struct retro_game_info *info,
 
 size_t retro_serialize_size(void)
 {
-   return 0;
+   return sizeof(struct serialized_state);
 }
 
 bool retro_serialize(void *data, size_t size)
 {
-   (void)data;
-   (void)size;
-   return false;
+   if (size < sizeof(struct serialized_state))
+      return false;
+
+   struct serialized_state *state = data;
+   state->version = SERIALIZE_VERSION;
+   state->audio_streams_ptr = audio_streams_ptr;
+   state->subtitle_streams_ptr = subtitle_streams_ptr;
+   state->colorspace = colorspace;
+   state->play_time = play_time;
+   state->audio_frames = audio_frames;
+   state->pts_bias = pts_bias;
+   state->session = load_start_time;
+   state->epoch = playback_epoch;
+   state->video_entries = video_entries_read;
+   return true;
 }
 
 bool retro_unserialize(const void *data, size_t size)
 {
-   (void)data;
-   (void)size;
-   return false;
+   if (size < sizeof(struct serialized_state) || !fifo_lock)
+      return false;
+
+   struct serialized_state state;
+   memcpy(&state, data, sizeof(state));
+   if (state.version != SERIALIZE_VERSION)
+      return false;
+
+#ifdef HAVE_SSA
+   int old_subtitle_ptr = subtitle_streams_ptr;
+#endif
+   int old_audio_ptr = audio_streams_ptr;
+   slock_lock(decode_thread_lock);
+   if (state.audio_streams_ptr >= 0 && state.audio_streams_ptr < audio_streams_num)
+      audio_streams_ptr = state.audio_streams_ptr;
+   if (state.subtitle_streams_ptr >= 0 && state.subtitle_streams_ptr < subtitle_streams_num)
+      subtitle_streams_ptr = state.subtitle_streams_ptr;
+   colorspace = state.colorspace;
+   // Without decode_all_audio, the FIFO history belongs to the old track.
+   if (audio_streams_ptr != old_audio_ptr)
+      playback_epoch++;
+   slock_unlock(decode_thread_lock);
+
+#ifdef HAVE_SSA
+   if (subtitle_streams_ptr != old_subtitle_ptr)
+      subtitle_cache_invalidate(INT64_MIN, INT64_MAX);
+#endif
+
+   double current_time = play_time + pts_bias;
+   double target_time = state.play_time + state.pts_bias;
+
+   if (target_time == current_time && state.audio_frames == audio_frames)
+      return true;
+
+   play_time = state.play_time;
+   pts_bias = state.pts_bias;
+
+   slock_lock(fifo_lock);
+   bool rewound = state.session == load_start_time && state.epoch == playback_epoch &&
+      rewind_fifos(state.audio_frames, state.video_entries);
+   if (!rewound)
+   {
+      queue_seek();
+      seek_time = target_time;
+      audio_frames = state.audio_frames;
+      frames[0].pts = 0.0;
+      frames[1].pts = 0.0;
+   }
+   slock_unlock(fifo_lock);
+   return true;
 }
 
 void *retro_get_memory_data(unsigned id)
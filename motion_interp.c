@@ -0,0 +1,589 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "motion_interp.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MOTION_SSE2 1
+#endif
+
+// Blocks are 8x8 on both pyramid levels, i.e. 16x16 and 32x32 pixels of the frame.
+#define MOTION_BLOCK 8
+// Exhaustive search range on the quarter resolution level, +/- 32 pixels of the frame.
+#define MOTION_COARSE_RANGE 8
+// Search range around the best candidate on the half resolution level.
+#define MOTION_REFINE_RANGE 2
+// Cost of vector length, keeps flat areas from picking up random motion.
+#define MOTION_LAMBDA 8
+// Mean absolute luma difference per pixel of the best matches.
+// Above this, the frames are considered unrelated.
+#define MOTION_SCENE_CUT 24
+// Blocks matching worse than this are cross-faded in place.
+#define MOTION_BLOCK_FALLBACK 40
+#define MOTION_MAX_THREADS 16
+
+enum motion_job
+{
+   MOTION_JOB_DOWNSCALE = 0,
+   MOTION_JOB_ESTIMATE,
+   MOTION_JOB_SMOOTH,
+   MOTION_JOB_RENDER
+};
+
+struct mv
+{
+   int16_t x, y;
+};
+
+struct motion_worker
+{
+   motion_interp_t *mi;
+   unsigned index;
+   // Last job generation this worker has seen.
+   unsigned generation;
+   sthread_t *thread;
+};
+
+struct motion_interp
+{
+   unsigned width;
+   unsigned height;
+
+   // Level 0 is half resolution, level 1 quarter resolution.
+   uint8_t *luma[2][2];
+   unsigned level_width[2];
+   unsigned level_height[2];
+   unsigned blocks_x[2];
+   unsigned blocks_y[2];
+
+   // Vectors are in level 0 pixels, pointing from a block of next to its match in prev.
+   struct mv *coarse;
+   struct mv *field;
+   struct mv *smooth;
+   struct mv *history;
+   uint16_t *sad;
+
+   // Job parameters.
+   const uint32_t *frames[2];
+   uint32_t *out;
+   float phase;
+   uint64_t band_sad[MOTION_MAX_THREADS];
+
+   struct motion_worker workers[MOTION_MAX_THREADS];
+   unsigned threads;
+   enum motion_job job;
+   unsigned generation;
+   unsigned busy;
+   bool dead;
+
+   slock_t *lock;
+   scond_t *cond;
+   scond_t *done_cond;
+};
+
+static void band_range(unsigned total, unsigned index, unsigned count, unsigned *start, unsigned *end)
+{
+   *start = total * index / count;
+   *end = total * (index + 1) / count;
+}
+
+static inline int clamp_int(int v, int lo, int hi)
+{
+   return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static inline unsigned rgb_luma(uint32_t p)
+{
+   return (((p >> 16) & 0xff) * 77 + ((p >> 8) & 0xff) * 150 + (p & 0xff) * 29) >> 8;
+}
+
+static unsigned sad8x8(const uint8_t *a, const uint8_t *b, unsigned stride)
+{
+#ifdef MOTION_SSE2
+   __m128i sum = _mm_setzero_si128();
+   for (unsigned y = 0; y < MOTION_BLOCK; y += 2, a += 2 * stride, b += 2 * stride)
+   {
+      __m128i va = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)a),
+            _mm_loadl_epi64((const __m128i*)(a + stride)));
+      __m128i vb = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)b),
+            _mm_loadl_epi64((const __m128i*)(b + stride)));
+      sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+   }
+   return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#else
+   unsigned sum = 0;
+   for (unsigned y = 0; y < MOTION_BLOCK; y++, a += stride, b += stride)
+      for (unsigned x = 0; x < MOTION_BLOCK; x++)
+         sum += abs(a[x] - b[x]);
+   return sum;
+#endif
+}
+
+static void downscale_band(motion_interp_t *mi, unsigned index)
+{
+   unsigned start, end;
+   band_range(mi->level_height[1], index, mi->threads, &start, &end);
+   unsigned end0 = index + 1 == mi->threads ? mi->level_height[0] : 2 * end;
+
+   for (unsigned f = 0; f < 2; f++)
+   {
+      const uint32_t *src = mi->frames[f];
+      unsigned w0 = mi->level_width[0];
+      for (unsigned y = 2 * start; y < end0; y++)
+      {
+         const uint32_t *row0 = src + 2 * y * mi->width;
+         const uint32_t *row1 = row0 + mi->width;
+         uint8_t *dst = mi->luma[f][0] + y * w0;
+         for (unsigned x = 0; x < w0; x++)
+         {
+            dst[x] = (rgb_luma(row0[2 * x]) + rgb_luma(row0[2 * x + 1]) +
+                  rgb_luma(row1[2 * x]) + rgb_luma(row1[2 * x + 1]) + 2) >> 2;
+         }
+      }
+
+      unsigned w1 = mi->level_width[1];
+      for (unsigned y = start; y < end; y++)
+      {
+         const uint8_t *row0 = mi->luma[f][0] + 2 * y * w0;
+         const uint8_t *row1 = row0 + w0;
+         uint8_t *dst = mi->luma[f][1] + y * w1;
+         for (unsigned x = 0; x < w1; x++)
+            dst[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+      }
+   }
+}
+
+// Clamps v so the referenced block stays inside the level.
+static struct mv clamp_vector(motion_interp_t *mi, unsigned level, int px, int py, int vx, int vy)
+{
+   struct mv v = {
+      clamp_int(vx, -px, (int)mi->level_width[level] - MOTION_BLOCK - px),
+      clamp_int(vy, -py, (int)mi->level_height[level] - MOTION_BLOCK - py),
+   };
+   return v;
+}
+
+static unsigned block_sad(motion_interp_t *mi, unsigned level, int px, int py, struct mv v)
+{
+   unsigned stride = mi->level_width[level];
+   const uint8_t *cur = mi->luma[1][level] + py * stride + px;
+   const uint8_t *ref = mi->luma[0][level] + (py + v.y) * stride + px + v.x;
+   return sad8x8(cur, ref, stride);
+}
+
+static unsigned block_cost(motion_interp_t *mi, unsigned level, int px, int py, struct mv v)
+{
+   return block_sad(mi, level, px, py, v) + MOTION_LAMBDA * (abs(v.x) + abs(v.y));
+}
+
+static void search(motion_interp_t *mi, unsigned level, int px, int py,
+      struct mv center, int range, struct mv *best, unsigned *best_cost)
+{
+   for (int dy = -range; dy <= range; dy++)
+   {
+      for (int dx = -range; dx <= range; dx++)
+      {
+         struct mv v = clamp_vector(mi, level, px, py, center.x + dx, center.y + dy);
+         if (v.x != center.x + dx || v.y != center.y + dy)
+            continue;
+
+         unsigned cost = block_cost(mi, level, px, py, v);
+         if (cost < *best_cost)
+         {
+            *best_cost = cost;
+            *best = v;
+         }
+      }
+   }
+}
+
+static void fine_rows(motion_interp_t *mi, unsigned index, unsigned *start, unsigned *end)
+{
+   unsigned coarse_start, coarse_end;
+   band_range(mi->blocks_y[1], index, mi->threads, &coarse_start, &coarse_end);
+   *start = 2 * coarse_start;
+   *end = index + 1 == mi->threads ? mi->blocks_y[0] : 2 * coarse_end;
+}
+
+static void estimate_band(motion_interp_t *mi, unsigned index)
+{
+   unsigned start, end;
+   band_range(mi->blocks_y[1], index, mi->threads, &start, &end);
+
+   // Exhaustive search at quarter resolution catches large motion.
+   for (unsigned by = start; by < end; by++)
+   {
+      for (unsigned bx = 0; bx < mi->blocks_x[1]; bx++)
+      {
+         int px = bx * MOTION_BLOCK, py = by * MOTION_BLOCK;
+         struct mv best = {0, 0};
+         unsigned best_cost = block_cost(mi, 1, px, py, best);
+         search(mi, 1, px, py, best, MOTION_COARSE_RANGE, &best, &best_cost);
+         mi->coarse[by * mi->blocks_x[1] + bx] = best;
+      }
+   }
+
+   // Refine at half resolution, starting from the best of a few predictors.
+   fine_rows(mi, index, &start, &end);
+   uint64_t band_sad = 0;
+   for (unsigned by = start; by < end; by++)
+   {
+      for (unsigned bx = 0; bx < mi->blocks_x[0]; bx++)
+      {
+         unsigned i = by * mi->blocks_x[0] + bx;
+         int px = bx * MOTION_BLOCK, py = by * MOTION_BLOCK;
+
+         unsigned cx = bx / 2, cy = by / 2;
+         if (cx >= mi->blocks_x[1])
+            cx = mi->blocks_x[1] - 1;
+         if (cy >= mi->blocks_y[1])
+            cy = mi->blocks_y[1] - 1;
+         struct mv parent = mi->coarse[cy * mi->blocks_x[1] + cx];
+
+         struct mv candidates[5];
+         unsigned num_candidates = 0;
+         candidates[num_candidates++] = clamp_vector(mi, 0, px, py, 2 * parent.x, 2 * parent.y);
+         candidates[num_candidates++] = clamp_vector(mi, 0, px, py, mi->history[i].x, mi->history[i].y);
+         if (bx > 0)
+            candidates[num_candidates++] = clamp_vector(mi, 0, px, py, mi->field[i - 1].x, mi->field[i - 1].y);
+         if (by > start)
+            candidates[num_candidates++] = clamp_vector(mi, 0, px, py,
+                  mi->field[i - mi->blocks_x[0]].x, mi->field[i - mi->blocks_x[0]].y);
+
+         struct mv best = {0, 0};
+         unsigned best_cost = block_cost(mi, 0, px, py, best);
+         for (unsigned c = 0; c < num_candidates; c++)
+         {
+            unsigned cost = block_cost(mi, 0, px, py, candidates[c]);
+            if (cost < best_cost)
+            {
+               best_cost = cost;
+               best = candidates[c];
+            }
+         }
+
+         search(mi, 0, px, py, best, MOTION_REFINE_RANGE, &best, &best_cost);
+
+         unsigned sad = block_sad(mi, 0, px, py, best);
+         mi->field[i] = best;
+         mi->sad[i] = sad;
+         band_sad += sad;
+      }
+   }
+   mi->band_sad[index] = band_sad;
+}
+
+static int median9(int *v)
+{
+   for (unsigned i = 1; i < 9; i++)
+   {
+      int tmp = v[i];
+      unsigned j = i;
+      for (; j > 0 && v[j - 1] > tmp; j--)
+         v[j] = v[j - 1];
+      v[j] = tmp;
+   }
+   return v[4];
+}
+
+// 3x3 median removes outliers from the field.
+static void smooth_band(motion_interp_t *mi, unsigned index)
+{
+   unsigned start, end;
+   fine_rows(mi, index, &start, &end);
+
+   int w = mi->blocks_x[0], h = mi->blocks_y[0];
+   for (int by = start; by < (int)end; by++)
+   {
+      for (int bx = 0; bx < w; bx++)
+      {
+         int xs[9], ys[9];
+         unsigned n = 0;
+         for (int dy = -1; dy <= 1; dy++)
+         {
+            for (int dx = -1; dx <= 1; dx++, n++)
+            {
+               const struct mv *v = &mi->field[clamp_int(by + dy, 0, h - 1) * w + clamp_int(bx + dx, 0, w - 1)];
+               xs[n] = v->x;
+               ys[n] = v->y;
+            }
+         }
+
+         struct mv *out = &mi->smooth[by * w + bx];
+         out->x = median9(xs);
+         out->y = median9(ys);
+      }
+   }
+}
+
+static inline uint32_t blend_pixel(uint32_t a, uint32_t b, unsigned w)
+{
+   uint32_t rb = (((a & 0xff00ff) * (256 - w) + (b & 0xff00ff) * w) >> 8) & 0xff00ff;
+   uint32_t g = (((a & 0x00ff00) * (256 - w) + (b & 0x00ff00) * w) >> 8) & 0x00ff00;
+   return rb | g;
+}
+
+static void render_band(motion_interp_t *mi, unsigned index)
+{
+   unsigned start, end;
+   band_range(mi->height, index, mi->threads, &start, &end);
+
+   const uint32_t *prev = mi->frames[0];
+   const uint32_t *next = mi->frames[1];
+   int width = mi->width, height = mi->height;
+   unsigned w = (unsigned)(mi->phase * 256.0f + 0.5f);
+   unsigned span = 2 * MOTION_BLOCK;
+
+   for (int y = start; y < (int)end; y++)
+   {
+      unsigned by = (y / 2) / MOTION_BLOCK;
+      if (by >= mi->blocks_y[0])
+         by = mi->blocks_y[0] - 1;
+
+      uint32_t *out = mi->out + y * width;
+      for (unsigned bx = 0; bx < mi->blocks_x[0]; bx++)
+      {
+         unsigned i = by * mi->blocks_x[0] + bx;
+         int dx = 0, dy = 0;
+         if (mi->sad[i] <= MOTION_BLOCK_FALLBACK * MOTION_BLOCK * MOTION_BLOCK)
+         {
+            dx = 2 * mi->smooth[i].x;
+            dy = 2 * mi->smooth[i].y;
+         }
+
+         // An object at p in prev is at p - d in next, and at p - phase * d in between.
+         int prev_x = (int)lrintf(mi->phase * dx);
+         int prev_y = (int)lrintf(mi->phase * dy);
+         int next_x = prev_x - dx;
+         int next_y = prev_y - dy;
+
+         const uint32_t *prev_row = prev + clamp_int(y + prev_y, 0, height - 1) * width;
+         const uint32_t *next_row = next + clamp_int(y + next_y, 0, height - 1) * width;
+
+         int x0 = bx * span;
+         int x1 = bx + 1 == mi->blocks_x[0] ? width : x0 + (int)span;
+         if (x0 + prev_x >= 0 && x1 + prev_x <= width && x0 + next_x >= 0 && x1 + next_x <= width)
+         {
+            for (int x = x0; x < x1; x++)
+               out[x] = blend_pixel(prev_row[x + prev_x], next_row[x + next_x], w);
+         }
+         else
+         {
+            for (int x = x0; x < x1; x++)
+            {
+               out[x] = blend_pixel(prev_row[clamp_int(x + prev_x, 0, width - 1)],
+                     next_row[clamp_int(x + next_x, 0, width - 1)], w);
+            }
+         }
+      }
+   }
+}
+
+static void motion_worker_thread(void *data)
+{
+   struct motion_worker *worker = (struct motion_worker*)data;
+   motion_interp_t *mi = worker->mi;
+
+   slock_lock(mi->lock);
+   for (;;)
+   {
+      while (mi->generation == worker->generation && !mi->dead)
+         scond_wait(mi->cond, mi->lock);
+      if (mi->dead)
+         break;
+
+      worker->generation = mi->generation;
+      enum motion_job job = mi->job;
+      slock_unlock(mi->lock);
+
+      switch (job)
+      {
+         case MOTION_JOB_DOWNSCALE:
+            downscale_band(mi, worker->index);
+            break;
+         case MOTION_JOB_ESTIMATE:
+            estimate_band(mi, worker->index);
+            break;
+         case MOTION_JOB_SMOOTH:
+            smooth_band(mi, worker->index);
+            break;
+         case MOTION_JOB_RENDER:
+            render_band(mi, worker->index);
+            break;
+      }
+
+      slock_lock(mi->lock);
+      if (--mi->busy == 0)
+         scond_signal(mi->done_cond);
+   }
+   slock_unlock(mi->lock);
+}
+
+// Runs job on every band and waits for all of them.
+static void run_job(motion_interp_t *mi, enum motion_job job)
+{
+   slock_lock(mi->lock);
+   mi->job = job;
+   mi->generation++;
+   mi->busy = mi->threads;
+   scond_broadcast(mi->cond);
+   while (mi->busy)
+      scond_wait(mi->done_cond, mi->lock);
+   slock_unlock(mi->lock);
+}
+
+motion_interp_t *motion_interp_new(unsigned width, unsigned height, unsigned threads)
+{
+   // Needs at least two blocks each way on the coarse level.
+   if (width < 4 * 2 * MOTION_BLOCK || height < 4 * 2 * MOTION_BLOCK)
+      return NULL;
+
+   motion_interp_t *mi = (motion_interp_t*)calloc(1, sizeof(*mi));
+   if (!mi)
+      return NULL;
+
+   mi->width = width;
+   mi->height = height;
+
+   mi->level_width[0] = width / 2;
+   mi->level_height[0] = height / 2;
+   mi->level_width[1] = mi->level_width[0] / 2;
+   mi->level_height[1] = mi->level_height[0] / 2;
+
+   for (unsigned l = 0; l < 2; l++)
+   {
+      mi->blocks_x[l] = mi->level_width[l] / MOTION_BLOCK;
+      mi->blocks_y[l] = mi->level_height[l] / MOTION_BLOCK;
+      for (unsigned f = 0; f < 2; f++)
+      {
+         mi->luma[f][l] = (uint8_t*)malloc(mi->level_width[l] * mi->level_height[l]);
+         if (!mi->luma[f][l])
+            goto error;
+      }
+   }
+
+   unsigned blocks = mi->blocks_x[0] * mi->blocks_y[0];
+   mi->coarse = (struct mv*)calloc(mi->blocks_x[1] * mi->blocks_y[1], sizeof(struct mv));
+   mi->field = (struct mv*)calloc(blocks, sizeof(struct mv));
+   mi->smooth = (struct mv*)calloc(blocks, sizeof(struct mv));
+   mi->history = (struct mv*)calloc(blocks, sizeof(struct mv));
+   mi->sad = (uint16_t*)calloc(blocks, sizeof(uint16_t));
+   if (!mi->coarse || !mi->field || !mi->smooth || !mi->history || !mi->sad)
+      goto error;
+
+   // Every band has to hold at least one coarse block row.
+   if (threads < 1)
+      threads = 1;
+   if (threads > MOTION_MAX_THREADS)
+      threads = MOTION_MAX_THREADS;
+   if (threads > mi->blocks_y[1])
+      threads = mi->blocks_y[1];
+
+   mi->lock = slock_new();
+   mi->cond = scond_new();
+   mi->done_cond = scond_new();
+   if (!mi->lock || !mi->cond || !mi->done_cond)
+      goto error;
+
+   for (unsigned i = 0; i < threads; i++)
+   {
+      mi->workers[i].mi = mi;
+      mi->workers[i].index = i;
+      mi->workers[i].thread = sthread_create(motion_worker_thread, &mi->workers[i]);
+      if (!mi->workers[i].thread)
+         goto error;
+      mi->threads++;
+   }
+
+   return mi;
+
+error:
+   motion_interp_free(mi);
+   return NULL;
+}
+
+void motion_interp_free(motion_interp_t *mi)
+{
+   if (!mi)
+      return;
+
+   if (mi->threads)
+   {
+      slock_lock(mi->lock);
+      mi->dead = true;
+      scond_broadcast(mi->cond);
+      slock_unlock(mi->lock);
+
+      for (unsigned i = 0; i < mi->threads; i++)
+         sthread_join(mi->workers[i].thread);
+   }
+
+   if (mi->lock)
+      slock_free(mi->lock);
+   if (mi->cond)
+      scond_free(mi->cond);
+   if (mi->done_cond)
+      scond_free(mi->done_cond);
+
+   for (unsigned l = 0; l < 2; l++)
+   {
+      free(mi->luma[0][l]);
+      free(mi->luma[1][l]);
+   }
+   free(mi->coarse);
+   free(mi->field);
+   free(mi->smooth);
+   free(mi->history);
+   free(mi->sad);
+   free(mi);
+}
+
+bool motion_interp_set_frames(motion_interp_t *mi, const uint32_t *prev, const uint32_t *next)
+{
+   unsigned blocks = mi->blocks_x[0] * mi->blocks_y[0];
+
+   mi->frames[0] = prev;
+   mi->frames[1] = next;
+   run_job(mi, MOTION_JOB_DOWNSCALE);
+   run_job(mi, MOTION_JOB_ESTIMATE);
+
+   uint64_t total_sad = 0;
+   for (unsigned i = 0; i < mi->threads; i++)
+      total_sad += mi->band_sad[i];
+
+   if (total_sad > (uint64_t)MOTION_SCENE_CUT * MOTION_BLOCK * MOTION_BLOCK * blocks)
+   {
+      // Motion before a cut says nothing about motion after it.
+      memset(mi->history, 0, blocks * sizeof(struct mv));
+      return false;
+   }
+
+   run_job(mi, MOTION_JOB_SMOOTH);
+   memcpy(mi->history, mi->smooth, blocks * sizeof(struct mv));
+   return true;
+}
+
+void motion_interp_render(motion_interp_t *mi, uint32_t *out, float phase)
+{
+   mi->out = out;
+   mi->phase = phase;
+   run_job(mi, MOTION_JOB_RENDER);
+}
@@ -0,0 +1,47 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOTION_INTERP_H__
+#define MOTION_INTERP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Motion-compensated frame interpolation on the CPU.
+// Block motion is estimated on a reduced resolution luma pyramid by a pool of worker threads,
+// and intermediate frames are synthesized by sampling both frames along the motion vectors.
+// Frames are XRGB8888, width * height pixels, tightly packed.
+
+typedef struct motion_interp motion_interp_t;
+
+motion_interp_t *motion_interp_new(unsigned width, unsigned height, unsigned threads);
+void motion_interp_free(motion_interp_t *mi);
+
+// Estimates motion between two consecutive frames. Both must stay valid until the next call.
+// Returns false if they don't look related (e.g. a scene cut), nothing should be interpolated then.
+bool motion_interp_set_frames(motion_interp_t *mi, const uint32_t *prev, const uint32_t *next);
+
+// Synthesizes the frame at phase (0 is prev, 1 is next).
+void motion_interp_render(motion_interp_t *mi, uint32_t *out, float phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,307 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "probe_cache.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define probe_cache_mkdir(dir) _mkdir(dir)
+#else
+#define probe_cache_mkdir(dir) mkdir(dir, 0755)
+#endif
+
+#define PROBE_CACHE_VERSION 2
+// Entries are stored in a fixed set of slots picked by path hash, which bounds the directory.
+// Colliding paths simply replace each other, the stored path tells them apart.
+#define PROBE_CACHE_SLOTS 256
+// Far above any real codec's extradata, just keeps a corrupted entry from allocating wildly.
+#define PROBE_CACHE_MAX_EXTRADATA (1 << 20)
+
+struct probe_cache_header
+{
+   char magic[4];
+   uint32_t version;
+   uint64_t file_size;
+   int64_t file_mtime;
+   uint32_t path_len;
+   uint32_t nb_streams;
+   int64_t duration;
+   int64_t start_time;
+};
+
+struct probe_cache_stream
+{
+   int32_t codec_type;
+   int32_t codec_id;
+   uint32_t codec_tag;
+   int32_t width;
+   int32_t height;
+   int32_t pix_fmt;
+   AVRational sample_aspect_ratio;
+   int32_t sample_rate;
+   int32_t channels;
+   uint64_t channel_layout;
+   int32_t sample_fmt;
+   int32_t block_align;
+   int32_t frame_size;
+   int32_t bits_per_raw_sample;
+   int32_t profile;
+   int32_t level;
+   int64_t bit_rate;
+   int32_t has_b_frames;
+   AVRational codec_time_base;
+   int32_t ticks_per_frame;
+
+   AVRational time_base;
+   AVRational avg_frame_rate;
+   AVRational r_frame_rate;
+   int64_t duration;
+   int64_t start_time;
+
+   uint32_t extradata_size;
+};
+
+static void probe_cache_path(char *out, size_t size, const char *dir, const char *path)
+{
+   // FNV-1a.
+   uint64_t hash = 0xcbf29ce484222325ull;
+   for (const char *c = path; *c; c++)
+   {
+      hash ^= (uint8_t)*c;
+      hash *= 0x100000001b3ull;
+   }
+
+   snprintf(out, size, "%s/ffmpeg_probe_cache/%03u.bin", dir, (unsigned)(hash % PROBE_CACHE_SLOTS));
+}
+
+static bool probe_cache_stat(const char *path, struct probe_cache_header *header)
+{
+   struct stat st;
+   if (stat(path, &st) < 0)
+      return false;
+
+   header->file_size = st.st_size;
+   header->file_mtime = st.st_mtime;
+   return true;
+}
+
+bool probe_cache_load(AVFormatContext *ctx, const char *dir, const char *path)
+{
+   char cache_path[1024];
+   probe_cache_path(cache_path, sizeof(cache_path), dir, path);
+
+   struct probe_cache_header expected, header;
+   if (!probe_cache_stat(path, &expected))
+      return false;
+
+   FILE *file = fopen(cache_path, "rb");
+   if (!file)
+      return false;
+
+   bool ret = false;
+   struct probe_cache_stream *streams = NULL;
+   uint8_t **extradata = NULL;
+   char *cached_path = NULL;
+
+   if (fread(&header, sizeof(header), 1, file) != 1)
+      goto end;
+   if (memcmp(header.magic, "FFPC", 4) || header.version != PROBE_CACHE_VERSION)
+      goto end;
+   if (header.file_size != expected.file_size || header.file_mtime != expected.file_mtime)
+      goto end;
+   if (header.path_len != strlen(path) || header.nb_streams != ctx->nb_streams)
+      goto end;
+
+   cached_path = av_mallocz(header.path_len + 1);
+   if (!cached_path)
+      goto end;
+   if (fread(cached_path, 1, header.path_len, file) != header.path_len || strcmp(cached_path, path))
+      goto end;
+
+   streams = av_mallocz(header.nb_streams * sizeof(*streams));
+   extradata = av_mallocz(header.nb_streams * sizeof(*extradata));
+   if (!streams || !extradata)
+      goto end;
+
+   // Read and validate everything before touching the context.
+   for (unsigned i = 0; i < header.nb_streams; i++)
+   {
+      struct probe_cache_stream *s = &streams[i];
+      if (fread(s, sizeof(*s), 1, file) != 1)
+         goto end;
+
+      AVCodecContext *codec = ctx->streams[i]->codec;
+      if (codec->codec_type != AVMEDIA_TYPE_UNKNOWN && codec->codec_type != s->codec_type)
+         goto end;
+      if (codec->codec_id != AV_CODEC_ID_NONE && codec->codec_id != s->codec_id)
+         goto end;
+
+      if (s->extradata_size > PROBE_CACHE_MAX_EXTRADATA)
+         goto end;
+      if (s->extradata_size)
+      {
+         extradata[i] = av_mallocz(s->extradata_size + FF_INPUT_BUFFER_PADDING_SIZE);
+         if (!extradata[i])
+            goto end;
+         if (fread(extradata[i], 1, s->extradata_size, file) != s->extradata_size)
+            goto end;
+      }
+   }
+
+   for (unsigned i = 0; i < header.nb_streams; i++)
+   {
+      const struct probe_cache_stream *s = &streams[i];
+      AVStream *st = ctx->streams[i];
+      AVCodecContext *codec = st->codec;
+
+      codec->codec_type = s->codec_type;
+      codec->codec_id = s->codec_id;
+      codec->codec_tag = s->codec_tag;
+      codec->width = s->width;
+      codec->height = s->height;
+      codec->pix_fmt = s->pix_fmt;
+      codec->sample_aspect_ratio = s->sample_aspect_ratio;
+      codec->sample_rate = s->sample_rate;
+      codec->channels = s->channels;
+      codec->channel_layout = s->channel_layout;
+      codec->sample_fmt = s->sample_fmt;
+      codec->block_align = s->block_align;
+      codec->frame_size = s->frame_size;
+      codec->bits_per_raw_sample = s->bits_per_raw_sample;
+      codec->profile = s->profile;
+      codec->level = s->level;
+      codec->bit_rate = s->bit_rate;
+      codec->has_b_frames = s->has_b_frames;
+      codec->time_base = s->codec_time_base;
+      codec->ticks_per_frame = s->ticks_per_frame;
+
+      if (!codec->extradata && extradata[i])
+      {
+         codec->extradata = extradata[i];
+         codec->extradata_size = s->extradata_size;
+         extradata[i] = NULL;
+      }
+
+      st->time_base = s->time_base;
+      st->avg_frame_rate = s->avg_frame_rate;
+      st->r_frame_rate = s->r_frame_rate;
+      if (st->duration == AV_NOPTS_VALUE)
+         st->duration = s->duration;
+      if (st->start_time == AV_NOPTS_VALUE)
+         st->start_time = s->start_time;
+   }
+
+   if (ctx->duration == AV_NOPTS_VALUE)
+      ctx->duration = header.duration;
+   if (ctx->start_time == AV_NOPTS_VALUE)
+      ctx->start_time = header.start_time;
+
+   ret = true;
+
+end:
+   if (extradata)
+   {
+      for (unsigned i = 0; i < header.nb_streams; i++)
+         av_freep(&extradata[i]);
+   }
+   av_freep(&extradata);
+   av_freep(&streams);
+   av_freep(&cached_path);
+   fclose(file);
+   return ret;
+}
+
+void probe_cache_save(AVFormatContext *ctx, const char *dir, const char *path, unsigned open_streams)
+{
+   // Demuxers without a header (FLV, ...) can add streams while probing.
+   // Such an entry would never match the freshly opened context, and be rewritten on every load.
+   if (open_streams != ctx->nb_streams)
+      return;
+
+   struct probe_cache_header header;
+   memset(&header, 0, sizeof(header));
+   if (!probe_cache_stat(path, &header))
+      return;
+
+   char cache_path[1024];
+   snprintf(cache_path, sizeof(cache_path), "%s/ffmpeg_probe_cache", dir);
+   probe_cache_mkdir(cache_path);
+   probe_cache_path(cache_path, sizeof(cache_path), dir, path);
+
+   FILE *file = fopen(cache_path, "wb");
+   if (!file)
+      return;
+
+   memcpy(header.magic, "FFPC", 4);
+   header.version = PROBE_CACHE_VERSION;
+   header.path_len = strlen(path);
+   header.nb_streams = ctx->nb_streams;
+   header.duration = ctx->duration;
+   header.start_time = ctx->start_time;
+
+   bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(path, 1, header.path_len, file) == header.path_len;
+
+   for (unsigned i = 0; ok && i < ctx->nb_streams; i++)
+   {
+      const AVStream *st = ctx->streams[i];
+      const AVCodecContext *codec = st->codec;
+
+      struct probe_cache_stream s;
+      memset(&s, 0, sizeof(s));
+      s.codec_type = codec->codec_type;
+      s.codec_id = codec->codec_id;
+      s.codec_tag = codec->codec_tag;
+      s.width = codec->width;
+      s.height = codec->height;
+      s.pix_fmt = codec->pix_fmt;
+      s.sample_aspect_ratio = codec->sample_aspect_ratio;
+      s.sample_rate = codec->sample_rate;
+      s.channels = codec->channels;
+      s.channel_layout = codec->channel_layout;
+      s.sample_fmt = codec->sample_fmt;
+      s.block_align = codec->block_align;
+      s.frame_size = codec->frame_size;
+      s.bits_per_raw_sample = codec->bits_per_raw_sample;
+      s.profile = codec->profile;
+      s.level = codec->level;
+      s.bit_rate = codec->bit_rate;
+      s.has_b_frames = codec->has_b_frames;
+      s.codec_time_base = codec->time_base;
+      s.ticks_per_frame = codec->ticks_per_frame;
+      s.time_base = st->time_base;
+      s.avg_frame_rate = st->avg_frame_rate;
+      s.r_frame_rate = st->r_frame_rate;
+      s.duration = st->duration;
+      s.start_time = st->start_time;
+      s.extradata_size = codec->extradata ? codec->extradata_size : 0;
+
+      ok = fwrite(&s, sizeof(s), 1, file) == 1 &&
+         (!s.extradata_size || fwrite(codec->extradata, 1, s.extradata_size, file) == s.extradata_size);
+   }
+
+   fclose(file);
+
+   // Never leave a truncated entry behind.
+   if (!ok)
+      remove(cache_path);
+}
+
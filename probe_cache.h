@@ -0,0 +1,36 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROBE_CACHE_H__
+#define PROBE_CACHE_H__
+
+#include <stdbool.h>
+#include <libavformat/avformat.h>
+
+// Persistent cache of avformat_find_stream_info() results.
+// Entries live in dir, at most one file per hash slot, and are invalidated when
+// the media file's size or modification time changes.
+// Headerless formats are cached as long as the demuxer finds all streams while opening,
+// like MPEG-TS does from the PMT.
+
+// Fills in codec parameters of an opened (but not probed) context.
+// Returns false if there is no valid entry, or it does not match the streams the demuxer found.
+bool probe_cache_load(AVFormatContext *ctx, const char *dir, const char *path);
+
+// open_streams is the stream count right after avformat_open_input().
+void probe_cache_save(AVFormatContext *ctx, const char *dir, const char *path, unsigned open_streams);
+
+#endif
+
@@ -0,0 +1,338 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WIN32
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include "readahead.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#define READAHEAD_CHUNK (256 * 1024)
+
+#ifdef _WIN32
+
+readahead_t *readahead_new(const char *path, size_t window)
+{
+   (void)path;
+   (void)window;
+   return NULL;
+}
+
+void readahead_free(readahead_t *ra)
+{
+   (void)ra;
+}
+
+int readahead_read(readahead_t *ra, uint8_t *buf, int size)
+{
+   (void)ra;
+   (void)buf;
+   (void)size;
+   return -1;
+}
+
+int64_t readahead_seek(readahead_t *ra, int64_t offset, int whence)
+{
+   (void)ra;
+   (void)offset;
+   (void)whence;
+   return -1;
+}
+
+int64_t readahead_size(readahead_t *ra)
+{
+   (void)ra;
+   return -1;
+}
+
+#else
+
+struct readahead
+{
+   int fd;
+   int64_t file_size;
+
+   // Ring covers file range [ring_start, ring_end).
+   // Byte at file offset N lives at ring[N % ring_size].
+   uint8_t *ring;
+   size_t ring_size;
+   int64_t ring_start;
+   int64_t ring_end;
+   int64_t pos;
+
+   // Bumped on every discontinuous seek so in-flight reads are discarded.
+   unsigned generation;
+   bool eof;
+   bool error;
+   bool dead;
+
+   uint8_t *chunk;
+   size_t chunk_size;
+
+   slock_t *lock;
+   scond_t *cond;
+   scond_t *fill_cond;
+   sthread_t *thread;
+};
+
+static void readahead_advise(readahead_t *ra, int64_t offset)
+{
+#ifdef POSIX_FADV_WILLNEED
+   posix_fadvise(ra->fd, offset, ra->ring_size, POSIX_FADV_WILLNEED);
+#else
+   (void)ra;
+   (void)offset;
+#endif
+}
+
+// Keep a quarter of the ring behind the read position for short backwards seeks.
+static bool readahead_wants_fill(readahead_t *ra)
+{
+   return !ra->eof && !ra->error &&
+      ra->ring_end - ra->pos + (int64_t)ra->chunk_size <= (int64_t)(ra->ring_size - ra->ring_size / 4);
+}
+
+static void readahead_ring_write(readahead_t *ra, const uint8_t *data, size_t size)
+{
+   size_t offset = ra->ring_end % ra->ring_size;
+   size_t first_write = size;
+   if (offset + size > ra->ring_size)
+      first_write = ra->ring_size - offset;
+
+   memcpy(ra->ring + offset, data, first_write);
+   memcpy(ra->ring, data + first_write, size - first_write);
+
+   ra->ring_end += size;
+   if (ra->ring_end - ra->ring_start > (int64_t)ra->ring_size)
+      ra->ring_start = ra->ring_end - ra->ring_size;
+}
+
+static void readahead_ring_read(readahead_t *ra, uint8_t *data, size_t size)
+{
+   size_t offset = ra->pos % ra->ring_size;
+   size_t first_read = size;
+   if (offset + size > ra->ring_size)
+      first_read = ra->ring_size - offset;
+
+   memcpy(data, ra->ring + offset, first_read);
+   memcpy(data + first_read, ra->ring, size - first_read);
+
+   ra->pos += size;
+}
+
+static void readahead_thread(void *data)
+{
+   readahead_t *ra = (readahead_t*)data;
+
+   slock_lock(ra->lock);
+   while (!ra->dead)
+   {
+      if (!readahead_wants_fill(ra))
+      {
+         scond_wait(ra->fill_cond, ra->lock);
+         continue;
+      }
+
+      int64_t offset = ra->ring_end;
+      unsigned generation = ra->generation;
+
+      // Hint the kernel about the next window so it can start fetching beyond what we hold.
+      if (offset % ra->ring_size < ra->chunk_size)
+         readahead_advise(ra, offset + ra->ring_size);
+
+      slock_unlock(ra->lock);
+      ssize_t ret = pread(ra->fd, ra->chunk, ra->chunk_size, offset);
+      slock_lock(ra->lock);
+
+      if (generation != ra->generation)
+         continue;
+
+      if (ret < 0)
+         ra->error = true;
+      else if (ret == 0)
+         ra->eof = true;
+      else
+         readahead_ring_write(ra, ra->chunk, ret);
+
+      scond_signal(ra->cond);
+   }
+   slock_unlock(ra->lock);
+}
+
+readahead_t *readahead_new(const char *path, size_t window)
+{
+   if (window < 4 * READAHEAD_CHUNK)
+      window = 4 * READAHEAD_CHUNK;
+
+   readahead_t *ra = (readahead_t*)calloc(1, sizeof(*ra));
+   if (!ra)
+      return NULL;
+
+   ra->fd = open(path, O_RDONLY);
+   if (ra->fd < 0)
+   {
+      free(ra);
+      return NULL;
+   }
+
+   struct stat st;
+   if (fstat(ra->fd, &st) < 0 || !S_ISREG(st.st_mode))
+      goto error;
+   ra->file_size = st.st_size;
+
+   ra->ring_size = window;
+   ra->chunk_size = READAHEAD_CHUNK;
+   ra->ring = (uint8_t*)malloc(ra->ring_size);
+   ra->chunk = (uint8_t*)malloc(ra->chunk_size);
+   ra->lock = slock_new();
+   ra->cond = scond_new();
+   ra->fill_cond = scond_new();
+   if (!ra->ring || !ra->chunk || !ra->lock || !ra->cond || !ra->fill_cond)
+      goto error;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+   posix_fadvise(ra->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+   readahead_advise(ra, 0);
+
+   ra->thread = sthread_create(readahead_thread, ra);
+   if (!ra->thread)
+      goto error;
+
+   return ra;
+
+error:
+   readahead_free(ra);
+   return NULL;
+}
+
+void readahead_free(readahead_t *ra)
+{
+   if (!ra)
+      return;
+
+   if (ra->thread)
+   {
+      slock_lock(ra->lock);
+      ra->dead = true;
+      scond_signal(ra->fill_cond);
+      slock_unlock(ra->lock);
+      sthread_join(ra->thread);
+   }
+
+   if (ra->lock)
+      slock_free(ra->lock);
+   if (ra->cond)
+      scond_free(ra->cond);
+   if (ra->fill_cond)
+      scond_free(ra->fill_cond);
+
+   if (ra->fd >= 0)
+      close(ra->fd);
+
+   free(ra->ring);
+   free(ra->chunk);
+   free(ra);
+}
+
+int readahead_read(readahead_t *ra, uint8_t *buf, int size)
+{
+   slock_lock(ra->lock);
+   while (ra->pos >= ra->ring_end && !ra->eof && !ra->error)
+   {
+      scond_signal(ra->fill_cond);
+      scond_wait(ra->cond, ra->lock);
+   }
+
+   int ret;
+   int64_t avail = ra->ring_end - ra->pos;
+   if (avail > 0)
+   {
+      if (avail > size)
+         avail = size;
+      readahead_ring_read(ra, buf, avail);
+      ret = avail;
+   }
+   else
+      ret = ra->error ? -1 : 0;
+
+   scond_signal(ra->fill_cond);
+   slock_unlock(ra->lock);
+   return ret;
+}
+
+int64_t readahead_seek(readahead_t *ra, int64_t offset, int whence)
+{
+   slock_lock(ra->lock);
+
+   int64_t target;
+   switch (whence)
+   {
+      case SEEK_SET:
+         target = offset;
+         break;
+      case SEEK_CUR:
+         target = ra->pos + offset;
+         break;
+      case SEEK_END:
+         target = ra->file_size + offset;
+         break;
+      default:
+         slock_unlock(ra->lock);
+         return -1;
+   }
+
+   if (target < 0)
+   {
+      slock_unlock(ra->lock);
+      return -1;
+   }
+
+   if (target < ra->ring_start || target > ra->ring_end)
+   {
+      // Outside the resident window, restart read-ahead around the new position.
+      ra->generation++;
+      ra->ring_start = ra->ring_end = target;
+      ra->eof = false;
+      ra->error = false;
+      readahead_advise(ra, target);
+   }
+
+   ra->pos = target;
+   scond_signal(ra->fill_cond);
+   slock_unlock(ra->lock);
+   return target;
+}
+
+int64_t readahead_size(readahead_t *ra)
+{
+   return ra->file_size;
+}
+
+#endif
+
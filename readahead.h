@@ -0,0 +1,49 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef READAHEAD_H__
+#define READAHEAD_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Background read-ahead of a local file.
+// A worker thread keeps a window of bytes following the current read position
+// resident in a ring buffer, so reads from the demuxer rarely touch the disk (or network mount).
+
+typedef struct readahead readahead_t;
+
+// Returns NULL if the file cannot be opened or read-ahead is not supported on this platform.
+readahead_t *readahead_new(const char *path, size_t window);
+void readahead_free(readahead_t *ra);
+
+// Blocks until at least one byte is available. Returns 0 on EOF, -1 on error.
+int readahead_read(readahead_t *ra, uint8_t *buf, int size);
+
+// whence is SEEK_SET, SEEK_CUR or SEEK_END. Seeking outside the resident window
+// restarts read-ahead at the new position immediately.
+int64_t readahead_seek(readahead_t *ra, int64_t offset, int whence);
+int64_t readahead_size(readahead_t *ra);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,541 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tonemap.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <libavutil/cpu.h>
+#include <libavutil/pixfmt.h>
+
+// AVX2 is picked at runtime, the rest of the file is built for the baseline.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TONEMAP_AVX2 1
+#define TONEMAP_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+// Both LUTs are indexed by a value in [0, 1] quantized to this many steps.
+#define TONEMAP_LUT_SIZE 4096
+#define TONEMAP_MAX_THREADS 16
+
+// Mastering metadata isn't exposed through the decoding API in use,
+// so assume the common 1000 nits grade, which is also the HLG nominal peak.
+#define TONEMAP_SOURCE_PEAK 1000.0
+// HDR reference white (BT.2408) ends up at SDR peak.
+#define TONEMAP_TARGET_PEAK 203.0
+// HLG OOTF gamma for a 1000 nits display, applied per channel.
+#define TONEMAP_HLG_GAMMA 1.2
+
+// SMPTE ST 2084 constants.
+#define PQ_M1 (2610.0 / 16384.0)
+#define PQ_M2 (2523.0 / 4096.0 * 128.0)
+#define PQ_C1 (3424.0 / 4096.0)
+#define PQ_C2 (2413.0 / 4096.0 * 32.0)
+#define PQ_C3 (2392.0 / 4096.0 * 32.0)
+
+// ARIB STD-B67 constants.
+#define HLG_A 0.17883277
+#define HLG_B 0.28466892
+#define HLG_C 0.55991073
+
+enum tonemap_transfer
+{
+   TONEMAP_TRANSFER_NONE = 0,
+   TONEMAP_TRANSFER_PQ,
+   TONEMAP_TRANSFER_HLG
+};
+
+struct tonemap_params
+{
+   // Y'CbCr to R'G'B' on raw 10-bit codes.
+   float y_mul, y_add;
+   float c_mul, c_add;
+   float cr_r, cb_g, cr_g, cb_b;
+   // Linear light primaries conversion, row major.
+   float gamut[9];
+};
+
+// Source pointers of one picture row.
+struct tonemap_row
+{
+   const uint16_t *y;
+   const uint16_t *u;
+   const uint16_t *v;
+   // P010 stores samples in the high bits and interleaves chroma.
+   unsigned shift;
+   unsigned chroma_step;
+};
+
+struct tonemap_worker
+{
+   tonemap_t *tm;
+   unsigned index;
+   // Last job generation this worker has seen.
+   unsigned generation;
+   sthread_t *thread;
+};
+
+struct tonemap
+{
+   // Code value to tone mapped linear light, 1.0 being SDR peak.
+   float lut_linear[TONEMAP_LUT_SIZE];
+   // Square root of linear light to 8-bit sRGB.
+   int32_t lut_encode[TONEMAP_LUT_SIZE];
+   enum tonemap_transfer transfer;
+   bool avx2;
+
+   // Job parameters.
+   struct tonemap_params params;
+   const AVFrame *frame;
+   uint8_t *dst;
+   unsigned stride;
+
+   struct tonemap_worker workers[TONEMAP_MAX_THREADS];
+   unsigned threads;
+   unsigned generation;
+   unsigned busy;
+   bool dead;
+
+   slock_t *lock;
+   scond_t *cond;
+   scond_t *done_cond;
+};
+
+static double pq_eotf(double e)
+{
+   double p = pow(e, 1.0 / PQ_M2);
+   double num = p - PQ_C1;
+   if (num < 0.0)
+      num = 0.0;
+   return 10000.0 * pow(num / (PQ_C2 - PQ_C3 * p), 1.0 / PQ_M1);
+}
+
+static double pq_inverse_eotf(double nits)
+{
+   double y = pow(nits / 10000.0, PQ_M1);
+   return pow((PQ_C1 + PQ_C2 * y) / (1.0 + PQ_C3 * y), PQ_M2);
+}
+
+static double hlg_inverse_oetf(double e)
+{
+   if (e <= 0.5)
+      return e * e / 3.0;
+   return (exp((e - HLG_C) / HLG_A) + HLG_B) / 12.0;
+}
+
+// BT.2390 EETF, rolls off highlights in PQ space and leaves everything below the knee alone.
+static double bt2390_eetf(double nits)
+{
+   double source = pq_inverse_eotf(TONEMAP_SOURCE_PEAK);
+   double max_lum = pq_inverse_eotf(TONEMAP_TARGET_PEAK) / source;
+   double knee = 1.5 * max_lum - 0.5;
+
+   double e = pq_inverse_eotf(nits) / source;
+   if (e > 1.0)
+      e = 1.0;
+
+   if (e > knee)
+   {
+      double t = (e - knee) / (1.0 - knee);
+      double t2 = t * t;
+      double t3 = t2 * t;
+      e = (2.0 * t3 - 3.0 * t2 + 1.0) * knee +
+         (t3 - 2.0 * t2 + t) * (1.0 - knee) +
+         (-2.0 * t3 + 3.0 * t2) * max_lum;
+   }
+
+   return pq_eotf(e * source);
+}
+
+static double srgb_encode(double c)
+{
+   if (c <= 0.0031308)
+      return 12.92 * c;
+   return 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+}
+
+static void build_linear_lut(tonemap_t *tm, enum tonemap_transfer transfer)
+{
+   for (unsigned i = 0; i < TONEMAP_LUT_SIZE; i++)
+   {
+      double e = (double)i / (TONEMAP_LUT_SIZE - 1);
+      double nits;
+      if (transfer == TONEMAP_TRANSFER_HLG)
+         nits = TONEMAP_SOURCE_PEAK * pow(hlg_inverse_oetf(e), TONEMAP_HLG_GAMMA);
+      else
+         nits = pq_eotf(e);
+
+      double linear = bt2390_eetf(nits) / TONEMAP_TARGET_PEAK;
+      tm->lut_linear[i] = linear > 1.0 ? 1.0f : (float)linear;
+   }
+   tm->transfer = transfer;
+}
+
+// Indexed by the square root, so dark values get most of the precision.
+static void build_encode_lut(tonemap_t *tm)
+{
+   for (unsigned i = 0; i < TONEMAP_LUT_SIZE; i++)
+   {
+      double c = (double)i / (TONEMAP_LUT_SIZE - 1);
+      tm->lut_encode[i] = (int32_t)(255.0 * srgb_encode(c * c) + 0.5);
+   }
+}
+
+static void setup_params(tonemap_t *tm, const AVFrame *frame)
+{
+   struct tonemap_params *p = &tm->params;
+
+   float kr = 0.2627f, kb = 0.0593f;
+   if (av_frame_get_colorspace(frame) == AVCOL_SPC_BT709)
+   {
+      kr = 0.2126f;
+      kb = 0.0722f;
+   }
+   float kg = 1.0f - kr - kb;
+
+   if (av_frame_get_color_range(frame) == AVCOL_RANGE_JPEG)
+   {
+      p->y_mul = 1.0f / 1023.0f;
+      p->y_add = 0.0f;
+      p->c_mul = 1.0f / 1023.0f;
+   }
+   else
+   {
+      p->y_mul = 1.0f / 876.0f;
+      p->y_add = -64.0f / 876.0f;
+      p->c_mul = 1.0f / 896.0f;
+   }
+   p->c_add = -512.0f * p->c_mul;
+
+   p->cr_r = 2.0f * (1.0f - kr);
+   p->cb_g = -2.0f * kb * (1.0f - kb) / kg;
+   p->cr_g = -2.0f * kr * (1.0f - kr) / kg;
+   p->cb_b = 2.0f * (1.0f - kb);
+
+   static const float bt2020_to_bt709[9] = {
+       1.6604910f, -0.5876411f, -0.0728499f,
+      -0.1245505f,  1.1328999f, -0.0083494f,
+      -0.0181508f, -0.1005789f,  1.1187297f,
+   };
+   static const float identity[9] = {
+      1.0f, 0.0f, 0.0f,
+      0.0f, 1.0f, 0.0f,
+      0.0f, 0.0f, 1.0f,
+   };
+   memcpy(p->gamut, frame->color_primaries == AVCOL_PRI_BT709 ? identity : bt2020_to_bt709,
+         sizeof(p->gamut));
+}
+
+static inline unsigned lut_index(float v)
+{
+   if (v <= 0.0f)
+      return 0;
+   if (v >= 1.0f)
+      return TONEMAP_LUT_SIZE - 1;
+   return (unsigned)(v * (TONEMAP_LUT_SIZE - 1) + 0.5f);
+}
+
+static inline uint32_t convert_pixel(const tonemap_t *tm, unsigned y, unsigned cb, unsigned cr)
+{
+   const struct tonemap_params *p = &tm->params;
+
+   float luma = y * p->y_mul + p->y_add;
+   float u = cb * p->c_mul + p->c_add;
+   float v = cr * p->c_mul + p->c_add;
+
+   float lin[3] = {
+      tm->lut_linear[lut_index(luma + p->cr_r * v)],
+      tm->lut_linear[lut_index(luma + p->cb_g * u + p->cr_g * v)],
+      tm->lut_linear[lut_index(luma + p->cb_b * u)],
+   };
+
+   uint32_t out = 0;
+   for (unsigned i = 0; i < 3; i++)
+   {
+      const float *m = &p->gamut[3 * i];
+      float c = m[0] * lin[0] + m[1] * lin[1] + m[2] * lin[2];
+      if (c < 0.0f)
+         c = 0.0f;
+      out |= (uint32_t)tm->lut_encode[lut_index(sqrtf(c))] << (16 - 8 * i);
+   }
+   return out;
+}
+
+static void convert_row_c(const tonemap_t *tm, const struct tonemap_row *row,
+      uint32_t *dst, unsigned start, unsigned width)
+{
+   for (unsigned x = start; x < width; x++)
+   {
+      unsigned c = (x >> 1) * row->chroma_step;
+      dst[x] = convert_pixel(tm, row->y[x] >> row->shift,
+            row->u[c] >> row->shift, row->v[c] >> row->shift);
+   }
+}
+
+#ifdef TONEMAP_AVX2
+TONEMAP_AVX2_TARGET
+static inline __m256i lut_index_avx2(__m256 v)
+{
+   v = _mm256_max_ps(_mm256_min_ps(v, _mm256_set1_ps(1.0f)), _mm256_setzero_ps());
+   return _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v,
+               _mm256_set1_ps(TONEMAP_LUT_SIZE - 1)), _mm256_set1_ps(0.5f)));
+}
+
+TONEMAP_AVX2_TARGET
+static inline __m256i encode_avx2(const tonemap_t *tm, const float *m, __m256 r, __m256 g, __m256 b)
+{
+   __m256 c = _mm256_add_ps(_mm256_add_ps(
+            _mm256_mul_ps(_mm256_set1_ps(m[0]), r),
+            _mm256_mul_ps(_mm256_set1_ps(m[1]), g)),
+         _mm256_mul_ps(_mm256_set1_ps(m[2]), b));
+   c = _mm256_sqrt_ps(_mm256_max_ps(c, _mm256_setzero_ps()));
+   return _mm256_i32gather_epi32(tm->lut_encode, lut_index_avx2(c), 4);
+}
+
+// Eight pixels at a time, both LUT lookups are gathers. Returns the number of pixels done.
+TONEMAP_AVX2_TARGET
+static unsigned convert_row_avx2(const tonemap_t *tm, const struct tonemap_row *row,
+      uint32_t *dst, unsigned width)
+{
+   const struct tonemap_params *p = &tm->params;
+   const __m128i shift = _mm_cvtsi32_si128(row->shift);
+   const __m256 y_mul = _mm256_set1_ps(p->y_mul);
+   const __m256 y_add = _mm256_set1_ps(p->y_add);
+   const __m256 c_mul = _mm256_set1_ps(p->c_mul);
+   const __m256 c_add = _mm256_set1_ps(p->c_add);
+
+   unsigned x;
+   for (x = 0; x + 8 <= width; x += 8)
+   {
+      __m256i y = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row->y + x)));
+      __m256i u, v;
+      if (row->chroma_step == 2)
+      {
+         // U0 V0 U1 V1 | U2 V2 U3 V3, duplicated horizontally.
+         __m256i uv = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(row->u + x)));
+         u = _mm256_shuffle_epi32(uv, _MM_SHUFFLE(2, 2, 0, 0));
+         v = _mm256_shuffle_epi32(uv, _MM_SHUFFLE(3, 3, 1, 1));
+      }
+      else
+      {
+         __m128i u4 = _mm_loadl_epi64((const __m128i*)(row->u + x / 2));
+         __m128i v4 = _mm_loadl_epi64((const __m128i*)(row->v + x / 2));
+         u = _mm256_cvtepu16_epi32(_mm_unpacklo_epi16(u4, u4));
+         v = _mm256_cvtepu16_epi32(_mm_unpacklo_epi16(v4, v4));
+      }
+
+      __m256 luma = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srl_epi32(y, shift)), y_mul), y_add);
+      __m256 cb = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srl_epi32(u, shift)), c_mul), c_add);
+      __m256 cr = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srl_epi32(v, shift)), c_mul), c_add);
+
+      __m256 r = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(p->cr_r), cr));
+      __m256 g = _mm256_add_ps(_mm256_add_ps(luma,
+               _mm256_mul_ps(_mm256_set1_ps(p->cb_g), cb)),
+            _mm256_mul_ps(_mm256_set1_ps(p->cr_g), cr));
+      __m256 b = _mm256_add_ps(luma, _mm256_mul_ps(_mm256_set1_ps(p->cb_b), cb));
+
+      r = _mm256_i32gather_ps(tm->lut_linear, lut_index_avx2(r), 4);
+      g = _mm256_i32gather_ps(tm->lut_linear, lut_index_avx2(g), 4);
+      b = _mm256_i32gather_ps(tm->lut_linear, lut_index_avx2(b), 4);
+
+      __m256i out = _mm256_or_si256(_mm256_or_si256(
+               _mm256_slli_epi32(encode_avx2(tm, &p->gamut[0], r, g, b), 16),
+               _mm256_slli_epi32(encode_avx2(tm, &p->gamut[3], r, g, b), 8)),
+            encode_avx2(tm, &p->gamut[6], r, g, b));
+      _mm256_storeu_si256((__m256i*)(dst + x), out);
+   }
+
+   return x;
+}
+#endif
+
+static void convert_band(tonemap_t *tm, unsigned index)
+{
+   const AVFrame *frame = tm->frame;
+   unsigned start = frame->height * index / tm->threads;
+   unsigned end = frame->height * (index + 1) / tm->threads;
+#ifdef TONEMAP_HAVE_P010
+   bool semiplanar = frame->format == AV_PIX_FMT_P010LE;
+#else
+   bool semiplanar = false;
+#endif
+
+   for (unsigned y = start; y < end; y++)
+   {
+      struct tonemap_row row;
+      row.y = (const uint16_t*)(frame->data[0] + y * frame->linesize[0]);
+      row.u = (const uint16_t*)(frame->data[1] + (y >> 1) * frame->linesize[1]);
+      if (semiplanar)
+      {
+         row.v = row.u + 1;
+         row.shift = 6;
+         row.chroma_step = 2;
+      }
+      else
+      {
+         row.v = (const uint16_t*)(frame->data[2] + (y >> 1) * frame->linesize[2]);
+         row.shift = 0;
+         row.chroma_step = 1;
+      }
+
+      uint32_t *dst = (uint32_t*)(tm->dst + y * tm->stride);
+      unsigned done = 0;
+#ifdef TONEMAP_AVX2
+      if (tm->avx2)
+         done = convert_row_avx2(tm, &row, dst, frame->width);
+#endif
+      convert_row_c(tm, &row, dst, done, frame->width);
+   }
+}
+
+static void tonemap_worker_thread(void *data)
+{
+   struct tonemap_worker *worker = (struct tonemap_worker*)data;
+   tonemap_t *tm = worker->tm;
+
+   slock_lock(tm->lock);
+   for (;;)
+   {
+      while (tm->generation == worker->generation && !tm->dead)
+         scond_wait(tm->cond, tm->lock);
+      if (tm->dead)
+         break;
+
+      worker->generation = tm->generation;
+      slock_unlock(tm->lock);
+
+      convert_band(tm, worker->index);
+
+      slock_lock(tm->lock);
+      if (--tm->busy == 0)
+         scond_signal(tm->done_cond);
+   }
+   slock_unlock(tm->lock);
+}
+
+bool tonemap_supported(const AVFrame *frame)
+{
+#ifdef TONEMAP_HAVE_P010
+   if (frame->format != AV_PIX_FMT_YUV420P10LE && frame->format != AV_PIX_FMT_P010LE)
+      return false;
+#else
+   if (frame->format != AV_PIX_FMT_YUV420P10LE)
+      return false;
+#endif
+#ifdef TONEMAP_HAVE_HLG
+   if (frame->color_trc != AVCOL_TRC_SMPTEST2084 && frame->color_trc != AVCOL_TRC_ARIB_STD_B67)
+      return false;
+#else
+   if (frame->color_trc != AVCOL_TRC_SMPTEST2084)
+      return false;
+#endif
+
+   // Some muxers leave out the primaries of BT.2020 content.
+   return frame->color_primaries == AVCOL_PRI_BT2020 ||
+      frame->color_primaries == AVCOL_PRI_BT709 ||
+      frame->color_primaries == AVCOL_PRI_UNSPECIFIED;
+}
+
+tonemap_t *tonemap_new(unsigned threads)
+{
+   tonemap_t *tm = (tonemap_t*)calloc(1, sizeof(*tm));
+   if (!tm)
+      return NULL;
+
+   build_encode_lut(tm);
+#ifdef TONEMAP_AVX2
+   tm->avx2 = av_get_cpu_flags() & AV_CPU_FLAG_AVX2;
+#endif
+
+   if (threads < 1)
+      threads = 1;
+   if (threads > TONEMAP_MAX_THREADS)
+      threads = TONEMAP_MAX_THREADS;
+
+   tm->lock = slock_new();
+   tm->cond = scond_new();
+   tm->done_cond = scond_new();
+   if (!tm->lock || !tm->cond || !tm->done_cond)
+      goto error;
+
+   for (unsigned i = 0; i < threads; i++)
+   {
+      tm->workers[i].tm = tm;
+      tm->workers[i].index = i;
+      tm->workers[i].thread = sthread_create(tonemap_worker_thread, &tm->workers[i]);
+      if (!tm->workers[i].thread)
+         goto error;
+      tm->threads++;
+   }
+
+   return tm;
+
+error:
+   tonemap_free(tm);
+   return NULL;
+}
+
+void tonemap_free(tonemap_t *tm)
+{
+   if (!tm)
+      return;
+
+   if (tm->threads)
+   {
+      slock_lock(tm->lock);
+      tm->dead = true;
+      scond_broadcast(tm->cond);
+      slock_unlock(tm->lock);
+
+      for (unsigned i = 0; i < tm->threads; i++)
+         sthread_join(tm->workers[i].thread);
+   }
+
+   if (tm->lock)
+      slock_free(tm->lock);
+   if (tm->cond)
+      scond_free(tm->cond);
+   if (tm->done_cond)
+      scond_free(tm->done_cond);
+   free(tm);
+}
+
+void tonemap_convert(tonemap_t *tm, const AVFrame *frame, uint32_t *dst, unsigned stride)
+{
+#ifdef TONEMAP_HAVE_HLG
+   enum tonemap_transfer transfer = frame->color_trc == AVCOL_TRC_ARIB_STD_B67 ?
+      TONEMAP_TRANSFER_HLG : TONEMAP_TRANSFER_PQ;
+#else
+   enum tonemap_transfer transfer = TONEMAP_TRANSFER_PQ;
+#endif
+   if (transfer != tm->transfer)
+      build_linear_lut(tm, transfer);
+
+   setup_params(tm, frame);
+   tm->frame = frame;
+   tm->dst = (uint8_t*)dst;
+   tm->stride = stride;
+
+   slock_lock(tm->lock);
+   tm->generation++;
+   tm->busy = tm->threads;
+   scond_broadcast(tm->cond);
+   while (tm->busy)
+      scond_wait(tm->done_cond, tm->lock);
+   slock_unlock(tm->lock);
+}
@@ -0,0 +1,56 @@
+/*  RetroArch - A frontend for libretro.
+ *  Copyright (C) 2010-2014 - Hans-Kristian Arntzen
+ *
+ *  RetroArch is free software: you can redistribute it and/or modify it under the terms
+ *  of the GNU General Public License as published by the Free Software Found-
+ *  ation, either version 3 of the License, or (at your option) any later version.
+ *
+ *  RetroArch is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ *  without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+ *  PURPOSE.  See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with RetroArch.
+ *  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TONEMAP_H__
+#define TONEMAP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libavutil/frame.h>
+#include <libavutil/version.h>
+
+// P010 is a macro wherever libavutil has it.
+#ifdef AV_PIX_FMT_P010
+#define TONEMAP_HAVE_P010 1
+#endif
+
+// ARIB STD-B67 (HLG) is not, so gate it on FFmpeg 3.0.
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(55, 17, 103)
+#define TONEMAP_HAVE_HLG 1
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HDR10 and HLG to SDR conversion for 10-bit 4:2:0 video.
+// Replaces swscale for these, which neither tone maps nor converts gamut,
+// and is slow on high bit depth input. Rows are split into bands over a pool of worker threads.
+typedef struct tonemap tonemap_t;
+
+// True if frame is 10-bit PQ or HLG content which should go through tonemap_convert().
+bool tonemap_supported(const AVFrame *frame);
+
+tonemap_t *tonemap_new(unsigned threads);
+void tonemap_free(tonemap_t *tm);
+
+// Converts frame to XRGB8888 at its own size. stride is in bytes.
+void tonemap_convert(tonemap_t *tm, const AVFrame *frame, uint32_t *dst, unsigned stride);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif